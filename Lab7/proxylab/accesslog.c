@@ -0,0 +1,362 @@
+/*
+ * accesslog.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * The access log of -l, one line per request answered:
+ *
+ * 2024-03-01T12:00:00.123Z 10.0.0.7 GET http://host/path 200 5120
+ *     hit 412
+ *
+ * the time it was answered, the client, the request, the status
+ * (- if unknown), the bytes sent, how it was answered (hit,
+ * joined, fetched, failed, local or cut) and the microseconds it
+ * took.
+ *
+ * Workers never write the file, nor take a lock, nor wait. Each
+ * thread puts fixed-size records into a ring of its own, with
+ * ACCESSLOG_RING slots, of which it moves the head and the
+ * writer thread the tail: a single producer and a single
+ * consumer, so the two indices, stored with release and loaded
+ * with acquire, are all the synchronization needed. When a ring
+ * is full the record is dropped and counted instead.
+ *
+ * The writer wakes every ACCESSLOG_FLUSH_MS, or sooner when a
+ * ring passes half full, and formats what every ring holds into
+ * a batch of lines, appended with writev(). The records of a
+ * ring are in the order they were answered, so the rings are
+ * merged by time, the oldest record first, and a batch reads in
+ * order across threads. A record answered while a batch is
+ * being formatted may still come in the next one, a little out
+ * of order. The batch is formatted holding the lock on the list
+ * of rings, into BATCH_IOV pieces of lines that are only written
+ * once it is released, so threads starting, exiting or asking
+ * for statistics never wait for the file. Rings of threads that
+ * exited are freed once drained. Records not yet written when
+ * the proxy is killed are lost.
+ */
+
+#include "csapp.h"
+#include "accesslog.h"
+#include "request.h"
+
+#define LINE_MAX_LEN 512	/* bytes of a formatted record, at most */
+#define BATCH_IOV    16		/* pieces of one writev */
+#define PIECE_LEN    (ACCESSLOG_BATCH / BATCH_IOV)
+
+/* One answered request */
+typedef struct
+{
+	uint64_t time_us;		/* wall clock when it was answered */
+	uint64_t ns;			/* it took */
+	unsigned long bytes;
+	uint32_t client;		/* IPv4 address, network order */
+	uint16_t status;
+	uint8_t outcome;
+	uint8_t urilen;
+	char uri[ACCESSLOG_URI];
+}access_record;
+
+/* Records of one thread, filled by it and drained by the writer */
+typedef struct ring
+{
+	access_record rec[ACCESSLOG_RING];
+	unsigned long head;		/* next slot to fill, moved by the owner */
+	unsigned long tail;		/* next slot to write, moved by the writer */
+	unsigned long dropped;
+	int exited;				/* the owner is gone */
+	unsigned long end;		/* head when the writer last looked */
+	int drained;			/* exited when it last looked */
+	struct ring *next;
+}ring;
+
+static const char *outcome_names[METRIC_NCOUNTERS] = {
+	"-", "hit", "joined", "fetched", "failed", "local", "cut"
+};
+
+static int enabled;
+static int logfd;
+static ring *rings;					/* of all threads that logged */
+static sem_t mutex;					/* guards the list of rings */
+static sem_t wakeup;				/* a ring is half full */
+static pthread_key_t key;
+static __thread ring *mine;
+static accesslog_stats stats;		/* records and batches, by the writer */
+static unsigned long freed_dropped;	/* dropped in rings since freed */
+static char batch[BATCH_IOV][PIECE_LEN];
+
+static ring *join(void);
+static void leave(void *vargp);
+static void *writer(void *vargp);
+static void flush(void);
+static ring *oldest(void);
+static int fill_batch(struct iovec *iov, unsigned long *lines);
+static int write_batch(struct iovec *iov, int n, unsigned long lines);
+static size_t format(access_record *a, char *buf);
+
+
+/*
+ * Append the log to path and start its writer. Return -1 if the
+ * file cannot be opened.
+ */
+int accesslog_open(char *path)
+{
+	pthread_t tid;
+
+	if ((logfd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+		return -1;
+	Sem_init(&mutex, 0, 1);
+	Sem_init(&wakeup, 0, 0);
+	if (pthread_key_create(&key, leave) != 0)
+		app_error("pthread_key_create error");
+	enabled = 1;
+	Pthread_create(&tid, NULL, writer, NULL);
+	return 0;
+}
+
+int accesslog_enabled(void)
+{
+	return enabled;
+}
+
+/*
+ * Log a request that took ns nanoseconds to answer, if there is
+ * a log and room in the ring of the calling thread
+ */
+void accesslog_write(uint32_t client, const char *uri, size_t urilen,
+					 int status, unsigned long bytes, metric_counter outcome,
+					 uint64_t ns)
+{
+	struct timeval tv;
+	access_record *a;
+	unsigned long head, tail;
+	ring *r;
+
+	if (!enabled)
+		return;
+	if ((r = mine) == NULL)
+		r = mine = join();
+
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (head - tail == ACCESSLOG_RING)
+	{
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	a = &r->rec[head & (ACCESSLOG_RING - 1)];
+	gettimeofday(&tv, NULL);
+	a->time_us = tv.tv_sec * 1000000ULL + tv.tv_usec;
+	a->ns = ns;
+	a->bytes = bytes;
+	a->client = client;
+	a->status = status;
+	a->outcome = outcome;
+	a->urilen = urilen < ACCESSLOG_URI ? urilen : ACCESSLOG_URI;
+	memcpy(a->uri, uri, a->urilen);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+	/* Wake the writer once, as the ring passes half full */
+	if (head + 1 - tail == ACCESSLOG_RING / 2)
+		V(&wakeup);
+}
+
+void get_accesslog_stats(accesslog_stats *st)
+{
+	ring *r;
+
+	st->records = __atomic_load_n(&stats.records, __ATOMIC_RELAXED);
+	st->batches = __atomic_load_n(&stats.batches, __ATOMIC_RELAXED);
+	st->dropped = 0;
+	if (!enabled)
+		return;
+	P(&mutex);
+	st->dropped = freed_dropped;
+	for (r = rings; r != NULL; r = r->next)
+		st->dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	V(&mutex);
+}
+
+/*
+ * Give the calling thread a ring, drained and freed by the
+ * writer after the thread exits
+ */
+static ring *join(void)
+{
+	ring *r = (ring *)Calloc(1, sizeof(ring));
+
+	P(&mutex);
+	r->next = rings;
+	rings = r;
+	V(&mutex);
+	pthread_setspecific(key, r);
+	return r;
+}
+
+static void leave(void *vargp)
+{
+	ring *r = (ring *)vargp;
+
+	__atomic_store_n(&r->exited, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write the rings out every ACCESSLOG_FLUSH_MS, or when one
+ * fills up
+ */
+static void *writer(void *vargp)
+{
+	struct timespec ts;
+
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += ACCESSLOG_FLUSH_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		while (sem_timedwait(&wakeup, &ts) < 0 && errno == EINTR)
+			;
+		flush();
+	}
+	return NULL;
+}
+
+/*
+ * Write out what every ring holds, a batch at a time. What the
+ * rings hold is taken once, and the rings of exited threads are
+ * freed once that is all written.
+ */
+static void flush(void)
+{
+	struct iovec iov[BATCH_IOV];
+	ring **pp, *r;
+	unsigned long lines;
+	int n, full;
+
+	P(&mutex);
+	for (r = rings; r != NULL; r = r->next)
+	{
+		/* Seen exited, the head read next is the last one */
+		r->drained = __atomic_load_n(&r->exited, __ATOMIC_ACQUIRE);
+		r->end = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	}
+
+	do
+	{
+		full = (n = fill_batch(iov, &lines)) == BATCH_IOV;
+		if (!full)
+		{
+			for (pp = &rings; (r = *pp) != NULL; )
+			{
+				if (r->drained)
+				{
+					*pp = r->next;
+					freed_dropped += r->dropped;
+					Free(r);
+				}
+				else
+					pp = &r->next;
+			}
+		}
+		V(&mutex);
+		write_batch(iov, n, lines);
+		if (full)
+			P(&mutex);
+	} while (full);
+}
+
+/*
+ * Format records into the pieces of the batch, merged by time,
+ * until every ring is written up to where the writer looked or
+ * the batch has no room left, and lay the pieces out in iov.
+ * Return the number of pieces, BATCH_IOV if the batch is full.
+ * Called holding mutex, so rings joining meanwhile, which are
+ * empty to the writer, cannot change the list under it.
+ */
+static int fill_batch(struct iovec *iov, unsigned long *lines)
+{
+	ring *r;
+	size_t len = 0;
+	int n = 0;
+
+	*lines = 0;
+	while ((r = oldest()) != NULL)
+	{
+		if (PIECE_LEN - len < LINE_MAX_LEN)
+		{
+			n = iov_put(iov, n, batch[n], len);
+			len = 0;
+			if (n == BATCH_IOV)
+				return n;
+		}
+		len += format(&r->rec[r->tail & (ACCESSLOG_RING - 1)],
+					  batch[n] + len);
+		(*lines)++;
+		__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+	}
+	if (len > 0)
+		n = iov_put(iov, n, batch[n], len);
+	return n;
+}
+
+/*
+ * The ring whose next record to write was answered first, or
+ * NULL once all are written up to where the writer looked.
+ * Called holding mutex.
+ */
+static ring *oldest(void)
+{
+	ring *r, *min = NULL;
+
+	for (r = rings; r != NULL; r = r->next)
+		if (r->tail != r->end && (min == NULL ||
+			r->rec[r->tail & (ACCESSLOG_RING - 1)].time_us <
+			min->rec[min->tail & (ACCESSLOG_RING - 1)].time_us))
+			min = r;
+	return min;
+}
+
+/*
+ * Append the pieces, holding lines records, to the log. Return
+ * -1 if it failed.
+ */
+static int write_batch(struct iovec *iov, int n, unsigned long lines)
+{
+	if (n == 0)
+		return 0;
+	__atomic_store_n(&stats.batches, stats.batches + 1, __ATOMIC_RELAXED);
+	if (writev_all(logfd, iov, n) < 0)
+		return -1;
+	__atomic_store_n(&stats.records, stats.records + lines,
+					 __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Write the line of a record in buf, return its length
+ */
+static size_t format(access_record *a, char *buf)
+{
+	char when[32], addr[INET_ADDRSTRLEN], status[8];
+	time_t sec = a->time_us / 1000000;
+	struct tm tm;
+
+	gmtime_r(&sec, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+	if (inet_ntop(AF_INET, &a->client, addr, sizeof(addr)) == NULL)
+		strcpy(addr, "-");
+	if (a->status > 0)
+		sprintf(status, "%u", a->status);
+	else
+		strcpy(status, "-");
+
+	return sprintf(buf, "%s.%03uZ %s GET %.*s %s %lu %s %lu\n", when,
+				   (unsigned int)(a->time_us / 1000 % 1000), addr,
+				   (int)a->urilen, a->uri, status, a->bytes,
+				   outcome_names[a->outcome],
+				   (unsigned long)(a->ns / 1000));
+}
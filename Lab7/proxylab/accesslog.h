@@ -0,0 +1,35 @@
+/*
+ * accesslog.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Access log written in batches by a thread of its own
+ */
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "metrics.h"
+
+#define ACCESSLOG_RING     512		/* records per thread, a power of two */
+#define ACCESSLOG_URI      200		/* bytes of the uri kept */
+#define ACCESSLOG_FLUSH_MS 100		/* longest a record waits to be written */
+#define ACCESSLOG_BATCH    (256 << 10)	/* bytes of lines per writev */
+
+/* Statistics of the access log */
+typedef struct
+{
+	unsigned long records;		/* written to the file */
+	unsigned long dropped;		/* found their ring full */
+	unsigned long batches;		/* writev calls */
+}accesslog_stats;
+
+int accesslog_open(char *path);
+int accesslog_enabled(void);
+void accesslog_write(uint32_t client, const char *uri, size_t urilen,
+					 int status, unsigned long bytes, metric_counter outcome,
+					 uint64_t ns);
+void get_accesslog_stats(accesslog_stats *st);
+
+#endif
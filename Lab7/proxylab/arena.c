@@ -0,0 +1,208 @@
+/*
+ * arena.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Each cache shard reserves its whole capacity once, as an arena
+ * of ARENA_PAGE byte pages, and stores every node there with its
+ * id and content right behind it. An allocation takes the shortest
+ * run of free pages long enough for it, so size classes are
+ * multiples of a page and an object wastes less than a page,
+ * while long runs are kept for large objects.
+ * Freed runs just clear their bits in the page bitmap, which
+ * merges them with any free neighbours at no cost.
+ *
+ * Free pages can still end up scattered in runs too short for a
+ * large object. The arena then compacts, sliding the runs it may
+ * move down to the start so the free pages join at the end, and
+ * the owner of each run fixes the pointers to it. Runs that are
+ * in use elsewhere stay where they are. If even that leaves no
+ * run long enough, the cache evicts more nodes instead of falling
+ * back to the heap, so the memory of a shard never grows past
+ * what was reserved.
+ *
+ * Nodes are allocated under the writer lock of their shard but
+ * freed by whichever thread drops the last reference, so the
+ * arena has a mutex of its own.
+ */
+
+#include "csapp.h"
+#include "arena.h"
+
+static int page_used(arena *a, unsigned int i);
+static void mark_run(arena *a, unsigned int start, unsigned int n, int used);
+
+
+/*
+ * Reserve an arena of the whole pages that fit in bytes
+ */
+void arena_init(arena *a, size_t bytes)
+{
+	unsigned int words;
+
+	a->npages = bytes / ARENA_PAGE;
+	a->base = (char *)Malloc((size_t)a->npages * ARENA_PAGE + 1);
+	words = (a->npages + 63) / 64;
+	a->bitmap = (uint64_t *)Calloc(words ? words : 1, sizeof(uint64_t));
+	a->runs = (unsigned int *)Calloc(a->npages + 1, sizeof(unsigned int));
+	a->used = 0;
+	a->hint = 0;
+	a->compactions = 0;
+	Sem_init(&a->mutex, 0, 1);
+}
+
+/*
+ * Give the reserved memory back to the system
+ */
+void arena_deinit(arena *a)
+{
+	free(a->base);
+	free(a->bitmap);
+	free(a->runs);
+}
+
+/*
+ * Whether an allocation of this size could ever succeed
+ */
+int arena_fits(arena *a, size_t bytes)
+{
+	return ARENA_PAGES(bytes) <= a->npages;
+}
+
+/*
+ * Pages not in any run, maybe scattered
+ */
+unsigned int arena_free_pages(arena *a)
+{
+	return a->npages - a->used;
+}
+
+/*
+ * Allocate a run of pages holding bytes, from the shortest
+ * free run long enough for it. Return NULL if there is none.
+ */
+void *arena_alloc(arena *a, size_t bytes)
+{
+	unsigned int n = ARENA_PAGES(bytes);
+	unsigned int i, start = 0, run = 0;
+	unsigned int best = 0, best_run = 0;
+	void *p = NULL;
+
+	if (n == 0)
+		n = 1;
+
+	P(&a->mutex);
+	for (i = a->hint; i <= a->npages; i++)
+	{
+		if (i < a->npages && !page_used(a, i))
+		{
+			if (run++ == 0)
+				start = i;
+			continue;
+		}
+
+		/* End of a free run, keep it if it is a better fit */
+		if (run >= n && (best_run == 0 || run < best_run))
+		{
+			best = start;
+			best_run = run;
+			if (run == n)
+				break;
+		}
+		run = 0;
+
+		/* Skip a full word of used pages at once */
+		while (i + 1 < a->npages && (i + 1) % 64 == 0 &&
+			   a->bitmap[(i + 1) / 64] == ~0ULL)
+			i += 64;
+	}
+
+	if (best_run > 0)
+	{
+		mark_run(a, best, n, 1);
+		a->runs[best] = n;
+		a->used += n;
+		if (best == a->hint)
+			a->hint = best + n;
+		p = a->base + (size_t)best * ARENA_PAGE;
+	}
+	V(&a->mutex);
+	return p;
+}
+
+/*
+ * Return a run to the arena
+ */
+void arena_free(arena *a, void *p)
+{
+	unsigned int start = ((char *)p - a->base) / ARENA_PAGE;
+	unsigned int n;
+
+	P(&a->mutex);
+	n = a->runs[start];
+	a->runs[start] = 0;
+	mark_run(a, start, n, 0);
+	a->used -= n;
+	if (start < a->hint)
+		a->hint = start;
+	V(&a->mutex);
+}
+
+/*
+ * Slide runs toward the start of the arena so that free pages
+ * join into one run. relocate() either moves the bytes of a run
+ * to a lower address and returns 1, or returns 0 to keep it.
+ */
+void arena_compact(arena *a, int (*relocate)(void *from, void *to, void *arg),
+				   void *arg)
+{
+	unsigned int page = 0, to = 0, n;
+
+	P(&a->mutex);
+	while (page < a->npages)
+	{
+		if (!page_used(a, page))
+		{
+			page++;
+			continue;
+		}
+
+		/* Every page in [to, page) is free */
+		n = a->runs[page];
+		if (to < page && relocate(a->base + (size_t)page * ARENA_PAGE,
+								  a->base + (size_t)to * ARENA_PAGE, arg))
+		{
+			mark_run(a, page, n, 0);
+			a->runs[page] = 0;
+			mark_run(a, to, n, 1);
+			a->runs[to] = n;
+			to += n;
+		}
+		else
+			to = page + n;
+		page += n;
+	}
+	a->hint = 0;
+	a->compactions++;
+	V(&a->mutex);
+}
+
+static int page_used(arena *a, unsigned int i)
+{
+	return (a->bitmap[i / 64] >> (i % 64)) & 1;
+}
+
+static void mark_run(arena *a, unsigned int start, unsigned int n, int used)
+{
+	unsigned int i;
+
+	for (i = start; i < start + n; i++)
+	{
+		if (used)
+			a->bitmap[i / 64] |= 1ULL << (i % 64);
+		else
+			a->bitmap[i / 64] &= ~(1ULL << (i % 64));
+	}
+}
@@ -0,0 +1,43 @@
+/*
+ * arena.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Fixed-size arena backing the cache nodes
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <semaphore.h>
+
+/* Allocations are whole runs of pages of this size */
+#define ARENA_PAGE 1024
+
+/* Pages needed for n bytes, the size class of an allocation */
+#define ARENA_PAGES(n) (((n) + ARENA_PAGE - 1) / ARENA_PAGE)
+
+/* A region reserved once, handed out in runs of pages */
+typedef struct
+{
+	char *base;
+	unsigned int npages;
+	unsigned int used;		/* pages in allocated runs */
+	uint64_t *bitmap;		/* one bit per page, set if in use */
+	unsigned int *runs;		/* length of the run starting at a page */
+	unsigned int hint;		/* no free page before this one */
+	unsigned long compactions;
+	sem_t mutex;
+}arena;
+
+void arena_init(arena *a, size_t bytes);
+void arena_deinit(arena *a);
+void *arena_alloc(arena *a, size_t bytes);
+void arena_free(arena *a, void *p);
+int arena_fits(arena *a, size_t bytes);
+unsigned int arena_free_pages(arena *a);
+void arena_compact(arena *a, int (*relocate)(void *from, void *to, void *arg),
+				   void *arg);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * bufpool.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Responses were copied for the cache into a MAX_OBJECT_SIZE
+ * array on the stack of every thread. Now that the largest
+ * object is set at runtime, the copy goes into a growbuf that
+ * starts empty and grows as the response arrives, so a small
+ * response only takes a small buffer.
+ *
+ * Buffers come in power of two sizes from BUFPOOL_MIN up. A
+ * buffer that is freed goes back on the free list of its size,
+ * up to BUFPOOL_KEEP of them and only up to BUFPOOL_MAX_POOLED
+ * bytes, and the next buffer of that size is taken from there
+ * instead of malloc. Growing moves the bytes used to a buffer
+ * twice as large (or more) and frees the old one. Each size
+ * has its own semaphore, held only to push or pop a buffer.
+ */
+
+#include "csapp.h"
+#include "bufpool.h"
+
+/* Free buffers of one size, chained through their first bytes */
+typedef struct
+{
+	char *head;
+	unsigned int n;
+	sem_t mutex;
+}size_class;
+
+static size_class classes[BUFPOOL_CLASSES];
+static bufpool_stats stats;
+
+static int class_of(size_t n);
+static char *take(int k);
+static void give(char *data, int k);
+
+
+/*
+ * Initialize the free lists
+ */
+void bufpool_init(void)
+{
+	int k;
+
+	for (k = 0; k < BUFPOOL_CLASSES; k++)
+	{
+		classes[k].head = NULL;
+		classes[k].n = 0;
+		Sem_init(&classes[k].mutex, 0, 1);
+	}
+}
+
+/*
+ * Start an empty buffer, without memory yet
+ */
+void growbuf_init(growbuf *b)
+{
+	b->data = NULL;
+	b->len = b->cap = 0;
+}
+
+/*
+ * Make sure the buffer holds at least n bytes, moving what
+ * it has to a larger one if needed
+ */
+void growbuf_reserve(growbuf *b, size_t n)
+{
+	char *data;
+	int k;
+
+	if (n <= b->cap)
+		return;
+
+	/* At least double, so appends take amortized constant time */
+	if (n < b->cap * 2)
+		n = b->cap * 2;
+	k = class_of(n);
+	data = take(k);
+	if (b->data != NULL)
+	{
+		memcpy(data, b->data, b->len);
+		give(b->data, class_of(b->cap));
+		__sync_fetch_and_add(&stats.grown, 1);
+	}
+	b->data = data;
+	b->cap = (size_t)BUFPOOL_MIN << k;
+}
+
+/*
+ * Add n bytes at the end of the buffer
+ */
+void growbuf_append(growbuf *b, const void *data, size_t n)
+{
+	growbuf_reserve(b, b->len + n);
+	memcpy(b->data + b->len, data, n);
+	b->len += n;
+}
+
+/*
+ * Give the memory of the buffer back to the pool
+ */
+void growbuf_free(growbuf *b)
+{
+	if (b->data != NULL)
+		give(b->data, class_of(b->cap));
+	growbuf_init(b);
+}
+
+/*
+ * Copy the statistics of the pool
+ */
+void get_bufpool_stats(bufpool_stats *st)
+{
+	int k;
+
+	*st = stats;
+	st->pooled = 0;
+	st->pooled_bytes = 0;
+	for (k = 0; k < BUFPOOL_CLASSES; k++)
+	{
+		P(&classes[k].mutex);
+		st->pooled += classes[k].n;
+		st->pooled_bytes += (unsigned long long)classes[k].n *
+			((size_t)BUFPOOL_MIN << k);
+		V(&classes[k].mutex);
+	}
+}
+
+/*
+ * Smallest size class holding n bytes
+ */
+static int class_of(size_t n)
+{
+	int k = 0;
+
+	while (k < BUFPOOL_CLASSES - 1 && ((size_t)BUFPOOL_MIN << k) < n)
+		k++;
+	return k;
+}
+
+/*
+ * Take a buffer of size class k, from its free list if possible
+ */
+static char *take(int k)
+{
+	size_class *sc = &classes[k];
+	char *data;
+
+	P(&sc->mutex);
+	if ((data = sc->head) != NULL)
+	{
+		sc->head = *(char **)data;
+		sc->n--;
+	}
+	V(&sc->mutex);
+
+	if (data != NULL)
+		__sync_fetch_and_add(&stats.reused, 1);
+	else
+	{
+		data = (char *)Malloc((size_t)BUFPOOL_MIN << k);
+		__sync_fetch_and_add(&stats.allocated, 1);
+	}
+	return data;
+}
+
+/*
+ * Put a buffer of size class k back, or free it if the pool
+ * keeps enough of its size
+ */
+static void give(char *data, int k)
+{
+	size_class *sc = &classes[k];
+
+	if (((size_t)BUFPOOL_MIN << k) <= BUFPOOL_MAX_POOLED)
+	{
+		P(&sc->mutex);
+		if (sc->n < BUFPOOL_KEEP)
+		{
+			*(char **)data = sc->head;
+			sc->head = data;
+			sc->n++;
+			data = NULL;
+		}
+		V(&sc->mutex);
+	}
+	free(data);
+}
@@ -0,0 +1,43 @@
+/*
+ * bufpool.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Pool of response buffers that grow on demand
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+#define BUFPOOL_MIN        16384		/* bytes of the smallest buffers */
+#define BUFPOOL_CLASSES    19			/* power of two sizes, up to 4GB */
+#define BUFPOOL_KEEP       32			/* free buffers kept per size */
+#define BUFPOOL_MAX_POOLED (4 << 20)	/* larger buffers are never kept */
+
+/* A buffer growing on demand, its memory taken from the pool */
+typedef struct
+{
+	char *data;
+	size_t len;			/* bytes used */
+	size_t cap;			/* bytes of data, a size of the pool */
+}growbuf;
+
+/* Statistics of the pool */
+typedef struct
+{
+	unsigned long reused;		/* buffers taken from the pool */
+	unsigned long allocated;	/* buffers that had to be allocated */
+	unsigned long grown;		/* moves to a larger buffer */
+	unsigned long pooled;		/* free buffers kept */
+	unsigned long long pooled_bytes;
+}bufpool_stats;
+
+void bufpool_init(void);
+void growbuf_init(growbuf *b);
+void growbuf_reserve(growbuf *b, size_t n);
+void growbuf_append(growbuf *b, const void *data, size_t n);
+void growbuf_free(growbuf *b);
+void get_bufpool_stats(bufpool_stats *st);
+
+#endif
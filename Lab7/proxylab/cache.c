@@ -1,6 +1,6 @@
 /*
- * cache.c 
- * 
+ * cache.c
+ *
  * Name: Ti-Fen Pan
  * Andrew ID: tpan
  *
@@ -8,117 +8,364 @@
  * Basically, a linked list is used to cache web content.
  * Each cache node contains:
  * [request header]
+ * [hash of the request header]
  * [node size]
  * [the cache content]
  * [pointer to the previous node]
  * [pointer to the next node]
+ * [pointer to the next node in the same hash bucket]
  * To fulfill the LRU policy, I added new cache node at
  * the head of the cache list and remove old node from the
  * tail.  This cache node is moved to the head as a cache hit
- * occurs. Also, I lock the cache each time as I manipulate 
+ * occurs. Also, I lock the cache each time as I manipulate
  * the cache node to ensure thread-safe.
+ *
+ * A chained hash table indexes the same nodes by the hash
+ * of their request, so a lookup only compares the few nodes
+ * sharing a bucket instead of walking the whole list. The
+ * table doubles whenever it holds more nodes than buckets.
+ *
+ * The cache is split into shards picked by the high bits of
+ * the hash. Each shard is an independent list with its own
+ * share of the capacity and a readers-writers lock, so hits
+ * only take the lock as readers and run in parallel. Since
+ * readers cannot reorder the list, a hit just marks the node
+ * as referenced, and the writer gives referenced nodes a
+ * second chance at the tail by moving them back to the head.
+ *
+ * Cached content is immutable and reference counted. The list
+ * owns one reference, and a hit pins the node with another one
+ * instead of copying the content out, so the reader writes it
+ * straight from the cache. Evicting a node only drops the list
+ * reference; the last release_cache() frees it.
+ *
+ * Which node is evicted, and whether a new object is cached at
+ * all, is left to the policy of the cache (see policy.c). Every
+ * lookup tells the policy about the hit or miss, and when a new
+ * object does not fit, the policy hands out victims one by one.
+ *
+ * Nodes never come from the heap. Each shard reserves its
+ * capacity once as an arena (see arena.c), and a node is a
+ * single run of arena pages holding the node, its id and its
+ * content back to back, and capacity is counted in the pages
+ * nodes take. Eviction (and compaction, moving the nodes only
+ * the list holds) goes on until the arena has a run long enough
+ * for the new node, so a shard never uses more memory than it
+ * reserved.
+ *
+ * Each node also carries the freshness of its response. Caching
+ * a request that is already cached replaces the old node, which
+ * is how a revalidated response takes the place of a stale one,
+ * and refresh_cache() only moves the freshness of a node forward
+ * when the server confirms the cached copy is still valid.
+ *
+ * If the cache has a spill function, evicted objects are copied
+ * out while the shard is locked and handed to it once the lock
+ * is dropped, so a slower tier never holds up the shard.
+ *
+ * The contents can be dumped into a snapshot file, shard by
+ * shard and from the coldest node of each list to the hottest:
+ * [header: magic, version, object count, file size, checksum]
+ * [record: id and content lengths, freshness][id][content]...
+ * with every record padded to 8 bytes. Restoring maps the file
+ * and caches its objects again in that order, which rebuilds
+ * the recency of each list. The file is trusted on startup, so
+ * it is only restored if its checksum over everything past the
+ * header matches, and each record is checked to lie within the
+ * file with its validators within its content.
  */
 
 #include "csapp.h"
 #include "cache.h"
+#include "policy.h"
+
+static cache_list *shard_of(cache *c, uint64_t hash);
+static uint64_t snapshot_sum(uint64_t sum, const void *buf, size_t n);
+static void reader_lock(cache_list *cl);
+static void reader_unlock(cache_list *cl);
+static void writer_lock(cache_list *cl);
+static void writer_unlock(cache_list *cl);
+static node *new_dummy(void);
+static node *find_node(cache_list *cl, char *id, uint64_t hash);
+static void evict(cache *c, cache_list *cl, node *cb, cache_spill **spilled);
+static void spill_evicted(cache *c, cache_spill *spilled);
+static node **pin_list(node *head, node *tail, node **pinned,
+					   unsigned long *n, unsigned long *cap);
+static int relocate(void *from, void *to, void *arg);
+static node **bucket_of(cache_list *cl, uint64_t hash);
+static void hash_insert(cache_list *cl, node *cb);
+static void hash_remove(cache_list *cl, node *cb);
+static void hash_grow(cache_list *cl);
 
 
+/*
+ * Create a cache of nshards shards sharing capacity bytes,
+ * evicting with the given policy
+ */
+cache *init_cache(unsigned int nshards, unsigned int capacity,
+				  cache_policy policy)
+{
+	unsigned int i;
+	cache *c = (cache *)malloc(sizeof(cache));
+
+	if (nshards == 0)
+		nshards = 1;
+	c->nshards = nshards;
+	c->policy = policy;
+	c->spill = NULL;
+	c->shards = (cache_list *)malloc(nshards * sizeof(cache_list));
+	for (i = 0; i < nshards; i++)
+		init_cache_list(&c->shards[i], capacity / nshards, policy);
+
+	return c;
+}
+
+/*
+ * Free every shard of the cache
+ */
+void free_cache(cache *c)
+{
+	unsigned int i;
 
+	for (i = 0; i < c->nshards; i++)
+		free_cache_list(&c->shards[i]);
+	free(c->shards);
+	free(c);
+}
 
 /*
  * Initialize cache list
  */
-void init_cache_list(cache_list *cl)
+void init_cache_list(cache_list *cl, unsigned int capacity,
+					 cache_policy policy)
 {
+	/* Reserve the memory of every node of the shard */
+	arena_init(&cl->mem, capacity);
 	cl->_size = 0;
+	cl->capacity = cl->mem.npages * ARENA_PAGE;
 
 	/* Create dummy node for head and tail */
-	cl->head = new_cache(NULL, NULL, 0);
-	cl->tail = new_cache(NULL, NULL, 0);
+	cl->head = new_dummy();
+	cl->tail = new_dummy();
 
 	cl->head->next = cl->tail;
 	cl->tail->prev = cl->head;
 
+	/* A second list, used by policies with two segments */
+	cl->phead = new_dummy();
+	cl->ptail = new_dummy();
+	cl->phead->next = cl->ptail;
+	cl->ptail->prev = cl->phead;
+	cl->protected_size = 0;
+
+	/* Create an empty hash index */
+	cl->nbuckets = CACHE_INIT_BUCKETS;
+	cl->count = 0;
+	cl->buckets = (node **)calloc(cl->nbuckets, sizeof(node *));
+
+	memset(&cl->stats, 0, sizeof(cl->stats));
+
 	/* initialize lock */
-	Sem_init(&sem, 0, 1); 
+	cl->readcnt = 0;
+	Sem_init(&cl->mutex, 0, 1);
+	Sem_init(&cl->w, 0, 1);
+
+	/* Policy state */
+	cl->sketch = NULL;
+	cl->heap = NULL;
+	cl->heap_n = cl->heap_cap = 0;
+	cl->clock = 0;
+	cl->ops = policy_ops_of(policy);
+	cl->ops->init(cl);
 
 	return;
 }
 
 /*
- * Create a new cache block
+ * 64-bit FNV-1a hash of a request, computed once per
+ * request and passed to search_cache and update_cache.
+ * FNV leaves the high bits of keys differing only in their
+ * last bytes nearly equal, and those bits pick the shard,
+ * so the result goes through the MurmurHash3 finalizer.
  */
-node *new_cache(char *id, char *content, 
-				unsigned int _size)
+uint64_t cache_hash(const char *id)
 {
-	node *cb;
-	cb = (node *)malloc(sizeof(node));
+	uint64_t h = 14695981039346656037ULL;
 
-	/* 
-	 * copy cache id, if id == NULL, 
-	 * it is header and tail
-	 */
-	if (id != NULL)
+	while (*id)
 	{
-		cb->id = (char *) malloc(sizeof(char) * (strlen(id) + 1));
-		strcpy(cb->id, id);
+		h ^= (unsigned char)*id++;
+		h *= 1099511628211ULL;
 	}
 
-	cb->_size = _size;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
 
-	/* 
-	 * copy cache content, if content == NULL, 
-	 * it is header and tail
-	 */
-	if (content != NULL)
-	{
-		cb->content = (char *) malloc(sizeof(char) * _size);
-		memcpy(cb->content, content, sizeof(char) * _size);
-	}
+/*
+ * Create a new cache block in the arena of a shard, with
+ * its id and content copied right behind it. Return NULL
+ * if the arena has no room for it.
+ */
+node *new_cache(cache_list *cl, char *id, char *content,
+				unsigned int _size)
+{
+	size_t idlen = strlen(id) + 1;
+	node *cb;
+
+	cb = (node *)arena_alloc(&cl->mem, sizeof(node) + idlen + _size);
+	if (cb == NULL)
+		return NULL;
+
+	/* copy cache id and content */
+	cb->id = (char *)(cb + 1);
+	memcpy(cb->id, id, idlen);
+	cb->content = cb->id + idlen;
+	memcpy(cb->content, content, _size);
+
+	cb->home = &cl->mem;
+	cb->hash = 0;
+	cb->meta.fresh_until = cb->meta.stale_until = CACHE_NEVER_STALE;
+	cb->meta.etag_off = cb->meta.etag_len = 0;
+	cb->meta.lm_off = cb->meta.lm_len = 0;
+	cb->revalidating = 0;
+	cb->_size = _size;
+	cb->footprint = node_footprint(id, _size);
+	cb->referenced = 0;
+	cb->refcnt = 1;
+	cb->freq = 1;
+	cb->segment = 0;
+	cb->heapidx = -1;
+	cb->priority = 0;
 
 	cb->prev = NULL;
 	cb->next = NULL;
+	cb->hnext = NULL;
 
 	return cb;
 }
 
+/*
+ * Arena bytes a node takes, with its id and content
+ */
+unsigned int node_footprint(char *id, unsigned int _size)
+{
+	return ARENA_PAGES(sizeof(node) + strlen(id) + 1 + _size) * ARENA_PAGE;
+}
+
+/*
+ * Move a node elsewhere in the arena while it is compacted,
+ * and point the lists, the hash index and the policy at the
+ * new place. Only nodes held by nothing but the list may move:
+ * pinned nodes are in use by readers, and no reader can pin
+ * one while the writer lock is held.
+ */
+static int relocate(void *from, void *to, void *arg)
+{
+	cache_list *cl = (cache_list *)arg;
+	node *cb = (node *)from, *nb = (node *)to;
+	node **pp;
+	size_t idlen;
+
+	/* Evicted nodes are off the list and always pinned */
+	if (cb->prev == NULL ||
+		__atomic_load_n(&cb->refcnt, __ATOMIC_ACQUIRE) != 1)
+		return 0;
+
+	pp = bucket_of(cl, cb->hash);
+	while (*pp != cb)
+		pp = &(*pp)->hnext;
+	idlen = cb->content - cb->id;
+
+	memmove(nb, cb, cb->footprint);
+	nb->id = (char *)(nb + 1);
+	nb->content = nb->id + idlen;
+	nb->prev->next = nb;
+	nb->next->prev = nb;
+	*pp = nb;
+	if (nb->heapidx >= 0)
+		cl->heap[nb->heapidx] = nb;
+	return 1;
+}
+
+/*
+ * Create a dummy node for the head or tail of a list
+ */
+static node *new_dummy(void)
+{
+	return (node *)Calloc(1, sizeof(node));
+}
+
 /*
  * Insert a cache block to the head of the list
  */
 void push_to_head(cache_list *cl, node *cb)
 {
-	/* manipulate pointer */
-	cb->prev = cl->head;
-	cb->next = cl->head->next;
-	cl->head->next->prev = cb;
-	cl->head->next = cb;
+	link_after(cl->head, cb);
 	return;
 }
 
+/*
+ * Insert a cache block right after another one
+ */
+void link_after(node *at, node *cb)
+{
+	/* manipulate pointer */
+	cb->prev = at;
+	cb->next = at->next;
+	at->next->prev = cb;
+	at->next = cb;
+}
+
+/*
+ * Take a cache block out of its list
+ */
+void unlink_node(node *cb)
+{
+	cb->next->prev = cb->prev;
+	cb->prev->next = cb->next;
+}
+
 /*
  * Delete cache block
  * Return the previous block of the deleted block
  */
 node *delete_cache(cache_list *cl, node *cb)
 {
-	/* remove cache block from list */
+	/* remove cache block from list and index */
 	node *prev_cb;
-	cb->next->prev = cb->prev;
-	cb->prev->next = cb->next;
-	cl->_size -= cb->_size;
+	cl->ops->remove(cl, cb);
+	hash_remove(cl, cb);
+	unlink_node(cb);
+	cl->_size -= cb->footprint;
 	prev_cb = cb->prev;
 
 	cb->prev = NULL;
 	cb->next = NULL;
 
-	/* Free heap */
-	free(cb->id);
-	free(cb->content);
-	free(cb);
+	/* Drop the reference of the list */
+	release_cache(cb);
 
 	return prev_cb;
 }
 
+/*
+ * Drop a reference to a cache block,
+ * the last one frees it
+ */
+void release_cache(node *cb)
+{
+	if (__sync_sub_and_fetch(&cb->refcnt, 1) > 0)
+		return;
+
+	/* Give its pages back to the arena */
+	arena_free(cb->home, cb);
+}
+
 /*
  * Free cache list
  */
@@ -130,100 +377,601 @@ void free_cache_list(cache_list *cl)
 	{
 		cb = delete_cache(cl, cb);
 	}
+	cb = cl->ptail->prev;
+	while(cb != cl->phead)
+	{
+		cb = delete_cache(cl, cb);
+	}
+	cl->ops->deinit(cl);
 
 	/* free heap */
+	free(cl->buckets);
 	free(cl->head);
 	free(cl->tail);
-	free(cl);
+	free(cl->phead);
+	free(cl->ptail);
+	arena_deinit(&cl->mem);
 	return;
 }
 
 /*
  * Check cache list, if there exist the request content,
- * read from it.
+ * return it pinned. The caller must release_cache() it.
  */
-char* search_cache(cache_list *cl, char *id, int* size)
+node *search_cache(cache *c, char *id, uint64_t hash)
 {
-	node *cache = NULL;
+	cache_list *cl = shard_of(c, hash);
+	node *hit = NULL;
+	unsigned long probes = 0;
 
-	/* 
-	 * When there is cache hit, we first lock 
-	 * it for thread safety
+	/*
+	 * Lookups only read the shard, so they share
+	 * the lock with other readers
 	 */
-	P(&sem);
-	char* content_copy;
+	reader_lock(cl);
 
 	/*
-	 * Serach the cache list
+	 * Search the bucket of this hash, comparing the
+	 * full request only when the hashes are equal
 	 */
-	node *cn = cl->head->next;
-	while( cn != cl->tail)
+	node *cn = *bucket_of(cl, hash);
+	while (cn != NULL)
 	{
-    	if(!strcmp(cn->id, id))
-    	{
-    		/* Cache hit!!
-    		 * Move the cache to the head of the list
-    		 */
-    		cn->next->prev = cn->prev;
-			cn->prev->next = cn->next;
-			push_to_head(cl, cn);
-    		cache = cn; 
-    		break;
-    	}
-    	cn = cn->next; 			
-    }
-
-	/* if cache hit, copy the content */
-	if (cache != NULL)
-	{
-		*size = cache->_size;
-		content_copy = (char*) malloc(sizeof(char)*cache->_size);
+		probes++;
+		if (cn->hash == hash && !strcmp(cn->id, id))
+		{
+			/* Cache hit!! */
+			hit = cn;
+			break;
+		}
+		cn = cn->hnext;
+	}
+	__sync_fetch_and_add(&cl->stats.probes, probes);
 
-		memcpy(content_copy, cache->content,
-			   sizeof(char) * cache->_size);
-		V(&sem);
-        return content_copy;
+	/* Let the policy count the lookup and mark the hit */
+	cl->ops->access(cl, hash, hit);
 
-	}
-	else
+	/* if cache hit, pin the node before unlocking */
+	if (hit != NULL)
 	{
-		V(&sem);
-		return NULL;
+		__sync_fetch_and_add(&cl->stats.hits, 1);
+		__sync_fetch_and_add(&hit->refcnt, 1);
 	}
+	else
+		__sync_fetch_and_add(&cl->stats.misses, 1);
+
+	reader_unlock(cl);
+	return hit;
 }
 
 /*
- * Write a new cache node to cache list
+ * Write a new cache node to cache list, replacing the node
+ * of the same request if there is one. Without meta the
+ * node never goes stale.
  */
-void update_cache(cache_list *cl, char *id, char *content,
-		unsigned int _size)
+void update_cache(cache *c, char *id, uint64_t hash,
+		char *content, unsigned int _size, cache_meta *meta)
 {
+	cache_list *cl = shard_of(c, hash);
 	node *new_cb = NULL;
+	unsigned int footprint = node_footprint(id, _size);
+	int compacted = 0;
+	cache_spill *spilled = NULL;
 
-	/* 
+	/* Objects larger than a whole shard are never cached */
+	if (footprint > cl->capacity)
+		return;
+
+	/*
 	 * Write operation should lock the cache list
 	 * for thread safety
 	 */
-	P(&sem);
-	new_cb = new_cache(id, content, _size);
+	writer_lock(cl);
+
+	/*
+	 * A newer response of a cached request replaces it,
+	 * without asking the policy to admit it again
+	 */
+	node *cn = find_node(cl, id, hash);
+	if (cn != NULL)
+		delete_cache(cl, cn);
+	else if (!cl->ops->admit(cl, hash, footprint))
+	{
+		cl->stats.rejections++;
+		writer_unlock(cl);
+		return;
+	}
 
-    /* 
+    /*
      * Make room for new objects if the cache exceeds
-     * maximum cache size.
+     * maximum cache size, evicting the victims the
+     * policy picks
+     */
+    while((cl->_size + footprint > cl->capacity) &&
+    	    (cn = cl->ops->victim(cl)) != NULL)
+    	evict(c, cl, cn, &spilled);
+
+    /*
+     * Keep evicting until the arena has a run of pages long
+     * enough, compacting it once if the free pages are just
+     * scattered. Pinned victims only free theirs once released,
+     * so the object may still find no room and is dropped.
      */
-	node *cn = cl->tail->prev;
-    while((cl->_size + new_cb->_size > MAX_CACHE_SIZE) && 
-    	    cn != cl->head)
+    while ((new_cb = new_cache(cl, id, content, _size)) == NULL)
     {
-    	cn = delete_cache(cl, cn);
+    	if (!compacted &&
+    		arena_free_pages(&cl->mem) >= ARENA_PAGES(footprint))
+    	{
+    		arena_compact(&cl->mem, relocate, cl);
+    		compacted = 1;
+    		continue;
+    	}
+    	if ((cn = cl->ops->victim(cl)) == NULL)
+    	{
+    		cl->stats.rejections++;
+    		writer_unlock(cl);
+    		spill_evicted(c, spilled);
+    		return;
+    	}
+    	evict(c, cl, cn, &spilled);
     }
-    /* Push the new cache to the head of the list */
-    push_to_head(cl, new_cb);
+    new_cb->hash = hash;
+    if (meta != NULL)
+    	new_cb->meta = *meta;
+    /* Let the policy link the new cache */
+    cl->ops->insert(cl, new_cb);
+    hash_insert(cl, new_cb);
 
     /* Change total size */
-	cl->_size += cn->_size;
+	cl->_size += footprint;
 
-    V(&sem);
+    writer_unlock(cl);
+    spill_evicted(c, spilled);
     return;
 
 }
+
+/*
+ * Evict a node, copying it out first if the cache spills
+ * evicted objects. The copies are chained on *spilled.
+ */
+static void evict(cache *c, cache_list *cl, node *cb, cache_spill **spilled)
+{
+	size_t idlen = strlen(cb->id) + 1;
+	cache_spill *s;
+
+	if (c->spill != NULL)
+	{
+		s = (cache_spill *)Malloc(sizeof(cache_spill) + idlen + cb->_size);
+		s->id = (char *)(s + 1);
+		memcpy(s->id, cb->id, idlen);
+		s->content = s->id + idlen;
+		memcpy(s->content, cb->content, cb->_size);
+		s->hash = cb->hash;
+		s->_size = cb->_size;
+		s->meta = cb->meta;
+		s->next = *spilled;
+		*spilled = s;
+	}
+	delete_cache(cl, cb);
+	cl->stats.evictions++;
+}
+
+/*
+ * Hand the evicted copies to the next tier, once the shard
+ * is unlocked
+ */
+static void spill_evicted(cache *c, cache_spill *spilled)
+{
+	if (spilled != NULL)
+		c->spill(spilled);
+}
+
+/*
+ * Move the freshness of a cached request forward after the
+ * server confirmed it is unchanged. The validators stay those
+ * of the cached content.
+ */
+void refresh_cache(cache *c, char *id, uint64_t hash, cache_meta *meta)
+{
+	cache_list *cl = shard_of(c, hash);
+	node *cn;
+
+	writer_lock(cl);
+	if ((cn = find_node(cl, id, hash)) != NULL)
+	{
+		__atomic_store_n(&cn->meta.fresh_until, meta->fresh_until,
+						 __ATOMIC_RELAXED);
+		__atomic_store_n(&cn->meta.stale_until, meta->stale_until,
+						 __ATOMIC_RELAXED);
+		__atomic_store_n(&cn->revalidating, 0, __ATOMIC_RELAXED);
+	}
+	writer_unlock(cl);
+}
+
+/* Header of a snapshot file */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t count;			/* objects */
+	uint64_t bytes;			/* size of the whole file */
+	uint64_t sum;			/* snapshot_sum() of the records */
+}snapshot_header;
+
+/* One object in a snapshot, followed by its id and content */
+typedef struct
+{
+	uint32_t idlen;			/* with the NUL */
+	uint32_t size;
+	int64_t fresh_until;
+	int64_t stale_until;
+	uint32_t etag_off;
+	uint32_t etag_len;
+	uint32_t lm_off;
+	uint32_t lm_len;
+}snapshot_record;
+
+#define SNAPSHOT_PAD(n) (((n) + 7) & ~(size_t)7)
+#define SNAPSHOT_SUM_INIT 14695981039346656037ULL
+
+static int record_ok(snapshot_record *r, size_t room, unsigned int max_size);
+
+/*
+ * Dump every cached object into a snapshot at path. Each shard
+ * only has its nodes pinned under the reader lock, and is
+ * written once unlocked. The file is written aside and renamed,
+ * so a snapshot is never seen half written. Return the objects
+ * written and their file size in *bytes, or -1 on error.
+ */
+long cache_snapshot(cache *c, const char *path, unsigned long *bytes)
+{
+	char tmp[MAXLINE];
+	static const char pad[8];
+	snapshot_header h;
+	snapshot_record r;
+	node **pinned = NULL;
+	unsigned long n, cap = 0, i;
+	unsigned int s;
+	size_t len;
+	int fd, err = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = SNAPSHOT_MAGIC;
+	h.version = SNAPSHOT_VERSION;
+	h.bytes = sizeof(h);
+	h.sum = SNAPSHOT_SUM_INIT;
+	if (rio_writen(fd, &h, sizeof(h)) != sizeof(h))
+		err = 1;
+
+	for (s = 0; s < c->nshards && !err; s++)
+	{
+		cache_list *cl = &c->shards[s];
+
+		/* Coldest first, the protected segment being the hottest */
+		reader_lock(cl);
+		n = 0;
+		pinned = pin_list(cl->head, cl->tail, pinned, &n, &cap);
+		pinned = pin_list(cl->phead, cl->ptail, pinned, &n, &cap);
+		reader_unlock(cl);
+
+		for (i = 0; i < n; i++)
+		{
+			node *cb = pinned[i];
+
+			r.idlen = strlen(cb->id) + 1;
+			r.size = cb->_size;
+			r.fresh_until = __atomic_load_n(&cb->meta.fresh_until,
+											__ATOMIC_RELAXED);
+			r.stale_until = __atomic_load_n(&cb->meta.stale_until,
+											__ATOMIC_RELAXED);
+			r.etag_off = cb->meta.etag_off;
+			r.etag_len = cb->meta.etag_len;
+			r.lm_off = cb->meta.lm_off;
+			r.lm_len = cb->meta.lm_len;
+			len = sizeof(r) + r.idlen + r.size;
+			if (!err && (rio_writen(fd, &r, sizeof(r)) != sizeof(r) ||
+						 rio_writen(fd, cb->id, r.idlen) != (ssize_t)r.idlen ||
+						 rio_writen(fd, cb->content, r.size) != (ssize_t)r.size ||
+						 rio_writen(fd, (void *)pad, SNAPSHOT_PAD(len) - len) !=
+						 (ssize_t)(SNAPSHOT_PAD(len) - len)))
+				err = 1;
+			h.sum = snapshot_sum(h.sum, &r, sizeof(r));
+			h.sum = snapshot_sum(h.sum, cb->id, r.idlen);
+			h.sum = snapshot_sum(h.sum, cb->content, r.size);
+			h.sum = snapshot_sum(h.sum, pad, SNAPSHOT_PAD(len) - len);
+			h.count++;
+			h.bytes += SNAPSHOT_PAD(len);
+			release_cache(cb);
+		}
+	}
+	free(pinned);
+
+	/* The header goes in last, with the totals */
+	if (!err && (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) || fsync(fd) < 0))
+		err = 1;
+	if (close(fd) < 0)
+		err = 1;
+
+	/* A failed snapshot leaves the last good one in place */
+	if (err || rename(tmp, path) < 0)
+	{
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	if (bytes != NULL)
+		*bytes = h.bytes;
+	return h.count;
+}
+
+/*
+ * Map a snapshot and cache its objects again, skipping those
+ * that went stale and cannot be revalidated, or are larger than
+ * max_size. Return the objects restored, or -1 if the file is
+ * missing or damaged.
+ */
+long cache_restore(cache *c, const char *path, unsigned int max_size)
+{
+	struct stat st;
+	snapshot_header *h;
+	snapshot_record *r;
+	cache_meta meta;
+	char *map, *p, *id;
+	time_t now = time(NULL);
+	long restored = 0;
+	uint64_t i;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*h) ||
+		(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+		MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	h = (snapshot_header *)map;
+	if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION ||
+		h->bytes != (uint64_t)st.st_size ||
+		h->sum != snapshot_sum(SNAPSHOT_SUM_INIT, map + sizeof(*h),
+							   st.st_size - sizeof(*h)))
+	{
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	p = map + sizeof(*h);
+	for (i = 0; i < h->count; i++)
+	{
+		r = (snapshot_record *)p;
+		if (!record_ok(r, map + st.st_size - p, max_size))
+			break;
+		id = p + sizeof(*r);
+		p += SNAPSHOT_PAD(sizeof(*r) + (size_t)r->idlen + r->size);
+		if (id[r->idlen - 1] != '\0')
+			break;
+
+		if (now >= r->stale_until && r->etag_len == 0 && r->lm_len == 0)
+			continue;
+		meta.fresh_until = r->fresh_until;
+		meta.stale_until = r->stale_until;
+		meta.etag_off = r->etag_off;
+		meta.etag_len = r->etag_len;
+		meta.lm_off = r->lm_off;
+		meta.lm_len = r->lm_len;
+		update_cache(c, id, cache_hash(id), id + r->idlen, r->size, &meta);
+		restored++;
+	}
+
+	munmap(map, st.st_size);
+	return restored;
+}
+
+/*
+ * Whether the record at the start of room bytes of a snapshot
+ * fits in them, with its validators inside its content and
+ * the content no larger than max_size
+ */
+static int record_ok(snapshot_record *r, size_t room, unsigned int max_size)
+{
+	if (room < sizeof(*r) || r->idlen == 0 || r->size > max_size ||
+		SNAPSHOT_PAD(sizeof(*r) + (size_t)r->idlen + r->size) > room)
+		return 0;
+	if ((size_t)r->etag_off + r->etag_len > r->size ||
+		(size_t)r->lm_off + r->lm_len > r->size)
+		return 0;
+	return 1;
+}
+
+/*
+ * FNV-1a over n more bytes of a snapshot
+ */
+static uint64_t snapshot_sum(uint64_t sum, const void *buf, size_t n)
+{
+	const unsigned char *b = (const unsigned char *)buf;
+
+	while (n-- > 0)
+	{
+		sum ^= *b++;
+		sum *= 1099511628211ULL;
+	}
+	return sum;
+}
+
+/*
+ * Pin the nodes of a list, from its tail to its head, adding
+ * them to the growing array pinned. The caller holds the lock.
+ */
+static node **pin_list(node *head, node *tail, node **pinned,
+					   unsigned long *n, unsigned long *cap)
+{
+	node *cn;
+
+	for (cn = tail->prev; cn != head; cn = cn->prev)
+	{
+		if (*n == *cap)
+		{
+			*cap = *cap ? *cap * 2 : 64;
+			pinned = (node **)Realloc(pinned, *cap * sizeof(node *));
+		}
+		__sync_fetch_and_add(&cn->refcnt, 1);
+		pinned[(*n)++] = cn;
+	}
+	return pinned;
+}
+
+/*
+ * Sum up the lookup statistics of every shard
+ */
+void get_cache_stats(cache *c, cache_stats *st)
+{
+	unsigned int i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < c->nshards; i++)
+	{
+		cache_list *cl = &c->shards[i];
+
+		reader_lock(cl);
+		st->hits += cl->stats.hits;
+		st->misses += cl->stats.misses;
+		st->probes += cl->stats.probes;
+		st->evictions += cl->stats.evictions;
+		st->rejections += cl->stats.rejections;
+		st->arena_bytes += (unsigned long)cl->mem.used * ARENA_PAGE;
+		st->compactions += cl->mem.compactions;
+		st->objects += cl->count;
+		st->_size += cl->_size;
+		reader_unlock(cl);
+	}
+}
+
+/*
+ * Pick the shard of a hash. The high bits are used so
+ * that the bucket index inside the shard stays uniform.
+ */
+static cache_list *shard_of(cache *c, uint64_t hash)
+{
+	return &c->shards[(hash >> 32) % c->nshards];
+}
+
+/*
+ * Readers-writers lock of a shard, the first reader in
+ * locks out writers and the last reader out lets them in
+ */
+static void reader_lock(cache_list *cl)
+{
+	P(&cl->mutex);
+	cl->readcnt++;
+	if (cl->readcnt == 1)
+		P(&cl->w);
+	V(&cl->mutex);
+}
+
+static void reader_unlock(cache_list *cl)
+{
+	P(&cl->mutex);
+	cl->readcnt--;
+	if (cl->readcnt == 0)
+		V(&cl->w);
+	V(&cl->mutex);
+}
+
+static void writer_lock(cache_list *cl)
+{
+	P(&cl->w);
+}
+
+static void writer_unlock(cache_list *cl)
+{
+	V(&cl->w);
+}
+
+/*
+ * Return the bucket a hash falls into
+ */
+static node **bucket_of(cache_list *cl, uint64_t hash)
+{
+	return &cl->buckets[hash & (cl->nbuckets - 1)];
+}
+
+/*
+ * Return the node of a request in its shard, NULL if the
+ * request is not cached. The caller holds the lock.
+ */
+static node *find_node(cache_list *cl, char *id, uint64_t hash)
+{
+	node *cn = *bucket_of(cl, hash);
+
+	while (cn != NULL && (cn->hash != hash || strcmp(cn->id, id)))
+		cn = cn->hnext;
+	return cn;
+}
+
+/*
+ * Add a cache block to the hash index
+ */
+static void hash_insert(cache_list *cl, node *cb)
+{
+	node **b;
+
+	if (cl->count >= cl->nbuckets)
+		hash_grow(cl);
+
+	b = bucket_of(cl, cb->hash);
+	cb->hnext = *b;
+	*b = cb;
+	cl->count++;
+}
+
+/*
+ * Unlink a cache block from its hash bucket
+ */
+static void hash_remove(cache_list *cl, node *cb)
+{
+	node **pp = bucket_of(cl, cb->hash);
+
+	while (*pp != NULL && *pp != cb)
+		pp = &(*pp)->hnext;
+
+	if (*pp == cb)
+	{
+		*pp = cb->hnext;
+		cb->hnext = NULL;
+		cl->count--;
+	}
+}
+
+/*
+ * Double the number of buckets and rehash every node
+ */
+static void hash_grow(cache_list *cl)
+{
+	unsigned int i, old_n = cl->nbuckets;
+	node **old = cl->buckets;
+	node *cb, *next;
+
+	cl->nbuckets = old_n * 2;
+	cl->buckets = (node **)calloc(cl->nbuckets, sizeof(node *));
+
+	for (i = 0; i < old_n; i++)
+	{
+		for (cb = old[i]; cb != NULL; cb = next)
+		{
+			node **b = bucket_of(cl, cb->hash);
+			next = cb->hnext;
+			cb->hnext = *b;
+			*b = cb;
+		}
+	}
+	free(old);
+}
@@ -1,5 +1,5 @@
 /*
- * cache.h 
+ * cache.h
  * Name: Ti-Fen Pan
  * Andrew ID: tpan
  * Prototypes and definitions for cache
@@ -8,39 +8,184 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <semaphore.h>
+#include "arena.h"
+
 #define MAX_CACHE_SIZE 1049000
 
+/* Initial number of hash buckets, always a power of two */
+#define CACHE_INIT_BUCKETS 256
+
+/* Shards used when the proxy is not told otherwise */
+#define CACHE_DEFAULT_SHARDS 8
+
+/* Snapshot files of the cache contents, version 3 with a checksum */
+#define SNAPSHOT_MAGIC   0x50585348	/* "PXSH" */
+#define SNAPSHOT_VERSION 3
+
+/* Freshness of nodes cached without any */
+#define CACHE_NEVER_STALE ((time_t)LONG_MAX)
+
+/* Eviction and admission policies, picked when the cache is created */
+typedef enum
+{
+	POLICY_LRU,			/* second-chance LRU */
+	POLICY_SLRU,		/* segmented LRU, probation then protected */
+	POLICY_TINYLFU,		/* LRU behind a frequency admission filter */
+	POLICY_GDSF,		/* greedy dual size frequency */
+	POLICY_COUNT
+}cache_policy;
+
+/*
+ * Freshness of a cached response, worked out from its headers
+ * when it is cached (see fresh.c). The validators are kept as
+ * offsets into the content, which holds the headers they came
+ * from. The times are read without the lock, so they are only
+ * accessed atomically.
+ */
+typedef struct
+{
+	time_t fresh_until;		/* served as is until then */
+	time_t stale_until;		/* then served while it is revalidated */
+	unsigned int etag_off;	/* ETag value, 0 length if none */
+	unsigned int etag_len;
+	unsigned int lm_off;	/* Last-Modified value, 0 length if none */
+	unsigned int lm_len;
+}cache_meta;
 
 /* Definition of cache node */
 typedef struct cachenode
 {
-	char *id;
+	char *id;			/* id and content are stored right after the node */
+	uint64_t hash;
     unsigned int _size;
-    char *content;
+    unsigned int footprint;	/* arena bytes taken, node and id included */
+    int referenced;		/* hit since it was last considered for eviction */
+    int refcnt;			/* one for the list plus one per pinned reader */
+    char *content;		/* never modified once the node is cached */
+    cache_meta meta;
+    int revalidating;	/* a stale hit started revalidating it */
     struct cachenode *next;
     struct cachenode *prev;
+    struct cachenode *hnext;	/* next node in the same hash bucket */
+    arena *home;			/* arena of the shard holding the node */
+
+    /* Bookkeeping of the eviction policy */
+    unsigned int freq;		/* hits plus one, for GDSF */
+    int segment;			/* protected segment of SLRU */
+    int heapidx;			/* position in the GDSF heap */
+    double priority;		/* GDSF value, lowest is evicted first */
 }node;
 
-/* Definition of cache list */
+/* Lookup statistics of a cache */
 typedef struct
 {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long probes;		/* nodes compared over all lookups */
+	unsigned long evictions;
+	unsigned long rejections;	/* objects the admission filter refused */
+	unsigned int objects;
 	unsigned int _size;
+	unsigned long arena_bytes;	/* pages taken by nodes, ids and content */
+	unsigned long compactions;
+}cache_stats;
+
+/*
+ * An evicted object handed to the next tier (see disk.c), with
+ * its id and content copied right behind it. The tier owns and
+ * frees it.
+ */
+typedef struct cache_spill
+{
+	struct cache_spill *next;
+	char *id;
+	uint64_t hash;
+	char *content;
+	unsigned int _size;
+	cache_meta meta;
+}cache_spill;
+
+struct policy_ops;
+
+/*
+ * Definition of cache list, one per shard. Each shard has its
+ * own capacity and its own readers-writers lock.
+ */
+typedef struct
+{
+	unsigned int _size;		/* arena bytes taken by cached nodes */
+	unsigned int capacity;	/* bytes of the arena */
 	node *head;
 	node *tail;
+
+	/* Hash index over the list, chained by node->hnext */
+	node **buckets;
+	unsigned int nbuckets;
+	unsigned int count;
+
+	/* Readers-writers lock, readers first */
+	int readcnt;
+	sem_t mutex;		/* protects readcnt */
+	sem_t w;			/* held by a writer or by the first reader */
+
+	cache_stats stats;
+
+	/* Memory reserved for the nodes of the shard */
+	arena mem;
+
+	/* State of the eviction policy, see policy.c */
+	const struct policy_ops *ops;
+	node *phead;		/* protected segment of SLRU */
+	node *ptail;
+	unsigned int protected_size;
+	unsigned short *sketch;		/* count-min sketch of TinyLFU */
+	unsigned int sketch_width;
+	unsigned long sketch_adds;
+	node **heap;		/* min-heap of GDSF by priority */
+	unsigned int heap_n;
+	unsigned int heap_cap;
+	double clock;		/* GDSF inflation, priority of the last victim */
 }cache_list;
 
+/* Definition of the sharded cache */
+typedef struct
+{
+	unsigned int nshards;
+	cache_policy policy;
+	cache_list *shards;
+	void (*spill)(cache_spill *s);	/* takes evicted objects, or NULL */
+}cache;
+
 /* Methods used in proxy.c */
-void init_cache_list(cache_list *cl);
-void update_cache(cache_list *cl, char *id, char *content,  
-				  unsigned int block_size);
-void free_cache_list(cache_list *cl);
-char* search_cache(cache_list *cl, char *id, int* size);
+cache *init_cache(unsigned int nshards, unsigned int capacity,
+				  cache_policy policy);
+int cache_policy_parse(const char *name);
+const char *cache_policy_name(cache_policy policy);
+uint64_t cache_hash(const char *id);
+void update_cache(cache *c, char *id, uint64_t hash,
+				  char *content, unsigned int block_size, cache_meta *meta);
+void refresh_cache(cache *c, char *id, uint64_t hash, cache_meta *meta);
+void free_cache(cache *c);
+node *search_cache(cache *c, char *id, uint64_t hash);
+void release_cache(node *cb);
+void get_cache_stats(cache *c, cache_stats *st);
+long cache_snapshot(cache *c, const char *path, unsigned long *bytes);
+long cache_restore(cache *c, const char *path, unsigned int max_size);
 
 
-node *new_cache(char *id, char *content, 
+void init_cache_list(cache_list *cl, unsigned int capacity,
+					 cache_policy policy);
+void free_cache_list(cache_list *cl);
+node *new_cache(cache_list *cl, char *id, char *content,
 				unsigned int block_size);
+unsigned int node_footprint(char *id, unsigned int block_size);
 void push_to_head(cache_list *cl, node *cb);
+void link_after(node *at, node *cb);
+void unlink_node(node *cb);
 node *delete_cache(cache_list *cl, node *cb);
-sem_t sem;
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,181 @@
+/*
+ * cachesim.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Replays a trace of requests against the cache of the proxy and
+ * reports the object and byte hit ratio of each eviction policy.
+ * Each line of the trace is one request, "<key> <bytes>", where
+ * the key names the object (a URL, say) and bytes is the size of
+ * its response. A miss caches the object the way the proxy does,
+ * so objects over MAX_OBJECT_SIZE are never cached.
+ *
+ * usage: cachesim [-c bytes] [-s shards] [-p policy] [trace]
+ *
+ * Without -p every policy replays the trace in turn. Without a
+ * trace file, the trace is read from standard input.
+ */
+
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+
+/* One request of the trace */
+typedef struct
+{
+	char *key;
+	uint64_t hash;
+	unsigned int size;
+}request;
+
+/* What a policy made of the trace */
+typedef struct
+{
+	unsigned long requests;
+	unsigned long hits;
+	unsigned long long bytes;
+	unsigned long long hit_bytes;
+}replay_result;
+
+cache *web_cache;
+
+static char payload[MAX_OBJECT_SIZE];
+
+void usage(char *prog);
+request *load_trace(FILE *fp, unsigned long *n);
+void replay(request *trace, unsigned long n, unsigned int capacity,
+			unsigned int nshards, cache_policy policy);
+
+
+int main(int argc, char **argv)
+{
+	int opt, policy = -1;
+	unsigned int capacity = MAX_CACHE_SIZE;
+	unsigned int nshards = 1;
+	unsigned long n;
+	request *trace;
+	FILE *fp = stdin;
+
+	while ((opt = getopt(argc, argv, "c:s:p:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			capacity = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			nshards = atoi(optarg);
+			break;
+		case 'p':
+			if ((policy = cache_policy_parse(optarg)) < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind > 1 || nshards < 1 || capacity < 1)
+		usage(argv[0]);
+
+	if (optind < argc && (fp = fopen(argv[optind], "r")) == NULL)
+		unix_error("Cannot open trace");
+	trace = load_trace(fp, &n);
+	if (fp != stdin)
+		fclose(fp);
+
+	printf("%-8s %10s %10s %9s %9s %10s %10s\n", "policy", "requests",
+		   "hits", "obj_hit%", "byte_hit%", "evictions", "rejections");
+	if (policy >= 0)
+		replay(trace, n, capacity, nshards, policy);
+	else
+		for (policy = 0; policy < POLICY_COUNT; policy++)
+			replay(trace, n, capacity, nshards, policy);
+
+	return 0;
+}
+
+/*
+ * Print the command line usage and exit
+ */
+void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-c bytes] [-s shards] [-p policy] "
+			"[trace]\n", prog);
+	fprintf(stderr, "   -c bytes   cache capacity (default %d)\n",
+			MAX_CACHE_SIZE);
+	fprintf(stderr, "   -s shards  cache shards (default 1)\n");
+	fprintf(stderr, "   -p policy  lru, slru, tinylfu or gdsf "
+			"(default: all of them)\n");
+	fprintf(stderr, "   trace      lines of \"<key> <bytes>\" "
+			"(default: standard input)\n");
+	exit(1);
+}
+
+/*
+ * Read the whole trace, hashing each key once
+ */
+request *load_trace(FILE *fp, unsigned long *n)
+{
+	char line[MAXLINE], key[MAXLINE];
+	unsigned long cap = 1024;
+	unsigned int size;
+	request *trace = (request *)Malloc(cap * sizeof(request));
+
+	*n = 0;
+	while (fgets(line, MAXLINE, fp) != NULL)
+	{
+		if (sscanf(line, "%s %u", key, &size) != 2)
+			continue;
+		if (*n == cap)
+		{
+			cap *= 2;
+			trace = (request *)Realloc(trace, cap * sizeof(request));
+		}
+		trace[*n].key = strdup(key);
+		trace[*n].hash = cache_hash(key);
+		trace[*n].size = size;
+		(*n)++;
+	}
+	return trace;
+}
+
+/*
+ * Replay the trace on an empty cache and print the result
+ */
+void replay(request *trace, unsigned long n, unsigned int capacity,
+			unsigned int nshards, cache_policy policy)
+{
+	unsigned long i;
+	replay_result r;
+	cache_stats cs;
+	node *hit;
+
+	web_cache = init_cache(nshards, capacity, policy);
+	memset(&r, 0, sizeof(r));
+
+	for (i = 0; i < n; i++)
+	{
+		r.requests++;
+		r.bytes += trace[i].size;
+		if ((hit = search_cache(web_cache, trace[i].key,
+								trace[i].hash)) != NULL)
+		{
+			r.hits++;
+			r.hit_bytes += trace[i].size;
+			release_cache(hit);
+		}
+		else if (trace[i].size < MAX_OBJECT_SIZE)
+			update_cache(web_cache, trace[i].key, trace[i].hash,
+						 payload, trace[i].size, NULL);
+	}
+
+	get_cache_stats(web_cache, &cs);
+	printf("%-8s %10lu %10lu %9.2f %9.2f %10lu %10lu\n",
+		   cache_policy_name(policy), r.requests, r.hits,
+		   r.requests ? 100.0 * r.hits / r.requests : 0.0,
+		   r.bytes ? 100.0 * r.hit_bytes / r.bytes : 0.0,
+		   cs.evictions, cs.rejections);
+	free_cache(web_cache);
+}
@@ -17,6 +17,7 @@
  */
 /* $begin csapp.c */
 #include "csapp.h"
+#include "scan.h"
 
 /************************** 
  * Error-handling functions
@@ -851,31 +852,42 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered), finding
+ *     its end with scan_char() rather than a byte at a time
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
+    int rc = 1;
+    size_t n = 0, cnt;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (n + 1 < maxlen && nl == NULL) {
+	/* Refill if needed, taking the first byte */
+	if ((rc = rio_read(rp, bufp, 1)) < 0)
 	    return -1;	  /* Error */
+	if (rc == 0)
+	    break;        /* EOF */
+	n++;
+	if (*bufp++ == '\n')
+	    break;
+
+	/* Copy the rest of the line in the buffer at once */
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = scan_char(rp->rio_bufptr, cnt, '\n')) != NULL)
+	    cnt = nl + 1 - rp->rio_bufptr;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	bufp += cnt;
+	n += cnt;
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
     }
+    if (rc == 0 && n == 0)
+	return 0; /* EOF, no data read */
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
@@ -0,0 +1,578 @@
+/*
+ * disk.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * A second cache tier behind the memory cache. Objects evicted
+ * from memory are appended to a log file, and an index in memory
+ * maps each request to where its latest record lies, so a miss
+ * in memory can still be served from disk: the record is read
+ * with pread and sent like a cached response.
+ *
+ * The log is a circular file of a fixed capacity. Every record
+ * has a log position that only grows, and lies at that position
+ * modulo the capacity; a record that would cross the end of the
+ * file starts over at its beginning. Appending a record drops
+ * the index entries of the oldest records it overwrites, which
+ * the index keeps in log order. A record is laid out as:
+ * [header: magic, lengths, log position, hash, checksum, freshness]
+ * [the request, NUL terminated]
+ * [the response]
+ * padded to DISK_ALIGN bytes.
+ *
+ * At startup the whole file is scanned for records whose magic,
+ * position and checksum are right. Only records the newest one
+ * has not wrapped over are still intact, and of those the
+ * latest record of each request wins, so a restart begins with
+ * every object the log held. Torn writes fail their checksum.
+ *
+ * Spilling never writes the file itself. Evicted objects are
+ * queued for a writer thread, and dropped once the queue holds
+ * DISK_QUEUE bytes or DISK_QUEUE_OBJECTS of the largest objects,
+ * whichever is more. So neither a worker thread nor an event
+ * loop ever waits for the disk; an object is only found on disk
+ * once it is written.
+ *
+ * Only fresh objects are spilled and served; a stale one is
+ * dropped from the index and fetched again. One semaphore guards
+ * the index and the write position, but reads and writes of the
+ * file happen without it. A record being read could be
+ * overwritten by appends meanwhile, so records within
+ * DISK_GUARD of being overwritten are not served, and a record
+ * is checked again after it was read and fetched instead if it
+ * happened anyway. Appends take their place in the log before
+ * writing, so a record still intact after the read was read
+ * whole.
+ */
+
+#include "csapp.h"
+#include <sys/uio.h>
+#include "disk.h"
+
+/* Header of a record in the log */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t idlen;			/* request bytes, with the NUL */
+	uint32_t size;			/* response bytes */
+	uint32_t head;
+	uint64_t lpos;
+	uint64_t hash;
+	uint64_t sum;			/* of the request and response */
+	int64_t fresh_until;
+	int64_t stale_until;
+	uint32_t etag_off;
+	uint32_t etag_len;
+	uint32_t lm_off;
+	uint32_t lm_len;
+}disk_record;
+
+/* Definition of an indexed record */
+typedef struct disk_entry
+{
+	char *id;
+	uint64_t hash;
+	unsigned int len;		/* bytes the record takes in the log */
+	disk_object obj;
+	struct disk_entry *hnext;	/* next entry in the same bucket */
+	struct disk_entry *prev;	/* log order, oldest first */
+	struct disk_entry *next;
+}disk_entry;
+
+static int fd = -1;
+static unsigned long capacity;
+static uint64_t wpos;				/* log position of the next record */
+static disk_entry *buckets[DISK_BUCKETS];
+static disk_entry log_order;		/* dummy head of the log order */
+static disk_stats stats;
+static sem_t mutex;
+static cache_spill *queue_head;		/* spills waiting for the writer */
+static cache_spill *queue_tail;
+static unsigned long queued;		/* bytes of the spills */
+static unsigned long queue_cap;		/* bytes they may take */
+static sem_t queue_mutex;			/* guards the queue */
+static sem_t queue_items;
+
+static unsigned int record_len(unsigned int idlen, unsigned int size);
+static uint64_t checksum(char *id, unsigned int idlen,
+						 char *content, unsigned int size);
+static unsigned int head_len(char *content, unsigned int size);
+static int append(cache_spill *s);
+static void *writer(void *vargp);
+static void recover(void);
+static int by_lpos(const void *a, const void *b);
+static disk_entry *find_entry(char *id, uint64_t hash);
+static int insert_entry(disk_entry *e);
+static void remove_entry(disk_entry *e);
+
+
+/*
+ * Open (or create) the log at path and index the objects it
+ * holds. Objects are at most max_object bytes. Return -1 if
+ * the file cannot be opened.
+ */
+int disk_init(char *path, unsigned long cap, unsigned int max_object)
+{
+	pthread_t tid;
+
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+		return -1;
+
+	capacity = cap;
+	queue_cap = DISK_QUEUE;
+	if (queue_cap < (unsigned long)DISK_QUEUE_OBJECTS * max_object)
+		queue_cap = (unsigned long)DISK_QUEUE_OBJECTS * max_object;
+	Sem_init(&mutex, 0, 1);
+	Sem_init(&queue_mutex, 0, 1);
+	Sem_init(&queue_items, 0, 0);
+	log_order.next = log_order.prev = &log_order;
+	recover();
+	Pthread_create(&tid, NULL, writer, NULL);
+	return 0;
+}
+
+/*
+ * Whether the proxy was started with a disk tier
+ */
+int disk_enabled(void)
+{
+	return fd >= 0;
+}
+
+/*
+ * Descriptor of the log, to send records from
+ */
+int disk_fd(void)
+{
+	return fd;
+}
+
+/*
+ * Take objects evicted from memory, the spill function of the
+ * cache, and queue them for the writer. Objects that are stale,
+ * or too large for the log, are not worth a write, and those
+ * finding the queue full are dropped too.
+ */
+void disk_spill(cache_spill *spilled)
+{
+	cache_spill *s, *next;
+	time_t now = time(NULL);
+
+	for (s = spilled; s != NULL; s = next)
+	{
+		next = s->next;
+		if (now >= s->meta.fresh_until ||
+			record_len(strlen(s->id) + 1, s->_size) >
+			capacity - DISK_GUARD(capacity))
+		{
+			__sync_fetch_and_add(&stats.dropped, 1);
+			Free(s);
+			continue;
+		}
+
+		P(&queue_mutex);
+		if (queued + s->_size > queue_cap)
+		{
+			V(&queue_mutex);
+			__sync_fetch_and_add(&stats.dropped, 1);
+			Free(s);
+			continue;
+		}
+		s->next = NULL;
+		if (queue_tail != NULL)
+			queue_tail->next = s;
+		else
+			queue_head = s;
+		queue_tail = s;
+		queued += s->_size;
+		V(&queue_mutex);
+		V(&queue_items);
+	}
+}
+
+/*
+ * Look a request up in the index. If a fresh record is found
+ * safely away from being overwritten, copy where it lies to
+ * obj and return 1, else return 0.
+ */
+int disk_lookup(char *id, uint64_t hash, disk_object *obj)
+{
+	disk_entry *e;
+	int found = 0;
+
+	P(&mutex);
+	if ((e = find_entry(id, hash)) != NULL)
+	{
+		if (time(NULL) >= e->obj.meta.fresh_until)
+			remove_entry(e);
+		else if (e->obj.lpos + capacity - DISK_GUARD(capacity) >= wpos)
+		{
+			*obj = e->obj;
+			found = 1;
+		}
+	}
+	if (found)
+		stats.hits++;
+	else
+		stats.misses++;
+	V(&mutex);
+	return found;
+}
+
+/*
+ * Whether the record of an object is still whole, to be checked
+ * after it was sent
+ */
+int disk_intact(disk_object *obj)
+{
+	int intact;
+
+	P(&mutex);
+	intact = obj->lpos + capacity >= wpos;
+	V(&mutex);
+	return intact;
+}
+
+/*
+ * Copy the statistics of the disk tier
+ */
+void get_disk_stats(disk_stats *st)
+{
+	if (fd < 0)
+	{
+		memset(st, 0, sizeof(*st));
+		return;
+	}
+	P(&mutex);
+	*st = stats;
+	V(&mutex);
+	P(&queue_mutex);
+	st->queued = queued;
+	V(&queue_mutex);
+}
+
+/*
+ * Bytes a record takes in the log, padding included
+ */
+static unsigned int record_len(unsigned int idlen, unsigned int size)
+{
+	unsigned int n = sizeof(disk_record) + idlen + size;
+
+	return (n + DISK_ALIGN - 1) / DISK_ALIGN * DISK_ALIGN;
+}
+
+/*
+ * FNV-1a over the request and response of a record
+ */
+static uint64_t checksum(char *id, unsigned int idlen,
+						 char *content, unsigned int size)
+{
+	uint64_t h = 14695981039346656037ULL;
+	unsigned int i;
+
+	for (i = 0; i < idlen; i++)
+		h = (h ^ (unsigned char)id[i]) * 1099511628211ULL;
+	for (i = 0; i < size; i++)
+		h = (h ^ (unsigned char)content[i]) * 1099511628211ULL;
+	return h;
+}
+
+/*
+ * Bytes before the blank line ending the headers of a
+ * response, 0 if it has none
+ */
+static unsigned int head_len(char *content, unsigned int size)
+{
+	unsigned int i;
+
+	for (i = 0; i + 3 < size; i++)
+	{
+		if (content[i] == '\r' && content[i + 1] == '\n' &&
+			content[i + 2] == '\r' && content[i + 3] == '\n')
+			return i + 2;
+	}
+	return 0;
+}
+
+/*
+ * Append an object to the log and index it. The place is
+ * reserved under the lock, written without it, then indexed
+ * unless the log wrapped over it meanwhile.
+ */
+static int append(cache_spill *s)
+{
+	unsigned int idlen = strlen(s->id) + 1;
+	unsigned int len = record_len(idlen, s->_size);
+	disk_record rec;
+	disk_entry *e;
+	struct iovec iov[3];
+	uint64_t lpos;
+	off_t off;
+
+	P(&mutex);
+
+	/* A record never crosses the end of the file */
+	lpos = wpos;
+	if (lpos % capacity + len > capacity)
+		lpos += capacity - lpos % capacity;
+	wpos = lpos + len;
+
+	/* Forget the records it overwrites */
+	while ((e = log_order.next) != &log_order && e->obj.lpos + capacity < wpos)
+	{
+		remove_entry(e);
+		stats.overwritten++;
+	}
+	V(&mutex);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = DISK_MAGIC;
+	rec.idlen = idlen;
+	rec.size = s->_size;
+	rec.head = head_len(s->content, s->_size);
+	rec.lpos = lpos;
+	rec.hash = s->hash;
+	rec.sum = checksum(s->id, idlen, s->content, s->_size);
+	rec.fresh_until = s->meta.fresh_until;
+	rec.stale_until = s->meta.stale_until;
+	rec.etag_off = s->meta.etag_off;
+	rec.etag_len = s->meta.etag_len;
+	rec.lm_off = s->meta.lm_off;
+	rec.lm_len = s->meta.lm_len;
+
+	off = lpos % capacity;
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = s->id;
+	iov[1].iov_len = idlen;
+	iov[2].iov_base = s->content;
+	iov[2].iov_len = s->_size;
+	if (pwritev(fd, iov, 3, off) != (ssize_t)(sizeof(rec) + idlen + s->_size))
+		return -1;
+
+	e = (disk_entry *)Malloc(sizeof(disk_entry));
+	e->id = strdup(s->id);
+	e->hash = s->hash;
+	e->len = len;
+	e->obj.lpos = lpos;
+	e->obj.off = off + sizeof(rec) + idlen;
+	e->obj._size = s->_size;
+	e->obj.head = rec.head;
+	e->obj.meta = s->meta;
+
+	P(&mutex);
+	stats.spills++;
+	if (lpos + capacity >= wpos)
+		insert_entry(e);
+	else
+	{
+		free(e->id);
+		Free(e);
+	}
+	V(&mutex);
+	return 0;
+}
+
+/*
+ * Append the queued spills to the log, one at a time
+ */
+static void *writer(void *vargp)
+{
+	cache_spill *s;
+
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		P(&queue_items);
+		P(&queue_mutex);
+		s = queue_head;
+		if ((queue_head = s->next) == NULL)
+			queue_tail = NULL;
+		V(&queue_mutex);
+
+		append(s);
+
+		P(&queue_mutex);
+		queued -= s->_size;
+		V(&queue_mutex);
+		Free(s);
+	}
+	return NULL;
+}
+
+/*
+ * Rebuild the index from the log left by a previous run
+ */
+static void recover(void)
+{
+	struct stat st;
+	disk_record rec;
+	disk_entry **found = NULL, *e;
+	unsigned long nfound = 0, cap = 0, i;
+	unsigned int len, bufsize = 0;
+	uint64_t end = 0;
+	off_t off, size;
+	char *buf = NULL;
+
+	if (fstat(fd, &st) < 0)
+		return;
+	size = st.st_size < (off_t)capacity ? st.st_size : (off_t)capacity;
+
+	/* Every record that is whole, skipping ahead past damage */
+	for (off = 0; off + (off_t)sizeof(rec) <= size; )
+	{
+		if (pread(fd, &rec, sizeof(rec), off) != sizeof(rec))
+			break;
+		len = record_len(rec.idlen, rec.size);
+		if (rec.magic != DISK_MAGIC || rec.lpos % capacity != (uint64_t)off ||
+			rec.idlen == 0 || rec.idlen > MAXLINE ||
+			rec.size > capacity ||
+			off + sizeof(rec) + rec.idlen + rec.size > (uint64_t)size)
+		{
+			off += DISK_ALIGN;
+			continue;
+		}
+
+		if (rec.idlen + rec.size > bufsize)
+		{
+			bufsize = rec.idlen + rec.size;
+			buf = (char *)Realloc(buf, bufsize);
+		}
+		if (pread(fd, buf, rec.idlen + rec.size, off + sizeof(rec)) !=
+			(ssize_t)(rec.idlen + rec.size) || buf[rec.idlen - 1] != '\0' ||
+			checksum(buf, rec.idlen, buf + rec.idlen, rec.size) != rec.sum)
+		{
+			off += DISK_ALIGN;
+			continue;
+		}
+
+		e = (disk_entry *)Malloc(sizeof(disk_entry));
+		e->id = strdup(buf);
+		e->hash = rec.hash;
+		e->len = len;
+		e->obj.lpos = rec.lpos;
+		e->obj.off = off + sizeof(rec) + rec.idlen;
+		e->obj._size = rec.size;
+		e->obj.head = rec.head;
+		e->obj.meta.fresh_until = rec.fresh_until;
+		e->obj.meta.stale_until = rec.stale_until;
+		e->obj.meta.etag_off = rec.etag_off;
+		e->obj.meta.etag_len = rec.etag_len;
+		e->obj.meta.lm_off = rec.lm_off;
+		e->obj.meta.lm_len = rec.lm_len;
+		if (nfound == cap)
+		{
+			cap = cap ? cap * 2 : 256;
+			found = (disk_entry **)Realloc(found, cap * sizeof(disk_entry *));
+		}
+		found[nfound++] = e;
+		if (rec.lpos + len > end)
+			end = rec.lpos + len;
+		off += len;
+	}
+	free(buf);
+
+	/*
+	 * Appends go on after the newest record. In log order, a
+	 * later record of the same request replaces an earlier one.
+	 */
+	wpos = end;
+	if (nfound > 0)
+		qsort(found, nfound, sizeof(disk_entry *), by_lpos);
+	for (i = 0; i < nfound; i++)
+	{
+		e = found[i];
+		if (e->obj.lpos + capacity >= wpos)
+			stats.recovered += insert_entry(e);
+		else
+		{
+			free(e->id);
+			Free(e);
+		}
+	}
+	free(found);
+}
+
+/*
+ * Order recovered records by log position
+ */
+static int by_lpos(const void *a, const void *b)
+{
+	uint64_t x = (*(disk_entry **)a)->obj.lpos;
+	uint64_t y = (*(disk_entry **)b)->obj.lpos;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Return the entry of a request, NULL if it has none.
+ * The caller holds the lock.
+ */
+static disk_entry *find_entry(char *id, uint64_t hash)
+{
+	disk_entry *e = buckets[hash & (DISK_BUCKETS - 1)];
+
+	while (e != NULL && (e->hash != hash || strcmp(e->id, id)))
+		e = e->hnext;
+	return e;
+}
+
+/*
+ * Index an entry in its bucket and in log order, replacing
+ * an older entry of the same request. Return 0, freeing the
+ * entry, if a newer one is indexed already. The caller holds
+ * the lock.
+ */
+static int insert_entry(disk_entry *e)
+{
+	disk_entry **b = &buckets[e->hash & (DISK_BUCKETS - 1)];
+	disk_entry *at, *old;
+
+	if ((old = find_entry(e->id, e->hash)) != NULL)
+	{
+		if (old->obj.lpos > e->obj.lpos)
+		{
+			free(e->id);
+			Free(e);
+			return 0;
+		}
+		remove_entry(old);
+	}
+	e->hnext = *b;
+	*b = e;
+
+	/* Appends finish about in order, so look from the newest */
+	at = log_order.prev;
+	while (at != &log_order && at->obj.lpos > e->obj.lpos)
+		at = at->prev;
+	e->prev = at;
+	e->next = at->next;
+	at->next->prev = e;
+	at->next = e;
+
+	stats.objects++;
+	stats.bytes += e->len;
+	return 1;
+}
+
+/*
+ * Drop an entry from the index and free it. The caller
+ * holds the lock.
+ */
+static void remove_entry(disk_entry *e)
+{
+	disk_entry **pp = &buckets[e->hash & (DISK_BUCKETS - 1)];
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+
+	stats.objects--;
+	stats.bytes -= e->len;
+	free(e->id);
+	Free(e);
+}
@@ -0,0 +1,59 @@
+/*
+ * disk.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Second cache tier, a log of evicted objects on disk
+ */
+
+#ifndef DISK_H
+#define DISK_H
+
+#include "csapp.h"
+#include "cache.h"
+
+#define DISK_DEFAULT_SIZE (64 << 20)	/* bytes of log, -D changes it */
+#define DISK_ALIGN        512			/* records start on this boundary */
+#define DISK_BUCKETS      4096			/* index chains, a power of two */
+#define DISK_MAGIC        0x50584c32	/* "PXL2", keyed by request_key() */
+#define DISK_QUEUE        (4 << 20)		/* bytes of spills waiting, at least */
+#define DISK_QUEUE_OBJECTS 4			/* of the largest objects, at least */
+
+/*
+ * Records about to be overwritten are not served, so a read
+ * is only wasted if this many bytes get spilled during it
+ */
+#define DISK_GUARD(cap)   ((cap) / 4)
+
+/* Where a cached object lies in the log, copied out of the index */
+typedef struct
+{
+	uint64_t lpos;			/* log position of its record */
+	off_t off;				/* file offset of the content */
+	unsigned int _size;
+	unsigned int head;		/* bytes before the blank line of the headers */
+	cache_meta meta;
+}disk_object;
+
+/* Statistics of the disk tier */
+typedef struct
+{
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long spills;		/* records appended */
+	unsigned long dropped;		/* evictions not worth keeping, or no room */
+	unsigned long queued;		/* bytes waiting for the writer */
+	unsigned long overwritten;	/* records the log wrapped over */
+	unsigned long recovered;	/* records found at startup */
+	unsigned long objects;
+	unsigned long long bytes;
+}disk_stats;
+
+int disk_init(char *path, unsigned long capacity, unsigned int max_object);
+int disk_enabled(void);
+void disk_spill(cache_spill *spilled);
+int disk_lookup(char *id, uint64_t hash, disk_object *obj);
+int disk_fd(void);
+int disk_intact(disk_object *obj);
+void get_disk_stats(disk_stats *st);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * dns.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * A cache in front of getaddrinfo, so a popular server is not
+ * resolved again for every miss. Entries are keyed by "host:port"
+ * and chained in a fixed hash table. Each holds a copy of up to
+ * DNS_MAX_ADDRS addresses and the time it expires; getaddrinfo
+ * does not report record TTLs, so every name is trusted for
+ * DNS_TTL seconds. Failed lookups are cached too, for a shorter
+ * DNS_NEG_TTL, so a bad name cannot make every request wait on
+ * the resolver. Expired entries are dropped from a chain when a
+ * new entry is added to it.
+ *
+ * One semaphore guards the table, but it is never held across
+ * getaddrinfo. Two threads missing on the same name both resolve
+ * it and the second insert replaces the first.
+ */
+
+#include "csapp.h"
+#include "cache.h"
+#include "dns.h"
+
+/* Definition of a cached name */
+typedef struct dns_entry
+{
+	char *key;					/* "host:port" */
+	uint64_t hash;
+	time_t expires;
+	int err;					/* getaddrinfo error, 0 if resolved */
+	int naddrs;
+	dns_addr addrs[DNS_MAX_ADDRS];
+	struct dns_entry *next;
+}dns_entry;
+
+static dns_entry *buckets[DNS_BUCKETS];
+static dns_stats stats;
+static sem_t mutex;
+
+static void free_entry(dns_entry *e);
+static unsigned long elapsed_ns(struct timespec *start);
+
+
+/*
+ * Initialize the empty resolver cache
+ */
+void dns_init(void)
+{
+	memset(buckets, 0, sizeof(buckets));
+	memset(&stats, 0, sizeof(stats));
+	Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * Copy up to max addresses of host:port into addrs, from the
+ * cache if possible. Return how many, or -1 if it cannot be
+ * resolved.
+ */
+int dns_lookup(char *host, char *port, dns_addr *addrs, int max)
+{
+	char key[MAXLINE];
+	uint64_t hash;
+	dns_entry *e, **pp;
+	struct addrinfo hints, *listp, *p;
+	struct timespec start;
+	unsigned long ns;
+	time_t now = time(NULL);
+	int n, rc;
+
+	snprintf(key, sizeof(key), "%s:%s", host, port);
+	hash = cache_hash(key);
+
+	/* Look for a live entry */
+	P(&mutex);
+	stats.lookups++;
+	for (e = buckets[hash & (DNS_BUCKETS - 1)]; e != NULL; e = e->next)
+	{
+		if (e->hash == hash && e->expires > now && !strcmp(e->key, key))
+			break;
+	}
+	if (e != NULL)
+	{
+		stats.hits++;
+		if (e->err)
+		{
+			stats.negative_hits++;
+			V(&mutex);
+			return -1;
+		}
+		n = e->naddrs < max ? e->naddrs : max;
+		memcpy(addrs, e->addrs, n * sizeof(dns_addr));
+		V(&mutex);
+		return n;
+	}
+	V(&mutex);
+
+	/* Cache miss: resolve without holding the lock */
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = getaddrinfo(host, port, &hints, &listp);
+	ns = elapsed_ns(&start);
+
+	e = (dns_entry *)Calloc(1, sizeof(dns_entry));
+	e->key = strdup(key);
+	e->hash = hash;
+	e->err = rc;
+	e->expires = now + (rc ? DNS_NEG_TTL : DNS_TTL);
+	if (rc == 0)
+	{
+		for (p = listp; p && e->naddrs < DNS_MAX_ADDRS; p = p->ai_next)
+		{
+			dns_addr *a = &e->addrs[e->naddrs++];
+			a->family = p->ai_family;
+			a->socktype = p->ai_socktype;
+			a->protocol = p->ai_protocol;
+			a->addrlen = p->ai_addrlen;
+			memcpy(&a->addr, p->ai_addr, p->ai_addrlen);
+		}
+		freeaddrinfo(listp);
+	}
+	n = e->naddrs < max ? e->naddrs : max;
+	memcpy(addrs, e->addrs, n * sizeof(dns_addr));
+
+	/* Insert it, dropping older entries of the same name and expired ones */
+	P(&mutex);
+	stats.resolved++;
+	if (rc)
+		stats.failed++;
+	stats.resolve_ns += ns;
+	if (ns > stats.max_resolve_ns)
+		stats.max_resolve_ns = ns;
+
+	pp = &buckets[hash & (DNS_BUCKETS - 1)];
+	while (*pp != NULL)
+	{
+		dns_entry *old = *pp;
+		if (old->expires <= now || (old->hash == hash && !strcmp(old->key, key)))
+		{
+			*pp = old->next;
+			free_entry(old);
+			stats.entries--;
+			continue;
+		}
+		pp = &old->next;
+	}
+	e->next = buckets[hash & (DNS_BUCKETS - 1)];
+	buckets[hash & (DNS_BUCKETS - 1)] = e;
+	stats.entries++;
+	V(&mutex);
+
+	return rc ? -1 : n;
+}
+
+/*
+ * Forget host:port, e.g. after none of its addresses answered
+ */
+void dns_invalidate(char *host, char *port)
+{
+	char key[MAXLINE];
+	uint64_t hash;
+	dns_entry **pp;
+
+	snprintf(key, sizeof(key), "%s:%s", host, port);
+	hash = cache_hash(key);
+
+	P(&mutex);
+	pp = &buckets[hash & (DNS_BUCKETS - 1)];
+	while (*pp != NULL)
+	{
+		dns_entry *e = *pp;
+		if (e->hash == hash && !strcmp(e->key, key))
+		{
+			*pp = e->next;
+			free_entry(e);
+			stats.entries--;
+			continue;
+		}
+		pp = &e->next;
+	}
+	V(&mutex);
+}
+
+/*
+ * open_clientfd on top of the resolver cache. On error,
+ * returns -1 and sets errno.
+ */
+int dns_open_clientfd(char *host, char *port)
+{
+	dns_addr addrs[DNS_MAX_ADDRS];
+	int i, n, clientfd;
+
+	if ((n = dns_lookup(host, port, addrs, DNS_MAX_ADDRS)) < 0)
+		return -1;
+
+	/* Walk the addresses for one that we can connect to */
+	for (i = 0; i < n; i++)
+	{
+		if ((clientfd = socket(addrs[i].family, addrs[i].socktype,
+							   addrs[i].protocol)) < 0)
+			continue;
+		if (connect(clientfd, (SA *)&addrs[i].addr, addrs[i].addrlen) != -1)
+			return clientfd;
+		close(clientfd);
+	}
+
+	/* The cached addresses may be out of date */
+	dns_invalidate(host, port);
+	return -1;
+}
+
+/*
+ * Copy the statistics of the resolver cache
+ */
+void get_dns_stats(dns_stats *st)
+{
+	P(&mutex);
+	*st = stats;
+	V(&mutex);
+}
+
+static void free_entry(dns_entry *e)
+{
+	free(e->key);
+	free(e);
+}
+
+static unsigned long elapsed_ns(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000000000UL +
+		   (end.tv_nsec - start->tv_nsec);
+}
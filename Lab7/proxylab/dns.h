@@ -0,0 +1,47 @@
+/*
+ * dns.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Resolver cache used to connect to servers
+ */
+
+#ifndef DNS_H
+#define DNS_H
+
+#include "csapp.h"
+
+#define DNS_BUCKETS   256	/* hash chains, a power of two */
+#define DNS_MAX_ADDRS 8		/* addresses kept per name */
+#define DNS_TTL       60	/* seconds a resolved name is trusted */
+#define DNS_NEG_TTL   5		/* seconds a failed lookup is remembered */
+
+/* One address of a resolved name */
+typedef struct
+{
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+}dns_addr;
+
+/* Statistics of the resolver cache */
+typedef struct
+{
+	unsigned long lookups;
+	unsigned long hits;
+	unsigned long negative_hits;	/* hits on a remembered failure */
+	unsigned long resolved;			/* getaddrinfo calls */
+	unsigned long failed;			/* getaddrinfo calls that failed */
+	unsigned long resolve_ns;		/* time spent in getaddrinfo */
+	unsigned long max_resolve_ns;
+	unsigned long entries;
+}dns_stats;
+
+void dns_init(void);
+int dns_lookup(char *host, char *port, dns_addr *addrs, int max);
+void dns_invalidate(char *host, char *port);
+int dns_open_clientfd(char *host, char *port);
+void get_dns_stats(dns_stats *st);
+
+#endif
@@ -0,0 +1,821 @@
+/*
+ * event.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * An event-driven alternative to the thread pool. Every event
+ * loop thread owns a listening socket bound with SO_REUSEPORT,
+ * so the kernel spreads new connections over the loops, and an
+ * epoll instance watching the client and server sockets of its
+ * connections. All sockets are non-blocking, and a connection
+ * moves through these states without ever blocking its loop:
+ *
+ * READ_REQUEST    read the client until the blank line ending
+ *                 the headers, then look the request up in cache
+ * CONNECTING      wait for the non-blocking connect to the server
+ * SEND_REQUEST    write the rewritten request to the server
+ * RELAY           pipe the response from the server to the client
+ *                 one chunk at a time, copying it for the cache
+ * WRITE_RESPONSE  write a cache hit or a page of the proxy
+ *
+ * The loops only do part of what the threads do. They skip
+ * the disk tier, single-flight, the upstream pool and
+ * revalidation: a memory miss is never looked up on disk,
+ * concurrent misses of one request each fetch it, every fetch
+ * opens a new server connection that is closed with the
+ * response, and cache hits are only served while fresh, a
+ * stale copy being fetched again in full and replaced.
+ *
+ * When the client asked for a persistent connection and the
+ * response carries its own framing, the connection goes back to
+ * READ_REQUEST, and requests already pipelined into its input
+ * buffer are served right away. Otherwise it is closed. Waiting
+ * connections only cost their struct. A connection making no
+ * progress for EVENT_IDLE_TIMEOUT seconds is closed in any
+ * state, so a stalled client or server cannot hold it forever.
+ *
+ * Nothing a loop does waits for the disk: objects the cache
+ * evicts are queued for the writer of the disk tier, and
+ * /__snapshot only asks the snapshot thread for one, answering
+ * 202 before it is written. The one wait left is the resolver,
+ * for the first request to a server (see open_nonblock_clientfd).
+ *
+ * epoll is used level-triggered. After each step the interest of
+ * both sockets is derived from the state of the connection.
+ */
+
+#include "csapp.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include "cache.h"
+#include "proxy.h"
+#include "event.h"
+#include "dns.h"
+#include "fresh.h"
+#include "bufpool.h"
+#include "request.h"
+#include "metrics.h"
+#include "accesslog.h"
+
+/* States of a connection */
+enum { CLOSED, READ_REQUEST, CONNECTING, SEND_REQUEST, RELAY, WRITE_RESPONSE };
+
+typedef struct conn conn;
+
+/* One socket as registered with epoll */
+typedef struct
+{
+	conn *c;				/* owning connection, NULL for the listener */
+	int fd;
+	unsigned int events;	/* interest registered now, 0 if none */
+}handle;
+
+/* Definition of a client connection */
+struct conn
+{
+	handle client;
+	handle server;
+	int state;
+	int keepalive;			/* client wants the connection kept open */
+	int has_length;			/* response end is known without a close */
+	int head_seen;			/* the response headers were all read */
+	time_t last_active;
+	conn *prev;				/* connections of the same loop */
+	conn *next;
+
+	/* Request bytes read from the client, NUL terminated */
+	char *in;
+	size_t inlen;
+	size_t consumed;		/* bytes of in used by the current request */
+
+	/* Rewritten request for the server, and its cache key */
+	char *request;
+	size_t reqlen;
+	size_t reqsent;
+	char *key;
+	uint64_t key_hash;
+
+	/* Timing of the request, by metrics_now() */
+	uint64_t received;		/* when it was all read, 0 once answered */
+	uint64_t connecting;	/* when the connect to the server began */
+	int first_sent;			/* first byte of the response written */
+
+	/* What the access log says of the request */
+	uint32_t addr;			/* of the client, IPv4 in network order */
+	const char *uri;		/* in the input buffer */
+	size_t urilen;
+	int status;				/* of the response, 0 if unknown */
+	unsigned long sent;		/* bytes written to the client */
+	metric_counter outcome;
+
+	/* Response being written to the client */
+	node *cached;			/* pinned cache hit */
+	char *local;			/* page built by the proxy */
+	char *relay;			/* last chunk read from the server */
+	char *out;
+	size_t outlen;
+	size_t outsent;
+
+	/* Copy of a missed response for the cache */
+	growbuf copy;
+	int fit_size;
+};
+
+/* Definition of an event loop */
+typedef struct
+{
+	int epfd;
+	handle listener;
+	time_t now;
+	conn conns;				/* dummy head of the connection list */
+	conn *dead;				/* closed during this batch of events */
+}loop;
+
+static void *loop_thread(void *vargp);
+static void loop_main(char *port);
+static void accept_clients(loop *l);
+static void progress(loop *l, conn *c, handle *h);
+static int start_request(conn *c);
+static int finish_response(loop *l, conn *c);
+static void first_byte(conn *c);
+static void answered(conn *c, metric_counter outcome);
+static void close_server(conn *c);
+static void close_conn(loop *l, conn *c);
+static void free_dead(loop *l);
+static void sweep_idle(loop *l);
+static void set_interest(loop *l, handle *h, unsigned int events);
+static int open_nonblock_clientfd(char *hostname, char *port);
+
+
+/*
+ * Run nloops event loops on port, one per CPU if nloops is 0.
+ * The calling thread becomes one of them, so it never returns.
+ */
+void event_run(char *port, int nloops)
+{
+	int i;
+	pthread_t tid;
+	struct rlimit rl;
+
+	if (nloops <= 0)
+		nloops = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nloops <= 0)
+		nloops = 1;
+
+	/* Allow as many open connections as the hard limit does */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	for (i = 1; i < nloops; i++)
+		Pthread_create(&tid, NULL, loop_thread, port);
+	loop_main(port);
+}
+
+static void *loop_thread(void *vargp)
+{
+	Pthread_detach(Pthread_self());
+	loop_main((char *)vargp);
+	return NULL;
+}
+
+/*
+ * Wait for events and hand them to the connections they
+ * belong to. Connections closed while handling a batch are
+ * freed only after it, since later events may refer to them.
+ */
+static void loop_main(char *port)
+{
+	loop l;
+	struct epoll_event evs[EVENT_BATCH];
+	time_t last_sweep;
+	int i, n;
+
+	if ((l.epfd = epoll_create1(0)) < 0)
+		unix_error("epoll_create1 error");
+	l.conns.next = l.conns.prev = &l.conns;
+	l.dead = NULL;
+	l.now = last_sweep = time(NULL);
+
+	l.listener.c = NULL;
+	l.listener.events = 0;
+	l.listener.fd = open_reuseport_listenfd(port);
+	if (l.listener.fd < 0)
+		unix_error("Open_listenfd error");
+	set_interest(&l, &l.listener, EPOLLIN);
+
+	while (1)
+	{
+		n = epoll_wait(l.epfd, evs, EVENT_BATCH, 1000);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			unix_error("epoll_wait error");
+		}
+		l.now = time(NULL);
+
+		for (i = 0; i < n; i++)
+		{
+			handle *h = (handle *)evs[i].data.ptr;
+
+			if (h->c == NULL)
+				accept_clients(&l);
+			else if (h->c->state != CLOSED)
+				progress(&l, h->c, h);
+		}
+
+		if (l.now != last_sweep)
+		{
+			sweep_idle(&l);
+			last_sweep = l.now;
+		}
+		free_dead(&l);
+	}
+}
+
+/*
+ * Accept every pending connection of the listener
+ */
+static void accept_clients(loop *l)
+{
+	int fd;
+	conn *c;
+	struct sockaddr_in addr;
+	socklen_t len;
+	int one = 1;
+
+	while (1)
+	{
+		len = sizeof(addr);
+		fd = accept(l->listener.fd, (SA *)&addr, &len);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* Nothing left, or out of descriptors for now */
+			return;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		c = (conn *)Calloc(1, sizeof(conn));
+		c->client.c = c;
+		c->client.fd = fd;
+		c->server.c = c;
+		c->server.fd = -1;
+		c->addr = addr.sin_family == AF_INET ? addr.sin_addr.s_addr : 0;
+		c->state = READ_REQUEST;
+		c->last_active = l->now;
+
+		c->next = l->conns.next;
+		c->prev = &l->conns;
+		l->conns.next->prev = c;
+		l->conns.next = c;
+
+		set_interest(l, &c->client, EPOLLIN);
+	}
+}
+
+/*
+ * Move a connection forward as far as its sockets allow,
+ * h is the socket that became ready
+ */
+static void progress(loop *l, conn *c, handle *h)
+{
+	ssize_t n;
+	int rc;
+	fresh_info fi;
+	cache_meta meta;
+
+	c->last_active = l->now;
+
+	/* The non-blocking connect finished, successfully or not */
+	if (c->state == CONNECTING && h == &c->server)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0
+				|| err != 0)
+		{
+			close_conn(l, c);
+			return;
+		}
+		metrics_since(METRIC_CONNECT, c->connecting);
+		c->state = SEND_REQUEST;
+	}
+
+	while (1)
+	{
+		switch (c->state)
+		{
+		case READ_REQUEST:
+			if (c->in == NULL)
+			{
+				c->in = (char *)Malloc(MAXLINE);
+				c->inlen = 0;
+				c->in[0] = '\0';
+			}
+
+			/* Start the request once it is all buffered */
+			if ((rc = start_request(c)) < 0)
+			{
+				close_conn(l, c);
+				return;
+			}
+			if (rc > 0)
+				continue;
+
+			/* Request headers too large */
+			if (c->inlen >= MAXLINE - 1)
+			{
+				close_conn(l, c);
+				return;
+			}
+
+			n = read(c->client.fd, c->in + c->inlen,
+					 MAXLINE - 1 - c->inlen);
+			if (n > 0)
+			{
+				c->inlen += n;
+				c->in[c->inlen] = '\0';
+				continue;
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				break;
+			close_conn(l, c);
+			return;
+
+		case CONNECTING:
+			break;
+
+		case SEND_REQUEST:
+			n = write(c->server.fd, c->request + c->reqsent,
+					  c->reqlen - c->reqsent);
+			if (n > 0)
+			{
+				c->reqsent += n;
+				if (c->reqsent == c->reqlen)
+					c->state = RELAY;
+				continue;
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				break;
+			close_conn(l, c);
+			return;
+
+		case RELAY:
+			/* Flush the last chunk before reading the next one */
+			if (c->outsent < c->outlen)
+			{
+				first_byte(c);
+				n = write(c->client.fd, c->out + c->outsent,
+						  c->outlen - c->outsent);
+				if (n > 0)
+				{
+					c->outsent += n;
+					c->sent += n;
+					continue;
+				}
+				if (n < 0 && (errno == EAGAIN || errno == EINTR))
+					break;
+				close_conn(l, c);
+				return;
+			}
+
+			n = read(c->server.fd, c->relay, MAXBUF);
+			if (n > 0)
+			{
+				/*
+				 * Keep a copy while it fits the max object size, and
+				 * the headers at least until their blank line was read
+				 */
+				if (c->fit_size || !c->head_seen)
+					growbuf_append(&c->copy, c->relay, n);
+				if (c->copy.len >= max_object_size)
+					c->fit_size = 0;
+				if (!c->head_seen && (c->copy.len >= MAXBUF ||
+						header_end(c->copy.data, c->copy.len) != NULL))
+				{
+					c->head_seen = 1;
+					c->has_length = response_delimited(c->copy.data, c->copy.len);
+					c->status = response_status(c->copy.data, c->copy.len);
+				}
+
+				c->out = c->relay;
+				c->outlen = n;
+				c->outsent = 0;
+				continue;
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				break;
+			if (n < 0)
+			{
+				close_conn(l, c);
+				return;
+			}
+
+			/* The server closed, the response is complete */
+			close_server(c);
+			if (c->fit_size && c->copy.len > 0)
+			{
+				/* Cache what the server said, not how it framed this hop */
+				c->copy.len = strip_hop_headers(c->copy.data, c->copy.len);
+				fresh_parse(&fi, c->copy.data, c->copy.len);
+				if (fresh_cacheable(&fi))
+				{
+					fresh_meta(&fi, time(NULL), &meta);
+					update_cache(web_cache, c->key, c->key_hash,
+								 c->copy.data, c->copy.len, &meta);
+				}
+			}
+			if (!finish_response(l, c))
+				return;
+			continue;
+
+		case WRITE_RESPONSE:
+			if (c->outsent < c->outlen)
+			{
+				first_byte(c);
+				n = write(c->client.fd, c->out + c->outsent,
+						  c->outlen - c->outsent);
+				if (n > 0)
+				{
+					c->outsent += n;
+					c->sent += n;
+					continue;
+				}
+				if (n < 0 && (errno == EAGAIN || errno == EINTR))
+					break;
+				close_conn(l, c);
+				return;
+			}
+			if (!finish_response(l, c))
+				return;
+			continue;
+		}
+		break;
+	}
+
+	/* Wait for whatever the current state needs */
+	switch (c->state)
+	{
+	case READ_REQUEST:
+		set_interest(l, &c->client, EPOLLIN);
+		set_interest(l, &c->server, 0);
+		break;
+	case CONNECTING:
+	case SEND_REQUEST:
+		set_interest(l, &c->client, 0);
+		set_interest(l, &c->server, EPOLLOUT);
+		break;
+	case RELAY:
+		if (c->outsent < c->outlen)
+		{
+			set_interest(l, &c->client, EPOLLOUT);
+			set_interest(l, &c->server, 0);
+		}
+		else
+		{
+			set_interest(l, &c->client, 0);
+			set_interest(l, &c->server, EPOLLIN);
+		}
+		break;
+	case WRITE_RESPONSE:
+		set_interest(l, &c->client, EPOLLOUT);
+		break;
+	}
+}
+
+/*
+ * Handle the request at the start of the input buffer: serve
+ * it from the proxy or the cache, or start connecting to the
+ * server. Return 0 if it is not all buffered yet, -1 if the
+ * connection should be closed.
+ */
+static int start_request(conn *c)
+{
+	http_request req;
+	struct iovec iov[REQ_MAX_IOV];
+	char host[REQ_MAX_HOST + 1], p[20];
+	uint64_t start = metrics_now();
+	int rc;
+
+	if ((rc = request_parse(c->in, c->inlen, &req)) <= 0)
+		return rc;
+	metrics_since(METRIC_PARSE, start);
+	c->received = start;
+	c->first_sent = 0;
+	c->uri = req.uri.p;
+	c->urilen = req.uri.n;
+	c->status = 0;
+	c->sent = 0;
+	c->consumed = req.len;
+	c->keepalive = req.keepalive;
+
+	/* The request is written from one flat copy */
+	c->request = (char *)Malloc(MAXLINE);
+	c->reqlen = request_flatten(iov, request_iov(&req, 0, iov),
+								c->request, MAXLINE);
+	c->key = (char *)Malloc(MAXLINE);
+	if (c->reqlen == 0 || request_key(&req, c->key, MAXLINE) == 0)
+		return -1;
+	slice_copy(req.host, host);
+
+	c->outlen = c->outsent = 0;
+
+	/* Requests for the proxy itself */
+	if (slice_is(req.uri, "/__stats") ||
+		slice_is(req.uri, "/__stats?format=json") ||
+		slice_is(req.uri, "/__snapshot"))
+	{
+		c->local = (char *)Malloc(MAXBUF);
+		c->out = c->local;
+		c->outlen = slice_is(req.uri, "/__snapshot") ?
+			request_snapshot(c->local, MAXBUF) :
+			build_stats(c->local, MAXBUF,
+						slice_is(req.uri, "/__stats?format=json"));
+		c->has_length = 1;
+		c->status = response_status(c->local, c->outlen);
+		c->outcome = METRIC_LOCAL;
+		c->state = WRITE_RESPONSE;
+		return 1;
+	}
+
+	/* Cache hit: write the pinned node while it is fresh */
+	start = metrics_now();
+	c->key_hash = cache_hash(c->key);
+	c->cached = search_cache(web_cache, c->key, c->key_hash);
+	metrics_since(METRIC_LOOKUP, start);
+	if (c->cached != NULL && time(NULL) >= __atomic_load_n(
+			&c->cached->meta.fresh_until, __ATOMIC_RELAXED))
+	{
+		release_cache(c->cached);
+		c->cached = NULL;
+	}
+	if (c->cached != NULL)
+	{
+		c->out = c->cached->content;
+		c->outlen = c->cached->_size;
+		c->has_length = response_delimited(c->out, c->outlen);
+		c->status = response_status(c->out, c->outlen);
+		c->outcome = METRIC_HITS;
+		c->state = WRITE_RESPONSE;
+		return 1;
+	}
+
+	/* Cache miss: connect to the server */
+	sprintf(p, "%d", req.port);
+	c->connecting = metrics_now();
+	if ((c->server.fd = open_nonblock_clientfd(host, p)) < 0)
+		return -1;
+
+	c->reqsent = 0;
+	c->relay = (char *)Malloc(MAXBUF);
+	growbuf_init(&c->copy);
+	c->fit_size = 1;
+	c->has_length = 0;
+	c->head_seen = 0;
+	c->outcome = METRIC_FETCHED;
+	c->state = CONNECTING;
+	return 1;
+}
+
+/*
+ * Release what the finished response held. Keep the
+ * connection for the next request if possible, else close
+ * it. Return 1 if the connection is still open.
+ */
+static int finish_response(loop *l, conn *c)
+{
+	answered(c, c->outcome);
+	if (c->cached != NULL)
+	{
+		release_cache(c->cached);
+		c->cached = NULL;
+	}
+	free(c->local);
+	free(c->relay);
+	growbuf_free(&c->copy);
+	free(c->request);
+	free(c->key);
+	c->local = c->relay = c->request = c->key = NULL;
+	c->out = NULL;
+	c->outlen = c->outsent = 0;
+
+	if (!c->keepalive || !c->has_length)
+	{
+		close_conn(l, c);
+		return 0;
+	}
+
+	/* Keep the pipelined requests behind this one */
+	c->inlen -= c->consumed;
+	memmove(c->in, c->in + c->consumed, c->inlen + 1);
+	c->consumed = 0;
+	if (c->inlen == 0)
+	{
+		free(c->in);
+		c->in = NULL;
+	}
+	c->state = READ_REQUEST;
+	return 1;
+}
+
+/*
+ * Time the first write of a response to the client
+ */
+static void first_byte(conn *c)
+{
+	if (!c->first_sent)
+	{
+		metrics_since(METRIC_FIRST_BYTE, c->received);
+		c->first_sent = 1;
+	}
+}
+
+/*
+ * Count and log the request being answered, as done or cut off
+ */
+static void answered(conn *c, metric_counter outcome)
+{
+	uint64_t ns = metrics_now() - c->received;
+
+	metrics_count(METRIC_REQUESTS);
+	metrics_count(outcome);
+	metrics_record(METRIC_TOTAL, ns);
+	accesslog_write(c->addr, c->uri, c->urilen, c->status, c->sent,
+					outcome, ns);
+	c->received = 0;
+}
+
+/*
+ * Close the server side of a connection
+ */
+static void close_server(conn *c)
+{
+	if (c->server.fd >= 0)
+	{
+		close(c->server.fd);
+		c->server.fd = -1;
+		c->server.events = 0;
+	}
+}
+
+/*
+ * Close a connection and queue it to be freed
+ * after the current batch of events
+ */
+static void close_conn(loop *l, conn *c)
+{
+	if (c->received != 0)
+		answered(c, METRIC_FAILED);
+	close_server(c);
+	close(c->client.fd);
+	c->client.fd = -1;
+
+	if (c->cached != NULL)
+		release_cache(c->cached);
+	free(c->in);
+	free(c->local);
+	free(c->relay);
+	growbuf_free(&c->copy);
+	free(c->request);
+	free(c->key);
+
+	c->prev->next = c->next;
+	c->next->prev = c->prev;
+	c->state = CLOSED;
+	c->next = l->dead;
+	l->dead = c;
+}
+
+static void free_dead(loop *l)
+{
+	conn *c;
+
+	while ((c = l->dead) != NULL)
+	{
+		l->dead = c->next;
+		free(c);
+	}
+}
+
+/*
+ * Close connections that made no progress for too long,
+ * whatever they wait for
+ */
+static void sweep_idle(loop *l)
+{
+	conn *c, *next;
+
+	for (c = l->conns.next; c != &l->conns; c = next)
+	{
+		next = c->next;
+		if (c->state != CLOSED &&
+				l->now - c->last_active > EVENT_IDLE_TIMEOUT)
+			close_conn(l, c);
+	}
+}
+
+/*
+ * Register, change or remove the epoll interest of a socket
+ */
+static void set_interest(loop *l, handle *h, unsigned int events)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (h->fd < 0 || h->events == events)
+		return;
+
+	if (events == 0)
+		op = EPOLL_CTL_DEL;
+	else if (h->events == 0)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	ev.events = events;
+	ev.data.ptr = h;
+	if (epoll_ctl(l->epfd, op, h->fd, &ev) < 0)
+		unix_error("epoll_ctl error");
+	h->events = events;
+}
+
+/*
+ * open_listenfd with SO_REUSEPORT, so that every loop can
+ * bind its own non-blocking listener to the same port
+ */
+int open_reuseport_listenfd(char *port)
+{
+	struct addrinfo hints, *listp, *p;
+	int listenfd = -1, optval = 1;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+	Getaddrinfo(NULL, port, &hints, &listp);
+
+	for (p = listp; p; p = p->ai_next)
+	{
+		listenfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+						  p->ai_protocol);
+		if (listenfd < 0)
+			continue;
+
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+				   (const void *)&optval, sizeof(int));
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+				   (const void *)&optval, sizeof(int));
+
+		if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(listenfd);
+		listenfd = -1;
+	}
+	freeaddrinfo(listp);
+
+	if (listenfd < 0)
+		return -1;
+	if (listen(listenfd, LISTENQ) < 0)
+	{
+		close(listenfd);
+		return -1;
+	}
+	return listenfd;
+}
+
+/*
+ * open_clientfd with a non-blocking socket, return as soon
+ * as the connect is in progress. Names come from the resolver
+ * cache, so only the first request to a server waits for it.
+ */
+static int open_nonblock_clientfd(char *hostname, char *port)
+{
+	dns_addr addrs[DNS_MAX_ADDRS];
+	int i, n, clientfd;
+
+	if ((n = dns_lookup(hostname, port, addrs, DNS_MAX_ADDRS)) < 0)
+		return -1;
+
+	for (i = 0; i < n; i++)
+	{
+		clientfd = socket(addrs[i].family, addrs[i].socktype | SOCK_NONBLOCK,
+						  addrs[i].protocol);
+		if (clientfd < 0)
+			continue;
+		if (connect(clientfd, (SA *)&addrs[i].addr, addrs[i].addrlen) == 0 ||
+				errno == EINPROGRESS)
+			return clientfd;
+		close(clientfd);
+	}
+	dns_invalidate(hostname, port);
+	return -1;
+}
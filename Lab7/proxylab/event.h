@@ -0,0 +1,20 @@
+/*
+ * event.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Event-driven (epoll) mode of the proxy
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+/* Events handled per epoll_wait call */
+#define EVENT_BATCH 256
+
+/* Seconds a connection may make no progress, in any state */
+#define EVENT_IDLE_TIMEOUT 60
+
+void event_run(char *port, int nloops);
+int open_reuseport_listenfd(char *port);
+
+#endif
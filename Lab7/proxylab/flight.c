@@ -0,0 +1,466 @@
+/*
+ * flight.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Makes concurrent misses of one request share a single fetch.
+ * The first client to miss becomes the leader of a flight and
+ * fetches the response. Clients missing the same request while
+ * it is on its way join the flight and are streamed the bytes
+ * as the leader relays them, instead of waiting for the whole
+ * object or fetching it again.
+ *
+ * The leader appends everything it relays to a shared buffer,
+ * a list of FLIGHT_CHUNK pieces that never move once allocated,
+ * so waiters write straight from it without holding the lock;
+ * bytes below the length are never changed. A waiter joining
+ * late starts from the first byte. Past FLIGHT_MAX_TEE bytes a
+ * flight takes no new waiters, and from then on a piece is
+ * freed as soon as no waiter needs it or is writing from it.
+ *
+ * That alone would let a slow waiter make the leader keep the
+ * rest of a large response. So a waiter lagging the leader by
+ * more than FLIGHT_MAX_TEE bytes for FLIGHT_LAG_MS, or by more
+ * than FLIGHT_MAX_LAG bytes at all, is cut off; the leader
+ * checks as it appends and never waits for anyone. The next
+ * read of a waiter cut off fails, and its client is closed
+ * without the rest. Once no waiter is left to read, the leader
+ * stops keeping bytes, so a flight holds at most about
+ * FLIGHT_MAX_LAG bytes, and FLIGHT_MAX_TEE once its waiters
+ * keep up. A leader relaying a response
+ * it cannot cache also detaches the flight while nobody has
+ * joined, so the body can be spliced instead; clients missing
+ * it later fetch it on their own.
+ *
+ * Flights hang off a small hash table keyed by the request and
+ * its cache hash, guarded by one semaphore. A flight leaves the
+ * table when the leader is done or it stops taking waiters, and
+ * is freed when the last of the leader and its waiters leaves.
+ */
+
+#include "csapp.h"
+#include "flight.h"
+
+static flight *table[FLIGHT_BUCKETS];
+static flight_stats stats;
+static sem_t mutex;
+
+static void unlink_flight(flight *f);
+static void put_flight(flight *f);
+static void free_chunks(flight *f);
+static void trim(flight *f);
+static int needed(flight *f, tee_chunk *t);
+static void cut_laggards(flight *f);
+static uint64_t now_ms(void);
+
+
+/*
+ * Initialize the empty table
+ */
+void flight_init(void)
+{
+	memset(table, 0, sizeof(table));
+	memset(&stats, 0, sizeof(stats));
+	Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * Join the flight of a request, starting one if there is
+ * none to join. *leader tells whether the caller must fetch
+ * and then call flight_finish(), or read with flight_read()
+ * from the cursor c, and then call flight_leave().
+ */
+flight *flight_join(char *id, uint64_t hash, int *leader, flight_cursor *c)
+{
+	flight *f, **b = &table[hash & (FLIGHT_BUCKETS - 1)];
+
+	P(&mutex);
+	for (f = *b; f != NULL; f = f->next)
+	{
+		if (f->hash != hash || strcmp(f->id, id))
+			continue;
+
+		pthread_mutex_lock(&f->lock);
+		if (f->joinable)
+		{
+			f->refcnt++;
+			c->chunk = NULL;
+			c->off = 0;
+			c->pos = 0;
+			c->cut = 0;
+			c->behind_ms = 0;
+			c->next = f->cursors;
+			f->cursors = c;
+			pthread_mutex_unlock(&f->lock);
+			stats.joined++;
+			V(&mutex);
+			*leader = 0;
+			return f;
+		}
+		pthread_mutex_unlock(&f->lock);
+	}
+
+	/* Nobody is fetching it yet, lead a new flight */
+	f = (flight *)Malloc(sizeof(flight));
+	f->id = strdup(id);
+	f->hash = hash;
+	f->linked = 1;
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+	f->state = FLIGHT_RUNNING;
+	f->refcnt = 1;
+	f->joinable = 1;
+	f->teeing = 1;
+	f->head = f->tail = NULL;
+	f->len = 0;
+	f->kept = 0;
+	f->cursors = NULL;
+	f->next = *b;
+	*b = f;
+	stats.leaders++;
+	stats.inflight++;
+	V(&mutex);
+
+	*leader = 1;
+	return f;
+}
+
+/*
+ * Keep bytes the leader relayed and wake the waiters
+ */
+void flight_append(flight *f, char *buf, size_t n)
+{
+	tee_chunk *c;
+	flight_cursor *k;
+	size_t room;
+	int full = 0, readers = 0;
+
+	pthread_mutex_lock(&f->lock);
+	if (!f->teeing)
+	{
+		pthread_mutex_unlock(&f->lock);
+		return;
+	}
+
+	while (n > 0)
+	{
+		if (f->tail == NULL || f->tail->len == FLIGHT_CHUNK)
+		{
+			c = (tee_chunk *)Malloc(sizeof(tee_chunk));
+			c->next = NULL;
+			c->start = f->len;
+			c->len = 0;
+			if (f->tail != NULL)
+				f->tail->next = c;
+			else
+				f->head = c;
+			f->tail = c;
+		}
+		room = FLIGHT_CHUNK - f->tail->len;
+		if (room > n)
+			room = n;
+		memcpy(f->tail->data + f->tail->len, buf, room);
+		f->tail->len += room;
+		f->len += room;
+		f->kept += room;
+		buf += room;
+		n -= room;
+	}
+
+	/* Too large to keep for waiters yet to come */
+	if (f->joinable && f->len > FLIGHT_MAX_TEE)
+	{
+		f->joinable = 0;
+		full = 1;
+	}
+
+	/* Cut off the waiters too far behind, free what all have read */
+	cut_laggards(f);
+	for (k = f->cursors; k != NULL; k = k->next)
+		readers += !k->cut;
+	trim(f);
+
+	/* Nobody can read the bytes any more */
+	if (!f->joinable && readers == 0)
+		f->teeing = 0;
+	if (!f->joinable && f->refcnt == 1)
+		free_chunks(f);
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+
+	if (full)
+		unlink_flight(f);
+}
+
+/*
+ * Whether the leader must still hand its bytes to
+ * flight_append(). Only the leader calls it.
+ */
+int flight_teeing(flight *f)
+{
+	return f != NULL && f->teeing;
+}
+
+/*
+ * Stop taking waiters if nobody joined yet, so the leader
+ * can relay the rest without keeping it. Return whether the
+ * flight still tees.
+ */
+int flight_detach(flight *f)
+{
+	int detached = 0;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->refcnt == 1)
+	{
+		f->joinable = 0;
+		f->teeing = 0;
+		free_chunks(f);
+		detached = 1;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	if (detached)
+		unlink_flight(f);
+	return f->teeing;
+}
+
+/*
+ * Called by the leader once the response is relayed and
+ * cached, or failed. Later misses start a flight of their own.
+ */
+void flight_finish(flight *f, int ok)
+{
+	unlink_flight(f);
+
+	pthread_mutex_lock(&f->lock);
+	f->state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+	f->joinable = 0;
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+
+	P(&mutex);
+	stats.inflight--;
+	V(&mutex);
+
+	put_flight(f);
+}
+
+/*
+ * Wait for bytes past the cursor of a waiter, point *data at
+ * up to max of them in the shared buffer and move the cursor.
+ * Return how many, 0 once the whole response has been read,
+ * -1 if the leader failed, or FLIGHT_CUT if the waiter was cut
+ * off. The cursor only moves under the lock, where the leader
+ * reads it.
+ */
+ssize_t flight_read(flight *f, flight_cursor *c, char **data, size_t max)
+{
+	size_t n;
+
+	pthread_mutex_lock(&f->lock);
+	while (!c->cut && c->pos == f->len && f->state == FLIGHT_RUNNING)
+		pthread_cond_wait(&f->cond, &f->lock);
+
+	if (c->cut)
+	{
+		pthread_mutex_unlock(&f->lock);
+		return FLIGHT_CUT;
+	}
+	if (f->state == FLIGHT_FAILED || c->pos == f->len)
+	{
+		n = f->state;
+		pthread_mutex_unlock(&f->lock);
+		return n == FLIGHT_DONE ? 0 : -1;
+	}
+
+	if (c->chunk == NULL)
+		c->chunk = f->head;
+	else if (c->off == c->chunk->len)
+	{
+		c->chunk = c->chunk->next;
+		c->off = 0;
+		trim(f);
+	}
+
+	/* The piece stays while the cursor points into it */
+	n = c->chunk->len - c->off;
+	if (n > max)
+		n = max;
+	*data = c->chunk->data + c->off;
+	c->off += n;
+	c->pos += n;
+	pthread_mutex_unlock(&f->lock);
+
+	__sync_fetch_and_add(&stats.tee_bytes, n);
+	return n;
+}
+
+/*
+ * Called by a waiter done with the flight, and with its cursor
+ */
+void flight_leave(flight *f, flight_cursor *c)
+{
+	flight_cursor **pp;
+
+	pthread_mutex_lock(&f->lock);
+	for (pp = &f->cursors; *pp != c; pp = &(*pp)->next)
+		;
+	*pp = c->next;
+	trim(f);
+	pthread_mutex_unlock(&f->lock);
+
+	put_flight(f);
+}
+
+/*
+ * Copy the statistics of the flights
+ */
+void get_flight_stats(flight_stats *st)
+{
+	P(&mutex);
+	*st = stats;
+	V(&mutex);
+}
+
+/*
+ * Take a flight out of the table, if still there
+ */
+static void unlink_flight(flight *f)
+{
+	flight **pp = &table[f->hash & (FLIGHT_BUCKETS - 1)];
+
+	P(&mutex);
+	if (f->linked)
+	{
+		while (*pp != f)
+			pp = &(*pp)->next;
+		*pp = f->next;
+		f->linked = 0;
+	}
+	V(&mutex);
+}
+
+/*
+ * Drop a reference, the last one frees the flight. The
+ * leader holds one until it is finished, and by then the
+ * flight is out of the table.
+ */
+static void put_flight(flight *f)
+{
+	int last;
+
+	pthread_mutex_lock(&f->lock);
+	last = (--f->refcnt == 0);
+	pthread_mutex_unlock(&f->lock);
+
+	if (last)
+	{
+		free_chunks(f);
+		pthread_mutex_destroy(&f->lock);
+		pthread_cond_destroy(&f->cond);
+		free(f->id);
+		free(f);
+	}
+}
+
+static void free_chunks(flight *f)
+{
+	tee_chunk *c, *next;
+
+	for (c = f->head; c != NULL; c = next)
+	{
+		next = c->next;
+		free(c);
+	}
+	f->head = f->tail = NULL;
+	f->kept = 0;
+}
+
+/*
+ * Free the pieces no waiter needs, once no new waiter can come
+ * to read from the first byte. The last piece stays for the
+ * leader to fill. Called with the lock held.
+ */
+static void trim(flight *f)
+{
+	tee_chunk **pp = &f->head, *t;
+
+	if (f->joinable)
+		return;
+	while ((t = *pp) != NULL && t != f->tail)
+	{
+		if (needed(f, t))
+		{
+			pp = &t->next;
+			continue;
+		}
+
+		/* Only waiters cut off point before it, and never move on */
+		*pp = t->next;
+		f->kept -= t->len;
+		free(t);
+	}
+}
+
+/*
+ * Cut off the waiters that have lagged the leader by more than
+ * FLIGHT_MAX_TEE bytes for FLIGHT_LAG_MS, or lag it by more than
+ * FLIGHT_MAX_LAG, once no new waiter can come. Called with the
+ * lock held.
+ */
+static void cut_laggards(flight *f)
+{
+	flight_cursor *k;
+	uint64_t now = 0;
+
+	if (f->joinable)
+		return;
+	for (k = f->cursors; k != NULL; k = k->next)
+	{
+		if (k->cut)
+			continue;
+		if (f->len - k->pos <= FLIGHT_MAX_TEE)
+		{
+			k->behind_ms = 0;
+			continue;
+		}
+		if (now == 0)
+			now = now_ms();
+		if (k->behind_ms == 0)
+			k->behind_ms = now;
+		if (now - k->behind_ms >= FLIGHT_LAG_MS ||
+			f->len - k->pos > FLIGHT_MAX_LAG)
+		{
+			k->cut = 1;
+			__sync_fetch_and_add(&stats.cut, 1);
+		}
+	}
+}
+
+/*
+ * Milliseconds of the monotonic clock, never 0
+ */
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000 + 1;
+}
+
+/*
+ * Whether a waiter is writing from a piece, or has yet to
+ * read some of it
+ */
+static int needed(flight *f, tee_chunk *t)
+{
+	flight_cursor *k;
+
+	for (k = f->cursors; k != NULL; k = k->next)
+		if (k->chunk == t || (!k->cut && k->pos < t->start + t->len))
+			return 1;
+	return 0;
+}
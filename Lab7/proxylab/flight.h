@@ -0,0 +1,93 @@
+/*
+ * flight.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Single-flight fetches of missed requests, teed to every waiter
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define FLIGHT_BUCKETS 64		/* request chains, a power of two */
+#define FLIGHT_CHUNK 16384		/* bytes per piece of the tee buffer */
+#define FLIGHT_MAX_TEE 1048576	/* larger responses take no new waiters, */
+								/* and waiters lag the leader by less */
+#define FLIGHT_LAG_MS 1000		/* or for no longer than this */
+#define FLIGHT_MAX_LAG (8 * FLIGHT_MAX_TEE)	/* and never by more */
+
+/* What flight_read() returns for a waiter cut off for lagging */
+#define FLIGHT_CUT -2
+
+/* States of a flight */
+#define FLIGHT_RUNNING 0
+#define FLIGHT_DONE    1
+#define FLIGHT_FAILED  -1
+
+/* A piece of the shared buffer, never moved once allocated */
+typedef struct tee_chunk
+{
+	struct tee_chunk *next;
+	size_t start;			/* of data[0], from the start of the response */
+	size_t len;
+	char data[FLIGHT_CHUNK];
+}tee_chunk;
+
+/* Where a waiter is in the shared buffer */
+typedef struct flight_cursor
+{
+	tee_chunk *chunk;
+	size_t off;				/* within chunk */
+	size_t pos;				/* from the start of the response */
+	int cut;				/* fell too far behind, gets no more */
+	uint64_t behind_ms;		/* since when it lags, 0 if it does not */
+	struct flight_cursor *next;	/* other waiters of the flight */
+}flight_cursor;
+
+/* A fetch on its way, shared by every client missing the request */
+typedef struct flight
+{
+	char *id;
+	uint64_t hash;
+	int linked;				/* in the table, under the table lock */
+
+	/* Everything below is protected by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signaled on new bytes and when over */
+	int state;
+	int refcnt;				/* leader plus waiters */
+	int joinable;			/* new waiters may still join */
+	int teeing;				/* the leader still keeps the bytes */
+	tee_chunk *head;		/* bytes relayed and not read by all yet */
+	tee_chunk *tail;
+	size_t len;				/* relayed so far */
+	size_t kept;			/* in the chunks */
+	flight_cursor *cursors;	/* of the waiters */
+
+	struct flight *next;	/* next flight in the same bucket */
+}flight;
+
+/* Statistics of the flights */
+typedef struct
+{
+	unsigned long leaders;		/* misses that fetched */
+	unsigned long joined;		/* misses that streamed from a leader */
+	unsigned long inflight;		/* fetches on their way right now */
+	unsigned long tee_bytes;	/* bytes the waiters were sent */
+	unsigned long cut;			/* waiters cut off for lagging */
+}flight_stats;
+
+void flight_init(void);
+flight *flight_join(char *id, uint64_t hash, int *leader, flight_cursor *c);
+void flight_append(flight *f, char *buf, size_t n);
+int flight_teeing(flight *f);
+int flight_detach(flight *f);
+void flight_finish(flight *f, int ok);
+ssize_t flight_read(flight *f, flight_cursor *c, char **data, size_t max);
+void flight_leave(flight *f, flight_cursor *c);
+void get_flight_stats(flight_stats *st);
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * flighttest.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Checks that a slow waiter cannot make a flight keep a large
+ * response, nor hold up its leader. A leader appends a response
+ * of -n bytes, 4MB by default, in pieces the size of a rio
+ * buffer, pausing -p microseconds after each, while two clients
+ * that joined before the first byte read it: a fast one, which
+ * must get every byte in order, and one sleeping -s microseconds
+ * after each read, which must be cut off once it has lagged the
+ * leader by FLIGHT_MAX_TEE bytes for FLIGHT_LAG_MS. No append
+ * may take as long as FLIGHT_LAG_MS, and after every append the
+ * bytes the flight keeps must stay below FLIGHT_MAX_LAG and a
+ * few pieces.
+ *
+ * Prints OK and exits with 0 if all of it holds, else says what
+ * failed and exits with 1.
+ *
+ * usage: flighttest [-n bytes] [-p usecs] [-s usecs]
+ */
+
+#include "csapp.h"
+#include "flight.h"
+
+#define TEST_BYTES (4L << 20)		/* of the response */
+#define LEAD_USECS 4000				/* the leader sleeps per append */
+#define SLOW_USECS 20000			/* the slow waiter sleeps per read */
+#define MAX_KEPT   (FLIGHT_MAX_LAG + 3 * FLIGHT_CHUNK)
+
+/* One waiter of the flight */
+typedef struct
+{
+	flight *f;
+	flight_cursor cur;
+	int usecs;				/* to sleep after every read */
+	long got;				/* bytes read, in order */
+	int bad;				/* a byte was not the one expected */
+	ssize_t last;			/* what the last flight_read() returned */
+}waiter;
+
+static long total = TEST_BYTES;
+
+void usage(char *prog);
+void *waiter_thread(void *vargp);
+char byte_at(long pos);
+long now_us(void);
+
+
+int main(int argc, char **argv)
+{
+	char buf[MAXBUF];
+	waiter fast, slow;
+	pthread_t tid[2];
+	flight_stats st;
+	flight *f;
+	size_t kept, max_kept = 0;
+	long pos = 0, n, i, start, took, max_took = 0;
+	int leader, opt, usecs = SLOW_USECS, lead = LEAD_USECS, failed = 0;
+
+	while ((opt = getopt(argc, argv, "n:p:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			total = atol(optarg);
+			break;
+		case 'p':
+			lead = atoi(optarg);
+			break;
+		case 's':
+			usecs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || total <= 2 * FLIGHT_MAX_TEE || usecs < 1 ||
+		lead < 0)
+		usage(argv[0]);
+
+	/* The leader and both waiters are in before the first byte */
+	flight_init();
+	f = flight_join("GET /big", 1, &leader, NULL);
+	memset(&fast, 0, sizeof(fast));
+	memset(&slow, 0, sizeof(slow));
+	fast.f = flight_join("GET /big", 1, &leader, &fast.cur);
+	slow.f = flight_join("GET /big", 1, &leader, &slow.cur);
+	slow.usecs = usecs;
+	if (fast.f != f || slow.f != f)
+		app_error("waiters did not join the flight");
+	Pthread_create(&tid[0], NULL, waiter_thread, &fast);
+	Pthread_create(&tid[1], NULL, waiter_thread, &slow);
+
+	/* Relay at the pace of a server, timing every append */
+	while (pos < total)
+	{
+		n = total - pos < MAXBUF ? total - pos : MAXBUF;
+		for (i = 0; i < n; i++)
+			buf[i] = byte_at(pos + i);
+		start = now_us();
+		flight_append(f, buf, n);
+		took = now_us() - start;
+		if (took > max_took)
+			max_took = took;
+		pos += n;
+
+		pthread_mutex_lock(&f->lock);
+		kept = f->kept;
+		pthread_mutex_unlock(&f->lock);
+		if (kept > max_kept)
+			max_kept = kept;
+		if (lead > 0)
+			usleep(lead);
+	}
+	flight_finish(f, 1);
+	Pthread_join(tid[0], NULL);
+	Pthread_join(tid[1], NULL);
+	get_flight_stats(&st);
+
+	printf("fast waiter  %ld of %ld bytes, last read %zd\n", fast.got,
+		   total, fast.last);
+	printf("slow waiter  %ld bytes, last read %zd\n", slow.got, slow.last);
+	printf("kept at most %zu bytes, cut %lu\n", max_kept, st.cut);
+	printf("longest append %ld us\n", max_took);
+
+	if (fast.got != total || fast.bad || fast.last != 0)
+		failed = printf("FAIL: the fast waiter did not get it all\n");
+	if (slow.last != FLIGHT_CUT || slow.bad || slow.got >= total)
+		failed = printf("FAIL: the slow waiter was not cut off\n");
+	if (st.cut != 1)
+		failed = printf("FAIL: %lu waiters cut off, not 1\n", st.cut);
+	if (max_kept > MAX_KEPT)
+		failed = printf("FAIL: kept %zu bytes, more than %d\n", max_kept,
+						MAX_KEPT);
+	if (max_took >= FLIGHT_LAG_MS * 1000L)
+		failed = printf("FAIL: an append took %ld us\n", max_took);
+	if (failed)
+		exit(1);
+	printf("OK\n");
+	return 0;
+}
+
+/*
+ * Print the command line usage and exit
+ */
+void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-n bytes] [-p usecs] [-s usecs]\n", prog);
+	fprintf(stderr, "   -n bytes  size of the response, more than twice "
+			"%d (default %ld)\n", FLIGHT_MAX_TEE, TEST_BYTES);
+	fprintf(stderr, "   -p usecs  pause of the leader after every "
+			"append (default %d)\n", LEAD_USECS);
+	fprintf(stderr, "   -s usecs  sleep of the slow waiter after every "
+			"read (default %d)\n", SLOW_USECS);
+	exit(1);
+}
+
+/*
+ * Read the flight to its end, checking every byte
+ */
+void *waiter_thread(void *vargp)
+{
+	waiter *w = (waiter *)vargp;
+	char *data;
+	ssize_t n, i;
+
+	while ((n = flight_read(w->f, &w->cur, &data, MAXBUF)) > 0)
+	{
+		for (i = 0; i < n; i++)
+			if (data[i] != byte_at(w->got + i))
+				w->bad = 1;
+		w->got += n;
+		if (w->usecs > 0)
+			usleep(w->usecs);
+	}
+	w->last = n;
+	flight_leave(w->f, &w->cur);
+	return NULL;
+}
+
+/*
+ * The byte of the response at pos, so that bytes out of order
+ * or from a freed piece show
+ */
+char byte_at(long pos)
+{
+	return (char)(pos * 7 + pos / 4093);
+}
+
+/*
+ * Microseconds of the monotonic clock
+ */
+long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
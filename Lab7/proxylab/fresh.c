@@ -0,0 +1,325 @@
+/*
+ * fresh.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Works out whether a response may be cached and for how long,
+ * following the rules of HTTP caching for a shared cache. The
+ * status line and headers are parsed once, as the response is
+ * relayed, into a fresh_info, and fresh_meta() turns that into
+ * the cache_meta stored in the cache node:
+ *
+ * - The freshness lifetime comes from s-maxage, max-age, then
+ *   Expires minus Date, minus the Age of the response. Without
+ *   any of them, it is FRESH_HEURISTIC_PCT of the time since
+ *   Last-Modified, or FRESH_DEFAULT_TTL if that is unknown too.
+ * - no-cache makes the lifetime 0, so every use is revalidated.
+ * - stale-while-revalidate lets the stale response be served
+ *   for that many more seconds while it is revalidated, unless
+ *   must-revalidate, proxy-revalidate or s-maxage forbid it.
+ * - ETag and Last-Modified are remembered as offsets into the
+ *   response, to build conditional requests when it goes stale.
+ *
+ * Only statuses cacheable by default (200, 203, 300, 301, 404,
+ * 410) are cached, or other final ones with an explicit
+ * lifetime. no-store and private responses never are, nor
+ * no-cache ones that cannot be revalidated, nor those varying on
+ * a request header the cache key does not hold, or Vary: *.
+ */
+
+#include "csapp.h"
+#include "fresh.h"
+#include "scan.h"
+#include "request.h"
+
+static char *header_value(char *line, const char *name);
+static unsigned int value_len(char *value);
+static void parse_cache_control(fresh_info *fi, char *value);
+static void parse_vary(fresh_info *fi, char *value);
+
+
+/*
+ * Start a response with nothing known about it
+ */
+void fresh_init(fresh_info *fi)
+{
+	memset(fi, 0, sizeof(*fi));
+	fi->max_age = fi->s_maxage = -1;
+	fi->date = fi->last_modified = -1;
+}
+
+/*
+ * Read the status code of a status line
+ */
+void fresh_status(fresh_info *fi, char *line)
+{
+	fi->status = 0;
+	sscanf(line, "%*s %d", &fi->status);
+}
+
+/*
+ * Take in one header line, which starts off bytes into the
+ * response it belongs to
+ */
+void fresh_header(fresh_info *fi, char *line, unsigned int off)
+{
+	char *v;
+
+	if ((v = header_value(line, "Cache-Control:")) != NULL)
+	{
+		fi->has_cc = 1;
+		parse_cache_control(fi, v);
+	}
+	else if ((v = header_value(line, "Expires:")) != NULL)
+	{
+		fi->has_expires = 1;
+		if ((fi->expires = http_date(v)) < 0)
+			fi->expires = 0;
+	}
+	else if ((v = header_value(line, "Date:")) != NULL)
+		fi->date = http_date(v);
+	else if ((v = header_value(line, "Age:")) != NULL)
+		fi->age = atol(v);
+	else if ((v = header_value(line, "Last-Modified:")) != NULL)
+	{
+		fi->last_modified = http_date(v);
+		fi->lm_off = off + (v - line);
+		fi->lm_len = value_len(v);
+	}
+	else if ((v = header_value(line, "ETag:")) != NULL)
+	{
+		fi->etag_off = off + (v - line);
+		fi->etag_len = value_len(v);
+	}
+	else if ((v = header_value(line, "Vary:")) != NULL)
+		parse_vary(fi, v);
+}
+
+/*
+ * Parse the status line and headers of a whole response
+ */
+void fresh_parse(fresh_info *fi, char *resp, size_t n)
+{
+	char line[MAXLINE];
+	char *p = resp, *end = resp + n, *eol;
+	size_t len;
+
+	fresh_init(fi);
+	fresh_status(fi, resp);
+	while (p < end && (eol = scan_char(p, end - p, '\n')) != NULL)
+	{
+		/* Skip the status line, stop at the blank line */
+		if (p != resp)
+		{
+			if (eol - p <= 1)
+				break;
+			len = eol + 1 - p;
+			if (len >= sizeof(line))
+				len = sizeof(line) - 1;
+			memcpy(line, p, len);
+			line[len] = '\0';
+			fresh_header(fi, line, p - resp);
+		}
+		p = eol + 1;
+	}
+}
+
+/*
+ * Apply the headers of a 304 to the stored response it
+ * validated. The validators of the stored response stay.
+ */
+void fresh_update(fresh_info *fi, fresh_info *upd)
+{
+	if (upd->has_cc)
+	{
+		fi->has_cc = 1;
+		fi->no_store = upd->no_store;
+		fi->no_cache = upd->no_cache;
+		fi->must_revalidate = upd->must_revalidate;
+		fi->max_age = upd->max_age;
+		fi->s_maxage = upd->s_maxage;
+		fi->swr = upd->swr;
+	}
+	if (upd->has_expires)
+	{
+		fi->has_expires = 1;
+		fi->expires = upd->expires;
+	}
+	fi->date = upd->date;
+	fi->age = upd->age;
+}
+
+/*
+ * Whether a shared cache may keep the response
+ */
+int fresh_cacheable(fresh_info *fi)
+{
+	int explicit = fi->s_maxage >= 0 || fi->max_age >= 0 ||
+		fi->has_expires;
+
+	if (fi->no_store || fi->vary_unkeyed)
+		return 0;
+	if (fi->no_cache && fi->etag_len == 0 && fi->lm_len == 0)
+		return 0;
+
+	switch (fi->status)
+	{
+	case 200: case 203: case 300: case 301: case 404: case 410:
+		return 1;
+	case 206:
+		return 0;
+	default:
+		return explicit && fi->status >= 200 && fi->status < 600;
+	}
+}
+
+/*
+ * Work out until when a response received at now is fresh,
+ * and until when it may be served stale
+ */
+void fresh_meta(fresh_info *fi, time_t now, cache_meta *meta)
+{
+	time_t date = fi->date >= 0 ? fi->date : now;
+	long lifetime;
+
+	if (fi->no_cache)
+		lifetime = 0;
+	else if (fi->s_maxage >= 0)
+		lifetime = fi->s_maxage;
+	else if (fi->max_age >= 0)
+		lifetime = fi->max_age;
+	else if (fi->has_expires)
+		lifetime = fi->expires - date;
+	else if (fi->last_modified >= 0 && fi->last_modified < date)
+	{
+		lifetime = (date - fi->last_modified) * FRESH_HEURISTIC_PCT / 100;
+		if (lifetime > FRESH_MAX_HEURISTIC)
+			lifetime = FRESH_MAX_HEURISTIC;
+	}
+	else
+		lifetime = FRESH_DEFAULT_TTL;
+
+	lifetime -= fi->age;
+	if (lifetime < 0)
+		lifetime = 0;
+
+	meta->fresh_until = now + lifetime;
+	meta->stale_until = meta->fresh_until;
+	if (!fi->no_cache && !fi->must_revalidate && fi->s_maxage < 0)
+		meta->stale_until += fi->swr;
+
+	meta->etag_off = fi->etag_off;
+	meta->etag_len = fi->etag_len;
+	meta->lm_off = fi->lm_off;
+	meta->lm_len = fi->lm_len;
+}
+
+/*
+ * Parse an HTTP date in any of its three formats:
+ * "Sun, 06 Nov 1994 08:49:37 GMT", "Sunday, 06-Nov-94 08:49:37
+ * GMT" or "Sun Nov  6 08:49:37 1994". Return -1 if it is none.
+ */
+time_t http_date(char *s)
+{
+	static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char mon[4];
+	const char *m;
+	struct tm tm;
+	int year;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(s, "%*[^,], %d %3s %d %d:%d:%d", &tm.tm_mday, mon,
+			   &year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 &&
+		sscanf(s, "%*[^,], %d-%3s-%d %d:%d:%d", &tm.tm_mday, mon,
+			   &year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 &&
+		sscanf(s, "%*s %3s %d %d:%d:%d %d", mon, &tm.tm_mday,
+			   &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &year) != 6)
+		return -1;
+
+	if ((m = strstr(months, mon)) == NULL || strlen(mon) != 3 ||
+		(m - months) % 3 != 0)
+		return -1;
+	tm.tm_mon = (m - months) / 3;
+
+	/* Two digit years of the second format */
+	if (year < 100)
+		year += year < 70 ? 2000 : 1900;
+	tm.tm_year = year - 1900;
+	return timegm(&tm);
+}
+
+/*
+ * Return the value of a header line if it is the named header
+ */
+static char *header_value(char *line, const char *name)
+{
+	size_t n = strlen(name);
+
+	if (strncasecmp(line, name, n))
+		return NULL;
+	line += n;
+	while (*line == ' ' || *line == '\t')
+		line++;
+	return line;
+}
+
+/*
+ * Length of a header value, without the line end and
+ * trailing blanks
+ */
+static unsigned int value_len(char *value)
+{
+	unsigned int n = strcspn(value, "\r\n");
+
+	while (n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t'))
+		n--;
+	return n;
+}
+
+/*
+ * Take in the directives of a Cache-Control header. Repeated
+ * headers add up.
+ */
+static void parse_cache_control(fresh_info *fi, char *value)
+{
+	char *p = value;
+
+	while (*p != '\0' && *p != '\r' && *p != '\n')
+	{
+		p += strspn(p, " \t,");
+		if (!strncasecmp(p, "no-store", 8) || !strncasecmp(p, "private", 7))
+			fi->no_store = 1;
+		else if (!strncasecmp(p, "no-cache", 8))
+			fi->no_cache = 1;
+		else if (!strncasecmp(p, "must-revalidate", 15) ||
+				 !strncasecmp(p, "proxy-revalidate", 16))
+			fi->must_revalidate = 1;
+		else if (!strncasecmp(p, "s-maxage=", 9))
+			fi->s_maxage = atol(p + 9);
+		else if (!strncasecmp(p, "max-age=", 8))
+			fi->max_age = atol(p + 8);
+		else if (!strncasecmp(p, "stale-while-revalidate=", 23))
+			fi->swr = atol(p + 23);
+		p += strcspn(p, ",\r\n");
+	}
+}
+
+/*
+ * Take in the header names of a Vary header
+ */
+static void parse_vary(fresh_info *fi, char *value)
+{
+	char *p = value;
+	size_t n;
+
+	while (*p != '\0' && *p != '\r' && *p != '\n')
+	{
+		p += strspn(p, " \t,");
+		n = strcspn(p, " \t,\r\n");
+		if (n > 0 && (*p == '*' || !request_keyed(p, n)))
+			fi->vary_unkeyed = 1;
+		p += n;
+	}
+}
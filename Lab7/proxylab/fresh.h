@@ -0,0 +1,50 @@
+/*
+ * fresh.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Freshness and validators of responses, from their headers
+ */
+
+#ifndef FRESH_H
+#define FRESH_H
+
+#include <time.h>
+#include "cache.h"
+
+#define FRESH_DEFAULT_TTL   300		/* seconds, without any hint at all */
+#define FRESH_HEURISTIC_PCT 10		/* of the age of Last-Modified */
+#define FRESH_MAX_HEURISTIC 86400	/* seconds a heuristic may give */
+
+/* What the status line and headers of a response say about caching */
+typedef struct
+{
+	int status;
+	int has_cc;				/* a Cache-Control header was seen */
+	int no_store;			/* no-store or private */
+	int no_cache;			/* revalidated before every use */
+	int must_revalidate;	/* never served stale */
+	int vary_unkeyed;		/* Vary names a header the key lacks */
+	long max_age;			/* seconds, -1 if absent */
+	long s_maxage;			/* seconds, -1 if absent */
+	long swr;				/* stale-while-revalidate seconds */
+	long age;				/* Age header, 0 if absent */
+	time_t date;			/* -1 if absent */
+	int has_expires;
+	time_t expires;			/* 0 if it could not be parsed */
+	time_t last_modified;	/* -1 if absent */
+	unsigned int etag_off;	/* validators, as offsets in the response */
+	unsigned int etag_len;
+	unsigned int lm_off;
+	unsigned int lm_len;
+}fresh_info;
+
+void fresh_init(fresh_info *fi);
+void fresh_status(fresh_info *fi, char *line);
+void fresh_header(fresh_info *fi, char *line, unsigned int off);
+void fresh_parse(fresh_info *fi, char *resp, size_t n);
+void fresh_update(fresh_info *fi, fresh_info *upd);
+int fresh_cacheable(fresh_info *fi);
+void fresh_meta(fresh_info *fi, time_t now, cache_meta *meta);
+time_t http_date(char *s);
+
+#endif
@@ -0,0 +1,624 @@
+/*
+ * loadgen.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Drives the proxy with many clients at once and reports its
+ * throughput, latency percentiles and hit ratio, so changes to
+ * the cache and the threading can be measured, not just checked
+ * with driver.sh.
+ *
+ * The origin the requests go to runs in loadgen itself, in a
+ * thread per connection on a port of its own, so the proxy can
+ * be measured on one machine without tiny. Object i of size s is
+ * "/o/<i>-<s>": the origin serves s bytes for it, with a long
+ * max-age so the proxy may cache it. -L delays every response of
+ * the origin, as a remote one would.
+ *
+ * Each client thread sends its requests one after the other, on
+ * a persistent connection with -k or a new one each time. Object
+ * i is asked for with probability proportional to 1 / (i+1)^a,
+ * Zipf's law with exponent a (-a, 0 for all alike). Its size is
+ * fixed per object, drawn from the distribution of -s:
+ *
+ * N            every object N bytes
+ * A-B          uniform between A and B bytes
+ * pareto:A-B   bounded Pareto of shape 1.2 between A and B, many
+ *              small objects and a few large ones, like the web
+ *
+ * Latency is from sending a request to the last byte of its
+ * response. The hit ratio is the share of requests the origin
+ * did not see. -w requests are sent first to warm the cache and
+ * are not counted.
+ *
+ * usage: loadgen [options] <proxy host> <proxy port>
+ */
+
+#include "csapp.h"
+#include <math.h>
+#include <netinet/tcp.h>
+
+#define DEFAULT_CLIENTS   16
+#define DEFAULT_REQUESTS  100000
+#define DEFAULT_OBJECTS   10000
+#define DEFAULT_ALPHA     0.8
+#define DEFAULT_SIZES     "pareto:512-262144"
+#define ORIGIN_MAX_SIZE   (64 << 20)	/* bytes the origin serves at most */
+#define PARETO_SHAPE      1.2
+
+/* Object sizes, drawn once per object */
+typedef enum
+{
+	SIZE_FIXED,
+	SIZE_UNIFORM,
+	SIZE_PARETO
+}size_kind;
+
+/* One client thread, and what it measured */
+typedef struct
+{
+	pthread_t tid;
+	uint64_t rng;
+	long nrequests;
+	int record;					/* keep latencies, not a warm-up */
+	unsigned int *latency;		/* microseconds, one per request */
+	long done;
+	long errors;
+	unsigned long long bytes;
+}client;
+
+/* Where the proxy and the origin are */
+static char *proxy_host, *proxy_port;
+static int origin_port;
+
+/* The workload */
+static long nobjects = DEFAULT_OBJECTS;
+static double *popularity;		/* cumulative probability of objects */
+static unsigned int *sizes;
+static int keepalive;
+static long origin_delay;		/* microseconds */
+
+/* Requests the origin served */
+static volatile long origin_requests;
+
+/* Bytes of every body the origin sends */
+static char payload[MAXBUF];
+
+void usage(char *prog);
+int parse_sizes(char *spec, size_kind *kind, unsigned int *lo,
+				unsigned int *hi);
+void make_workload(double alpha, size_kind kind, unsigned int lo,
+				   unsigned int hi);
+double run(client *clients, int nclients, long nrequests, int record);
+void *client_thread(void *vargp);
+int get_object(client *c, int *fd, rio_t *rio, char *request);
+long pick_object(client *c);
+double uniform(client *c);
+void report(client *clients, int nclients, long nrequests, double secs,
+			long served);
+int cmp_latency(const void *a, const void *b);
+int start_origin(void);
+void *origin_accept(void *vargp);
+void *origin_thread(void *vargp);
+int has_word(char *s, const char *word);
+double now(void);
+
+
+int main(int argc, char **argv)
+{
+	int opt, nclients = DEFAULT_CLIENTS;
+	long nrequests = DEFAULT_REQUESTS, warmup = 0, served;
+	double alpha = DEFAULT_ALPHA, secs;
+	char *spec = DEFAULT_SIZES;
+	unsigned int lo, hi;
+	size_kind kind;
+	client *clients;
+
+	while ((opt = getopt(argc, argv, "c:n:u:a:s:w:kL:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			nclients = atoi(optarg);
+			break;
+		case 'n':
+			nrequests = atol(optarg);
+			break;
+		case 'u':
+			nobjects = atol(optarg);
+			break;
+		case 'a':
+			alpha = atof(optarg);
+			break;
+		case 's':
+			spec = optarg;
+			break;
+		case 'w':
+			warmup = atol(optarg);
+			break;
+		case 'k':
+			keepalive = 1;
+			break;
+		case 'L':
+			origin_delay = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || nclients < 1 || nrequests < nclients ||
+		nobjects < 1 || alpha < 0 || warmup < 0 || origin_delay < 0 ||
+		parse_sizes(spec, &kind, &lo, &hi) < 0)
+		usage(argv[0]);
+	proxy_host = argv[optind];
+	proxy_port = argv[optind + 1];
+
+	Signal(SIGPIPE, SIG_IGN);
+	make_workload(alpha, kind, lo, hi);
+	origin_port = start_origin();
+	clients = (client *)Calloc(nclients, sizeof(client));
+
+	printf("%d clients, %ld requests, %ld objects, zipf %.2f, sizes %s, "
+		   "%s\n", nclients, nrequests, nobjects, alpha, spec,
+		   keepalive ? "keep-alive" : "connection per request");
+	if (warmup > 0)
+		run(clients, nclients, warmup < nclients ? nclients : warmup, 0);
+
+	served = origin_requests;
+	secs = run(clients, nclients, nrequests, 1);
+	report(clients, nclients, nrequests, secs, origin_requests - served);
+	return 0;
+}
+
+/*
+ * Print the command line usage and exit
+ */
+void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-c clients] [-n requests] [-u objects] "
+			"[-a alpha] [-s sizes]\n"
+			"       [-w requests] [-k] [-L usecs] <proxy host> "
+			"<proxy port>\n", prog);
+	fprintf(stderr, "   -c clients   concurrent clients (default %d)\n",
+			DEFAULT_CLIENTS);
+	fprintf(stderr, "   -n requests  requests measured (default %d)\n",
+			DEFAULT_REQUESTS);
+	fprintf(stderr, "   -u objects   distinct objects (default %d)\n",
+			DEFAULT_OBJECTS);
+	fprintf(stderr, "   -a alpha     Zipf exponent of their popularity, "
+			"0 for uniform (default %.1f)\n", DEFAULT_ALPHA);
+	fprintf(stderr, "   -s sizes     N, A-B or pareto:A-B bytes "
+			"(default %s)\n", DEFAULT_SIZES);
+	fprintf(stderr, "   -w requests  sent first to warm the cache, "
+			"not measured\n");
+	fprintf(stderr, "   -k           keep connections to the proxy open\n");
+	fprintf(stderr, "   -L usecs     delay of every origin response\n");
+	exit(1);
+}
+
+/*
+ * Parse a size distribution of -s. Return -1 if it is not one.
+ */
+int parse_sizes(char *spec, size_kind *kind, unsigned int *lo,
+				unsigned int *hi)
+{
+	char *p = spec, *end;
+
+	*kind = SIZE_UNIFORM;
+	if (!strncmp(p, "pareto:", 7))
+	{
+		*kind = SIZE_PARETO;
+		p += 7;
+	}
+	*lo = strtoul(p, &end, 10);
+	if (end == p)
+		return -1;
+	if (*end == '\0' && *kind != SIZE_PARETO)
+	{
+		*kind = SIZE_FIXED;
+		*hi = *lo;
+	}
+	else
+	{
+		if (*end != '-')
+			return -1;
+		p = end + 1;
+		*hi = strtoul(p, &end, 10);
+		if (end == p || *end != '\0')
+			return -1;
+	}
+	if (*lo < 1 || *hi < *lo || *hi > ORIGIN_MAX_SIZE)
+		return -1;
+	return 0;
+}
+
+/*
+ * Give each object its popularity and its size
+ */
+void make_workload(double alpha, size_kind kind, unsigned int lo,
+				   unsigned int hi)
+{
+	client sizer = { .rng = 0x9e3779b97f4a7c15ULL };
+	double sum = 0, u, l, h;
+	long i;
+
+	popularity = (double *)Malloc(nobjects * sizeof(double));
+	sizes = (unsigned int *)Malloc(nobjects * sizeof(unsigned int));
+
+	for (i = 0; i < nobjects; i++)
+	{
+		sum += 1.0 / pow(i + 1, alpha);
+		popularity[i] = sum;
+	}
+	for (i = 0; i < nobjects; i++)
+		popularity[i] /= sum;
+
+	for (i = 0; i < nobjects; i++)
+	{
+		u = uniform(&sizer);
+		switch (kind)
+		{
+		case SIZE_FIXED:
+			sizes[i] = lo;
+			break;
+		case SIZE_UNIFORM:
+			sizes[i] = lo + (unsigned int)(u * (hi - lo + 1.0));
+			break;
+		case SIZE_PARETO:
+			/* Inverse of the bounded Pareto distribution */
+			l = pow(lo, PARETO_SHAPE);
+			h = pow(hi, PARETO_SHAPE);
+			sizes[i] = (unsigned int)pow(-(u * h - u * l - h) / (h * l),
+										 -1.0 / PARETO_SHAPE);
+			break;
+		}
+		if (sizes[i] > hi)
+			sizes[i] = hi;
+	}
+}
+
+/*
+ * Send nrequests with the clients and wait for them. Return how
+ * many seconds it took.
+ */
+double run(client *clients, int nclients, long nrequests, int record)
+{
+	double start;
+	int i;
+
+	for (i = 0; i < nclients; i++)
+	{
+		clients[i].rng = 0x2545f4914f6cdd1dULL * (i + 1) + record;
+		clients[i].nrequests = nrequests / nclients +
+			(i < nrequests % nclients);
+		clients[i].record = record;
+		clients[i].done = clients[i].errors = 0;
+		clients[i].bytes = 0;
+		if (record)
+			clients[i].latency = (unsigned int *)Malloc(
+				clients[i].nrequests * sizeof(unsigned int));
+	}
+
+	start = now();
+	for (i = 0; i < nclients; i++)
+		Pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]);
+	for (i = 0; i < nclients; i++)
+		Pthread_join(clients[i].tid, NULL);
+	return now() - start;
+}
+
+/*
+ * Send the requests of one client, one after the other
+ */
+void *client_thread(void *vargp)
+{
+	client *c = (client *)vargp;
+	char request[MAXLINE];
+	double start;
+	int fd = -1;
+	rio_t rio;
+	long i, obj;
+
+	for (i = 0; i < c->nrequests; i++)
+	{
+		obj = pick_object(c);
+		sprintf(request, "GET http://127.0.0.1:%d/o/%ld-%u HTTP/1.1\r\n"
+				"Host: 127.0.0.1:%d\r\n"
+				"Connection: %s\r\n\r\n", origin_port, obj, sizes[obj],
+				origin_port, keepalive ? "keep-alive" : "close");
+
+		start = now();
+		if (get_object(c, &fd, &rio, request) < 0)
+		{
+			c->errors++;
+			continue;
+		}
+		if (c->record)
+			c->latency[c->done] = (unsigned int)((now() - start) * 1e6);
+		c->done++;
+	}
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+/*
+ * Send the request on *fd, connecting first if it is closed, and
+ * read the whole response. Leave *fd open if the proxy keeps the
+ * connection. Return -1 on any error.
+ */
+int get_object(client *c, int *fd, rio_t *rio, char *request)
+{
+	char buf[MAXBUF];
+	long length = -1, n;
+	int status, reused, close_after = !keepalive;
+
+	/*
+	 * The proxy may close a kept connection instead of reading
+	 * the next request, then it is sent again on a new one
+	 */
+	do
+	{
+		if ((reused = *fd >= 0) == 0)
+		{
+			if ((*fd = open_clientfd(proxy_host, proxy_port)) < 0)
+				return -1;
+			Rio_readinitb(rio, *fd);
+		}
+		if (rio_writen(*fd, request, strlen(request)) >= 0 &&
+			(n = rio_readlineb(rio, buf, MAXLINE)) > 0)
+			break;
+		close(*fd);
+		*fd = -1;
+	} while (reused);
+	if (*fd < 0 || sscanf(buf, "HTTP/1.%*d %d", &status) != 1)
+		goto fail;
+
+	/* Headers, until the blank line */
+	while ((n = rio_readlineb(rio, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n"))
+	{
+		if (!strncasecmp(buf, "Content-Length:", 15))
+			length = atol(buf + 15);
+		else if (!strncasecmp(buf, "Connection:", 11) &&
+				 has_word(buf + 11, "close"))
+			close_after = 1;
+	}
+	if (n <= 0)
+		goto fail;
+
+	/* The body, to the end of the connection if it has no length */
+	if (length < 0)
+		close_after = 1;
+	while (length != 0)
+	{
+		n = length < 0 || length > MAXBUF ? MAXBUF : length;
+		if ((n = rio_readnb(rio, buf, n)) < 0)
+			goto fail;
+		if (n == 0)
+		{
+			if (length > 0)
+				goto fail;
+			break;
+		}
+		c->bytes += n;
+		if (length > 0)
+			length -= n;
+	}
+
+	if (close_after)
+	{
+		close(*fd);
+		*fd = -1;
+	}
+	return status == 200 ? 0 : -1;
+
+fail:
+	if (*fd >= 0)
+		close(*fd);
+	*fd = -1;
+	return -1;
+}
+
+/*
+ * An object, the popular ones more often
+ */
+long pick_object(client *c)
+{
+	double u = uniform(c);
+	long lo = 0, hi = nobjects - 1, mid;
+
+	/* The first object whose cumulative probability reaches u */
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (popularity[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * A number in [0, 1) from the xorshift64* generator of the client
+ */
+double uniform(client *c)
+{
+	c->rng ^= c->rng >> 12;
+	c->rng ^= c->rng << 25;
+	c->rng ^= c->rng >> 27;
+	return ((c->rng * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/*
+ * Print throughput, latency percentiles and hit ratio of the
+ * measured requests
+ */
+void report(client *clients, int nclients, long nrequests, double secs,
+			long served)
+{
+	unsigned long long bytes = 0;
+	unsigned int *all;
+	long done = 0, errors = 0, i;
+	int j;
+
+	all = (unsigned int *)Malloc(nrequests * sizeof(unsigned int));
+	for (j = 0; j < nclients; j++)
+	{
+		memcpy(all + done, clients[j].latency,
+			   clients[j].done * sizeof(unsigned int));
+		done += clients[j].done;
+		errors += clients[j].errors;
+		bytes += clients[j].bytes;
+	}
+	printf("requests    %ld done, %ld failed, in %.2f s\n", done, errors,
+		   secs);
+	printf("throughput  %.0f requests/s, %.1f MB/s\n", done / secs,
+		   bytes / secs / (1 << 20));
+	printf("hit ratio   %.3f (%ld requests reached the origin)\n",
+		   done > 0 ? 1.0 - (double)served / done : 0.0, served);
+	if (done == 0)
+		return;
+
+	qsort(all, done, sizeof(unsigned int), cmp_latency);
+	i = done - 1;
+	printf("latency us  p50 %u  p99 %u  p999 %u  max %u\n",
+		   all[(long)(i * 0.5)], all[(long)(i * 0.99)],
+		   all[(long)(i * 0.999)], all[i]);
+	Free(all);
+}
+
+int cmp_latency(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Listen for the proxy on a free port and serve it from a thread.
+ * Return the port.
+ */
+int start_origin(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pthread_t tid;
+	int *listenfd = (int *)Malloc(sizeof(int));
+
+	memset(payload, 'x', sizeof(payload));
+	*listenfd = Open_listenfd("0");
+	if (getsockname(*listenfd, (struct sockaddr *)&addr, &len) < 0)
+		unix_error("getsockname error");
+	Pthread_create(&tid, NULL, origin_accept, listenfd);
+	return ntohs(addr.sin_port);
+}
+
+/*
+ * Give each connection of the proxy a thread of its own
+ */
+void *origin_accept(void *vargp)
+{
+	int listenfd = *(int *)vargp;
+	pthread_t tid;
+	int *connfd;
+
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		connfd = (int *)Malloc(sizeof(int));
+		if ((*connfd = accept(listenfd, NULL, NULL)) < 0)
+		{
+			Free(connfd);
+			continue;
+		}
+		Pthread_create(&tid, NULL, origin_thread, connfd);
+	}
+	return NULL;
+}
+
+/*
+ * Answer the requests on one connection until the proxy closes it
+ * or asks for it to be closed
+ */
+void *origin_thread(void *vargp)
+{
+	int fd = *(int *)vargp;
+	char buf[MAXLINE], header[MAXLINE];
+	unsigned int size;
+	int persistent, minor, one = 1;
+	long n, left;
+	rio_t rio;
+
+	Pthread_detach(pthread_self());
+	Free(vargp);
+	Rio_readinitb(&rio, fd);
+
+	/* Responses go out whole, not held back for the proxy's ACK */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	while (rio_readlineb(&rio, buf, MAXLINE) > 0)
+	{
+		if (sscanf(buf, "GET /o/%*d-%u HTTP/1.%d", &size, &minor) != 2 ||
+			size > ORIGIN_MAX_SIZE)
+			break;
+		persistent = minor >= 1;
+		while ((n = rio_readlineb(&rio, buf, MAXLINE)) > 0 &&
+			   strcmp(buf, "\r\n"))
+		{
+			if (!strncasecmp(buf, "Connection:", 11))
+				persistent = !has_word(buf + 11, "close") &&
+					(minor >= 1 || has_word(buf + 11, "keep-alive"));
+		}
+		if (n <= 0)
+			break;
+
+		__sync_fetch_and_add(&origin_requests, 1);
+		if (origin_delay > 0)
+			usleep(origin_delay);
+		n = sprintf(header, "HTTP/1.1 200 OK\r\n"
+					"Content-Length: %u\r\n"
+					"Content-Type: application/octet-stream\r\n"
+					"Cache-Control: max-age=86400\r\n"
+					"Connection: %s\r\n\r\n", size,
+					persistent ? "keep-alive" : "close");
+		if (rio_writen(fd, header, n) < 0)
+			break;
+		for (left = size; left > 0; left -= n)
+		{
+			n = left < MAXBUF ? left : MAXBUF;
+			if (rio_writen(fd, payload, n) < 0)
+				break;
+		}
+		if (left > 0 || !persistent)
+			break;
+	}
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Whether word is in s, in any case
+ */
+int has_word(char *s, const char *word)
+{
+	size_t n = strlen(word);
+
+	for (; *s != '\0'; s++)
+		if (!strncasecmp(s, word, n))
+			return 1;
+	return 0;
+}
+
+/*
+ * Seconds on the monotonic clock
+ */
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,286 @@
+/*
+ * metrics.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Counts what happens to requests and times their steps, for
+ * /__stats. Every thread records into a block of its own,
+ * allocated the first time it records, so recording takes no
+ * lock and no atomic read-modify-write: each count has a single
+ * writer, which stores it with a relaxed atomic store so readers
+ * never see a torn value. A reader sums the blocks of all
+ * threads, walking their list under a semaphore that only
+ * threads starting or exiting take. The block of an exiting
+ * thread, a background revalidation say, is added to the totals
+ * of exited threads before it is freed.
+ *
+ * Latencies go into histograms in the manner of HdrHistogram:
+ * below METRICS_SUB nanoseconds every value has a bucket, above
+ * that every power of two is cut into METRICS_SUB buckets of
+ * equal width. A bucket is at most 1/METRICS_SUB as wide as its
+ * values, so percentiles read from them are off by at most that,
+ * from nanoseconds to hours, in 8KB per step and thread.
+ */
+
+#include "csapp.h"
+#include "metrics.h"
+
+/* Latencies of one step */
+typedef struct
+{
+	uint64_t n;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[METRICS_BUCKETS];
+}histogram;
+
+/* What one thread recorded */
+typedef struct thread_metrics
+{
+	uint64_t counters[METRIC_NCOUNTERS];
+	histogram hist[METRIC_NPHASES];
+	struct thread_metrics *prev;
+	struct thread_metrics *next;
+}thread_metrics;
+
+static const char *phase_names[METRIC_NPHASES] = {
+	"parse", "lookup", "connect", "first_byte", "total"
+};
+static const char *counter_names[METRIC_NCOUNTERS] = {
+	"requests", "requests_hits", "requests_joined", "requests_fetched",
+	"requests_failed", "requests_local", "requests_cut"
+};
+
+static thread_metrics threads;		/* dummy head of the live blocks */
+static thread_metrics exited;		/* sums of the freed blocks */
+static sem_t mutex;
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread thread_metrics *mine;
+
+static void init(void);
+static thread_metrics *join(void);
+static void leave(void *vargp);
+static void add(thread_metrics *to, thread_metrics *from);
+static void summarize(histogram *h, metric_summary *s);
+static int bucket_of(uint64_t v);
+static uint64_t bucket_value(int b);
+
+/*
+ * Single writer: a plain read, then a store no reader can see
+ * half done
+ */
+static inline void bump(uint64_t *p, uint64_t n)
+{
+	__atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Nanoseconds on the monotonic clock
+ */
+uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Record that a step took ns nanoseconds
+ */
+void metrics_record(metric_phase phase, uint64_t ns)
+{
+	histogram *h;
+
+	if (mine == NULL)
+		mine = join();
+	h = &mine->hist[phase];
+	bump(&h->buckets[bucket_of(ns)], 1);
+	bump(&h->n, 1);
+	bump(&h->sum, ns);
+	if (ns > h->max)
+		__atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record a step that started at start, by metrics_now()
+ */
+void metrics_since(metric_phase phase, uint64_t start)
+{
+	metrics_record(phase, metrics_now() - start);
+}
+
+void metrics_count(metric_counter counter)
+{
+	if (mine == NULL)
+		mine = join();
+	bump(&mine->counters[counter], 1);
+}
+
+/*
+ * Sum the counters and histograms of all threads, and read the
+ * percentiles of each step off its histogram
+ */
+void get_metrics_stats(metrics_stats *st)
+{
+	thread_metrics *sum = (thread_metrics *)Calloc(1, sizeof(thread_metrics));
+	thread_metrics *t;
+	int i;
+
+	pthread_once(&once, init);
+	P(&mutex);
+	add(sum, &exited);
+	for (t = threads.next; t != &threads; t = t->next)
+		add(sum, t);
+	V(&mutex);
+
+	for (i = 0; i < METRIC_NCOUNTERS; i++)
+		st->counters[i] = sum->counters[i];
+	for (i = 0; i < METRIC_NPHASES; i++)
+		summarize(&sum->hist[i], &st->phases[i]);
+	Free(sum);
+}
+
+const char *metric_phase_name(metric_phase phase)
+{
+	return phase_names[phase];
+}
+
+const char *metric_counter_name(metric_counter counter)
+{
+	return counter_names[counter];
+}
+
+static void init(void)
+{
+	Sem_init(&mutex, 0, 1);
+	threads.next = threads.prev = &threads;
+	if (pthread_key_create(&key, leave) != 0)
+		app_error("pthread_key_create error");
+}
+
+/*
+ * Give the calling thread a block, freed when it exits
+ */
+static thread_metrics *join(void)
+{
+	thread_metrics *t = (thread_metrics *)Calloc(1, sizeof(thread_metrics));
+
+	pthread_once(&once, init);
+	P(&mutex);
+	t->next = threads.next;
+	t->prev = &threads;
+	threads.next->prev = t;
+	threads.next = t;
+	V(&mutex);
+	pthread_setspecific(key, t);
+	return t;
+}
+
+/*
+ * Keep what an exiting thread recorded and free its block
+ */
+static void leave(void *vargp)
+{
+	thread_metrics *t = (thread_metrics *)vargp;
+
+	P(&mutex);
+	add(&exited, t);
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	V(&mutex);
+	Free(t);
+}
+
+/*
+ * Add the counts of from to those of to, which only the caller
+ * writes
+ */
+static void add(thread_metrics *to, thread_metrics *from)
+{
+	histogram *h, *g;
+	uint64_t max;
+	int i, b;
+
+	for (i = 0; i < METRIC_NCOUNTERS; i++)
+		to->counters[i] += __atomic_load_n(&from->counters[i],
+										   __ATOMIC_RELAXED);
+	for (i = 0; i < METRIC_NPHASES; i++)
+	{
+		h = &to->hist[i];
+		g = &from->hist[i];
+		h->n += __atomic_load_n(&g->n, __ATOMIC_RELAXED);
+		h->sum += __atomic_load_n(&g->sum, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&g->max, __ATOMIC_RELAXED);
+		if (max > h->max)
+			h->max = max;
+		for (b = 0; b < METRICS_BUCKETS; b++)
+			h->buckets[b] += __atomic_load_n(&g->buckets[b],
+											 __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Mean, percentiles and max of a histogram. The buckets are
+ * read while threads record, so they may hold a few more values
+ * than n; the percentiles are taken of the values they hold.
+ */
+static void summarize(histogram *h, metric_summary *s)
+{
+	static const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t *out[] = { &s->p50, &s->p90, &s->p99, &s->p999 };
+	uint64_t total = 0, seen = 0;
+	int b, i = 0;
+
+	memset(s, 0, sizeof(*s));
+	for (b = 0; b < METRICS_BUCKETS; b++)
+		total += h->buckets[b];
+	if (total == 0)
+		return;
+	s->count = h->n;
+	s->mean = h->n > 0 ? h->sum / h->n : 0;
+	s->max = h->max;
+
+	for (b = 0; b < METRICS_BUCKETS && i < 4; b++)
+	{
+		seen += h->buckets[b];
+		while (i < 4 && seen > 0 && seen >= (uint64_t)(q[i] * total + 0.5))
+		{
+			*out[i] = bucket_value(b) < s->max ? bucket_value(b) : s->max;
+			i++;
+		}
+	}
+}
+
+/*
+ * Bucket of a value: the value itself below METRICS_SUB, else
+ * its METRICS_SUB_BITS bits after the leading one pick the
+ * bucket within its power of two
+ */
+static int bucket_of(uint64_t v)
+{
+	int shift;
+
+	if (v < METRICS_SUB)
+		return (int)v;
+	shift = 63 - __builtin_clzll(v) - METRICS_SUB_BITS;
+	return (shift + 1) * METRICS_SUB + (int)(v >> shift) - METRICS_SUB;
+}
+
+/*
+ * The middle of the values of bucket b
+ */
+static uint64_t bucket_value(int b)
+{
+	int shift;
+
+	if (b < METRICS_SUB)
+		return b;
+	shift = b / METRICS_SUB - 1;
+	return ((uint64_t)(METRICS_SUB + b % METRICS_SUB) << shift) +
+		((1ULL << shift) >> 1);
+}
@@ -0,0 +1,69 @@
+/*
+ * metrics.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Per-thread request counters and latency histograms
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/* Linear buckets per power of two of nanoseconds, 1/16 = 6% wide */
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB      (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS  ((64 - METRICS_SUB_BITS + 1) * METRICS_SUB)
+
+/* Steps of a request that are timed */
+typedef enum
+{
+	METRIC_PARSE,			/* parsing the buffered request */
+	METRIC_LOOKUP,			/* looking it up in the memory cache */
+	METRIC_CONNECT,			/* getting a connection to the server */
+	METRIC_FIRST_BYTE,		/* from parsed to first byte to the client */
+	METRIC_TOTAL,			/* from parsed to last byte to the client */
+	METRIC_NPHASES
+}metric_phase;
+
+/* What happened to requests */
+typedef enum
+{
+	METRIC_REQUESTS,		/* parsed */
+	METRIC_HITS,			/* served from memory or disk */
+	METRIC_JOINED,			/* streamed from another client's fetch */
+	METRIC_FETCHED,			/* relayed from the server */
+	METRIC_FAILED,			/* cut off before the response was done */
+	METRIC_LOCAL,			/* pages of the proxy itself */
+	METRIC_CUT,				/* joined, then cut off for lagging */
+	METRIC_NCOUNTERS
+}metric_counter;
+
+/* Latencies of one step, in nanoseconds */
+typedef struct
+{
+	uint64_t count;
+	uint64_t mean;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+}metric_summary;
+
+/* Sums over all threads */
+typedef struct
+{
+	uint64_t counters[METRIC_NCOUNTERS];
+	metric_summary phases[METRIC_NPHASES];
+}metrics_stats;
+
+uint64_t metrics_now(void);
+void metrics_record(metric_phase phase, uint64_t ns);
+void metrics_since(metric_phase phase, uint64_t start);
+void metrics_count(metric_counter counter);
+void get_metrics_stats(metrics_stats *st);
+const char *metric_phase_name(metric_phase phase);
+const char *metric_counter_name(metric_counter counter);
+
+#endif
@@ -0,0 +1,456 @@
+/*
+ * policy.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Eviction and admission policies of the cache. Every shard
+ * calls the operations of one policy, chosen when the cache is
+ * created. Hits only hold the reader lock of a shard, so they
+ * can never reorder its lists; a hit just marks the node as
+ * referenced (and counts it), and the policy acts on the mark
+ * later, when a writer looks for room.
+ *
+ * lru      Second-chance LRU. New nodes go to the head, victims
+ *          come from the tail, and a referenced tail node is
+ *          moved back to the head instead of being evicted.
+ * slru     Segmented LRU. New nodes start on probation, and a
+ *          node hit while on probation is promoted to the
+ *          protected segment, which keeps SLRU_PROTECTED_PCT of
+ *          the shard and demotes its own tail back to probation.
+ *          Victims come from probation, so a burst of one-time
+ *          objects cannot flush the objects hit more than once.
+ * tinylfu  LRU behind an admission filter. A count-min sketch
+ *          estimates how often every request was looked up,
+ *          cached or not, and a new object is only admitted if
+ *          it is more popular than each of the nodes that would
+ *          be evicted for it. The sketch is halved periodically
+ *          so that old popularity fades.
+ * gdsf     Greedy dual size frequency. Each node has priority
+ *          clock + hits / size, victims are taken from a min-heap
+ *          of priorities, and the clock rises to the priority of
+ *          every victim so that idle nodes age out. Small popular
+ *          objects are kept over large ones, which favors the
+ *          object hit ratio.
+ */
+
+#include "csapp.h"
+#include "policy.h"
+
+/* Multipliers spreading a hash over the rows of the sketch */
+static const uint64_t sketch_seeds[SKETCH_DEPTH] = {
+	0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+	0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
+
+static void mark_referenced(node *cb);
+static void no_init(cache_list *cl);
+static int admit_all(cache_list *cl, uint64_t hash, unsigned int size);
+static void no_remove(cache_list *cl, node *cb);
+static void lru_access(cache_list *cl, uint64_t hash, node *hit);
+static void lru_insert(cache_list *cl, node *cb);
+static node *lru_victim(cache_list *cl);
+static node *slru_victim(cache_list *cl);
+static void slru_shrink(cache_list *cl);
+static void slru_remove(cache_list *cl, node *cb);
+static void tinylfu_init(cache_list *cl);
+static void tinylfu_deinit(cache_list *cl);
+static void tinylfu_access(cache_list *cl, uint64_t hash, node *hit);
+static int tinylfu_admit(cache_list *cl, uint64_t hash, unsigned int size);
+static unsigned short *sketch_counter(cache_list *cl, uint64_t hash, int row);
+static unsigned int sketch_estimate(cache_list *cl, uint64_t hash);
+static void gdsf_init(cache_list *cl);
+static void gdsf_deinit(cache_list *cl);
+static void gdsf_access(cache_list *cl, uint64_t hash, node *hit);
+static void gdsf_insert(cache_list *cl, node *cb);
+static node *gdsf_victim(cache_list *cl);
+static void gdsf_remove(cache_list *cl, node *cb);
+static double gdsf_priority(cache_list *cl, node *cb);
+static void heap_set(cache_list *cl, unsigned int i, node *cb);
+static void sift_up(cache_list *cl, unsigned int i);
+static void sift_down(cache_list *cl, unsigned int i);
+
+/* Operations of every policy, in the order of cache_policy */
+static const struct policy_ops policies[POLICY_COUNT] = {
+	{ "lru", no_init, no_init, lru_access, admit_all,
+	  lru_insert, lru_victim, no_remove },
+	{ "slru", no_init, no_init, lru_access, admit_all,
+	  lru_insert, slru_victim, slru_remove },
+	{ "tinylfu", tinylfu_init, tinylfu_deinit, tinylfu_access,
+	  tinylfu_admit, lru_insert, lru_victim, no_remove },
+	{ "gdsf", gdsf_init, gdsf_deinit, gdsf_access, admit_all,
+	  gdsf_insert, gdsf_victim, gdsf_remove }
+};
+
+
+/*
+ * Return the operations of a policy
+ */
+const struct policy_ops *policy_ops_of(cache_policy policy)
+{
+	return &policies[policy < POLICY_COUNT ? policy : POLICY_LRU];
+}
+
+/*
+ * Find a policy by name, return -1 if there is none
+ */
+int cache_policy_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < POLICY_COUNT; i++)
+		if (!strcasecmp(name, policies[i].name))
+			return i;
+	return -1;
+}
+
+/*
+ * Return the name of a policy
+ */
+const char *cache_policy_name(cache_policy policy)
+{
+	return policy_ops_of(policy)->name;
+}
+
+/*
+ * Mark a node hit, without writing the flag when already set
+ */
+static void mark_referenced(node *cb)
+{
+	if (!cb->referenced)
+		__atomic_store_n(&cb->referenced, 1, __ATOMIC_RELAXED);
+}
+
+static void no_init(cache_list *cl)
+{
+	return;
+}
+
+static int admit_all(cache_list *cl, uint64_t hash, unsigned int size)
+{
+	return 1;
+}
+
+static void no_remove(cache_list *cl, node *cb)
+{
+	return;
+}
+
+
+/*
+ * Second-chance LRU
+ */
+static void lru_access(cache_list *cl, uint64_t hash, node *hit)
+{
+	if (hit != NULL)
+		mark_referenced(hit);
+}
+
+static void lru_insert(cache_list *cl, node *cb)
+{
+	push_to_head(cl, cb);
+}
+
+/*
+ * Take the tail, moving referenced nodes back to the head.
+ * Each move clears a mark, so the loop ends after one pass
+ * at most.
+ */
+static node *lru_victim(cache_list *cl)
+{
+	node *cn;
+
+	while ((cn = cl->tail->prev) != cl->head)
+	{
+		if (!cn->referenced)
+			return cn;
+		cn->referenced = 0;
+		unlink_node(cn);
+		push_to_head(cl, cn);
+	}
+	return NULL;
+}
+
+
+/*
+ * Segmented LRU. The main list of the shard is the probation
+ * segment and phead/ptail is the protected one.
+ */
+static node *slru_victim(cache_list *cl)
+{
+	node *cn;
+
+	while ((cn = cl->tail->prev) != cl->head)
+	{
+		if (!cn->referenced)
+			return cn;
+
+		/* Hit while on probation, promote it */
+		cn->referenced = 0;
+		unlink_node(cn);
+		link_after(cl->phead, cn);
+		cn->segment = 1;
+		cl->protected_size += cn->footprint;
+		slru_shrink(cl);
+	}
+
+	/* Probation is empty, fall back to the protected tail */
+	cn = cl->ptail->prev;
+	return cn == cl->phead ? NULL : cn;
+}
+
+/*
+ * Demote protected nodes to probation until the protected
+ * segment fits its share, giving referenced ones a second
+ * chance at the protected head
+ */
+static void slru_shrink(cache_list *cl)
+{
+	unsigned int limit = cl->capacity / 100 * SLRU_PROTECTED_PCT;
+	node *cn;
+
+	while (cl->protected_size > limit)
+	{
+		cn = cl->ptail->prev;
+		unlink_node(cn);
+		if (cn->referenced)
+		{
+			cn->referenced = 0;
+			link_after(cl->phead, cn);
+			continue;
+		}
+		cn->segment = 0;
+		cl->protected_size -= cn->footprint;
+		push_to_head(cl, cn);
+	}
+}
+
+static void slru_remove(cache_list *cl, node *cb)
+{
+	if (cb->segment)
+		cl->protected_size -= cb->footprint;
+}
+
+
+/*
+ * TinyLFU admission over second-chance LRU
+ */
+static void tinylfu_init(cache_list *cl)
+{
+	cl->sketch_width = SKETCH_MIN_WIDTH;
+	while (cl->sketch_width < cl->capacity / 1024)
+		cl->sketch_width <<= 1;
+	cl->sketch = (unsigned short *)calloc(SKETCH_DEPTH * cl->sketch_width,
+										  sizeof(unsigned short));
+	cl->sketch_adds = 0;
+}
+
+static void tinylfu_deinit(cache_list *cl)
+{
+	free(cl->sketch);
+	cl->sketch = NULL;
+}
+
+/*
+ * Count every lookup, hit or miss. Counters stop at
+ * SKETCH_MAX, give or take a few racing readers.
+ */
+static void tinylfu_access(cache_list *cl, uint64_t hash, node *hit)
+{
+	unsigned short *c;
+	int row;
+
+	if (hit != NULL)
+		mark_referenced(hit);
+
+	for (row = 0; row < SKETCH_DEPTH; row++)
+	{
+		c = sketch_counter(cl, hash, row);
+		if (*c < SKETCH_MAX)
+			__sync_fetch_and_add(c, 1);
+	}
+	__sync_fetch_and_add(&cl->sketch_adds, 1);
+}
+
+/*
+ * Admit an object only if it was looked up more often than
+ * every node LRU would evict to make room for it
+ */
+static int tinylfu_admit(cache_list *cl, uint64_t hash, unsigned int size)
+{
+	unsigned int i, freq, freed = 0;
+	node *cn;
+
+	/* Age the sketch, halving every counter */
+	if (cl->sketch_adds >= (unsigned long)SKETCH_SAMPLE * cl->sketch_width)
+	{
+		for (i = 0; i < SKETCH_DEPTH * cl->sketch_width; i++)
+			cl->sketch[i] >>= 1;
+		cl->sketch_adds /= 2;
+	}
+
+	freq = sketch_estimate(cl, hash);
+	for (cn = cl->tail->prev;
+		 cn != cl->head && cl->_size - freed + size > cl->capacity;
+		 cn = cn->prev)
+	{
+		/* Referenced nodes would get a second chance */
+		if (cn->referenced)
+			continue;
+		if (sketch_estimate(cl, cn->hash) >= freq)
+			return 0;
+		freed += cn->footprint;
+	}
+	return 1;
+}
+
+static unsigned short *sketch_counter(cache_list *cl, uint64_t hash, int row)
+{
+	uint64_t h = hash * sketch_seeds[row];
+
+	return &cl->sketch[row * cl->sketch_width +
+					   ((h >> 32) & (cl->sketch_width - 1))];
+}
+
+/*
+ * Estimated lookups of a hash, the smallest of its counters
+ */
+static unsigned int sketch_estimate(cache_list *cl, uint64_t hash)
+{
+	unsigned int c, min = SKETCH_MAX;
+	int row;
+
+	for (row = 0; row < SKETCH_DEPTH; row++)
+	{
+		c = *sketch_counter(cl, hash, row);
+		if (c < min)
+			min = c;
+	}
+	return min;
+}
+
+
+/*
+ * Greedy dual size frequency
+ */
+static void gdsf_init(cache_list *cl)
+{
+	cl->heap_cap = GDSF_INIT_HEAP;
+	cl->heap_n = 0;
+	cl->heap = (node **)malloc(cl->heap_cap * sizeof(node *));
+	cl->clock = 0;
+}
+
+static void gdsf_deinit(cache_list *cl)
+{
+	free(cl->heap);
+	cl->heap = NULL;
+}
+
+static void gdsf_access(cache_list *cl, uint64_t hash, node *hit)
+{
+	if (hit != NULL)
+	{
+		__sync_fetch_and_add(&hit->freq, 1);
+		mark_referenced(hit);
+	}
+}
+
+static void gdsf_insert(cache_list *cl, node *cb)
+{
+	push_to_head(cl, cb);
+
+	if (cl->heap_n == cl->heap_cap)
+	{
+		cl->heap_cap *= 2;
+		cl->heap = (node **)realloc(cl->heap, cl->heap_cap * sizeof(node *));
+	}
+	cb->freq = 1;
+	cb->priority = gdsf_priority(cl, cb);
+	heap_set(cl, cl->heap_n++, cb);
+	sift_up(cl, cb->heapidx);
+}
+
+/*
+ * Take the lowest priority. Hits only raise a priority, so
+ * a referenced top is ranked again and pushed down until the
+ * top is a node nobody hit since it was last ranked.
+ */
+static node *gdsf_victim(cache_list *cl)
+{
+	node *cn;
+
+	while (cl->heap_n > 0)
+	{
+		cn = cl->heap[0];
+		if (cn->referenced)
+		{
+			cn->referenced = 0;
+			cn->priority = gdsf_priority(cl, cn);
+			sift_down(cl, 0);
+			continue;
+		}
+		cl->clock = cn->priority;
+		return cn;
+	}
+	return NULL;
+}
+
+/*
+ * Replace the node by the last one of the heap
+ */
+static void gdsf_remove(cache_list *cl, node *cb)
+{
+	unsigned int i = cb->heapidx;
+
+	cl->heap_n--;
+	if (i < cl->heap_n)
+	{
+		heap_set(cl, i, cl->heap[cl->heap_n]);
+		sift_down(cl, i);
+		sift_up(cl, i);
+	}
+	cb->heapidx = -1;
+}
+
+static double gdsf_priority(cache_list *cl, node *cb)
+{
+	return cl->clock + (double)cb->freq / cb->footprint;
+}
+
+static void heap_set(cache_list *cl, unsigned int i, node *cb)
+{
+	cl->heap[i] = cb;
+	cb->heapidx = i;
+}
+
+static void sift_up(cache_list *cl, unsigned int i)
+{
+	node *cb = cl->heap[i];
+
+	while (i > 0 && cl->heap[(i - 1) / 2]->priority > cb->priority)
+	{
+		heap_set(cl, i, cl->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(cl, i, cb);
+}
+
+static void sift_down(cache_list *cl, unsigned int i)
+{
+	node *cb = cl->heap[i];
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < cl->heap_n)
+	{
+		if (child + 1 < cl->heap_n &&
+			cl->heap[child + 1]->priority < cl->heap[child]->priority)
+			child++;
+		if (cl->heap[child]->priority >= cb->priority)
+			break;
+		heap_set(cl, i, cl->heap[child]);
+		i = child;
+	}
+	heap_set(cl, i, cb);
+}
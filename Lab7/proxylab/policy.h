@@ -0,0 +1,51 @@
+/*
+ * policy.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Eviction and admission policies of the cache
+ */
+
+#ifndef POLICY_H
+#define POLICY_H
+
+#include "cache.h"
+
+/* Share of a shard kept for the protected segment of SLRU, in percent */
+#define SLRU_PROTECTED_PCT 80
+
+/* Rows of the TinyLFU count-min sketch and the largest count */
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX 15
+
+/* Counters per row, at least this many and about one per KB cached */
+#define SKETCH_MIN_WIDTH 256
+
+/* The sketch is halved after this many additions per counter of a row */
+#define SKETCH_SAMPLE 10
+
+/* Initial number of slots of the GDSF heap */
+#define GDSF_INIT_HEAP 64
+
+/*
+ * Operations of a policy. access() runs on every lookup with
+ * only the reader lock of the shard held, so it may change
+ * nodes and counters only atomically. The others run with the
+ * writer lock held: admit() decides whether an object is cached
+ * at all, insert() links a new node, victim() picks the next
+ * node to evict and remove() forgets a node leaving the shard.
+ */
+struct policy_ops
+{
+	const char *name;
+	void (*init)(cache_list *cl);
+	void (*deinit)(cache_list *cl);
+	void (*access)(cache_list *cl, uint64_t hash, node *hit);
+	int (*admit)(cache_list *cl, uint64_t hash, unsigned int size);
+	void (*insert)(cache_list *cl, node *cb);
+	node *(*victim)(cache_list *cl);
+	void (*remove)(cache_list *cl, node *cb);
+};
+
+const struct policy_ops *policy_ops_of(cache_policy policy);
+
+#endif
@@ -8,419 +8,1534 @@
 #include <stdlib.h>
 #include "csapp.h"
 #include "cache.h"
-/* Recommended max cache and object sizes */
-#define MAX_OBJECT_SIZE 102400
-#define DEFAULT_PORT    80
-/* You won't lose style points for including these long lines in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+#include "sbuf.h"
+#include "proxy.h"
+#include "event.h"
+#include "uring.h"
+#include "upstream.h"
+#include "dns.h"
+#include "relay.h"
+#include "flight.h"
+#include "fresh.h"
+#include "disk.h"
+#include "bufpool.h"
+#include "request.h"
+#include "scan.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include <netinet/tcp.h>
 
-static cache_list *web_cache;
+cache *web_cache;
+unsigned int max_object_size = MAX_OBJECT_SIZE;
+static sbuf_t sbuf;     /* Connected descriptors waiting for a worker */
+static unsigned long spliced_bytes;    /* body bytes never copied to user space */
+static unsigned long stale_hits;       /* served stale while revalidated */
+static unsigned long revalidations;    /* conditional requests sent */
+static unsigned long not_modified;     /* of which the server answered 304 */
+static unsigned long too_large;        /* responses over the max object size */
+static char *snapshot_path;            /* -S, NULL without snapshots */
+static sigset_t snapshot_signals;      /* taken by snapshot_thread only */
 
+/* A response being relayed from a server to a client */
+typedef struct {
+    int clientfd;
+    int keepalive;          /* client wants, then gets, a persistent conn */
+    growbuf copy;           /* kept for the cache, pooled */
+    int fit_size;
+    unsigned int forwarded; /* bytes already sent to the client */
+    flight *fl;             /* flight led by this fetch, if any */
+    fresh_info fi;          /* what its headers say about caching */
+    int revalidating;       /* a conditional request for a cached copy */
+    int not_modified;       /* the server answered it with a 304 */
+    uint64_t received;      /* when the client request was read */
+    int more;               /* hold what is sent for the packets of the next */
+} response;
 
-/* Customized write func and error handler wrapper */
-int myRio_writen(int fd, void *usrbuf, size_t n);
+/* Pieces of a conditional request: the request and two validators */
+#define COND_IOV (REQ_MAX_IOV + 6)
+
+/* How a request was answered, for the counters and the access log */
+typedef struct {
+    uint64_t received;      /* when it was read */
+    metric_counter outcome;
+    int status;             /* of the response, 0 if unknown */
+    unsigned long bytes;    /* sent to the client */
+} served;
+
+/* Where build_stats() writes, as text lines or JSON members */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t maxlen;
+    int json;
+    int n;                  /* values written */
+} stats_out;
+
+/* A stale cached response to revalidate in the background */
+typedef struct {
+    char key[MAXLINE];
+    char request[MAXLINE];
+    char host[MAXLINE];
+    int port;
+    uint64_t hash;
+} revalidation;
+
+
+/* Error page for requests the proxy could not serve */
 void client_error(int fd, char *cause, char *errnum, 
         char *shortmsg, char *longmsg);
 
+void usage(char *prog);
+unsigned long parse_size(char *s);
 void *thread(void *vargp);
-void doit(int fd);
-char* substring(char *dest, char *src, char *delim);
-int generate_request(rio_t *rp, char *i_request, char *i_host, 
-        char *i_uri, int *i_port);
-int parse_request(char *request, char *reqline, 
-        char *host, char *uri, int *port);
-int parse_uri(char *uri, char *host, int *port, char *uri_wohost);
-void get_key_value(char *header_line, char *key, char *value);
-void get_host_port(char *value, char *host, int *port);
+void *snapshot_thread(void *vargp);
+void serve_client(int fd);
+int doit(int fd, rio_t *client_rio, uint32_t client);
+int serve_request(int fd, http_request *req, served *sv);
+int serve_cached(int fd, node *cached, int keepalive);
+int serve_flight(int fd, flight *fl, flight_cursor *cur, int keepalive, 
+        served *sv);
+int serve_disk(int fd, disk_object *obj, int keepalive, served *sv);
+int fetch(struct iovec *iov, int niov, char *host, int port, 
+        response *resp);
+int conditional_request(struct iovec *cond, struct iovec *iov, int niov, 
+        node *cached);
+void revalidate_later(node *cached, char *key, struct iovec *iov, 
+        int niov, char *host, int port, uint64_t hash);
+void *revalidate_thread(void *vargp);
+void refresh_cached(node *cached, uint64_t hash, fresh_info *upd);
+void cache_response(char *key, uint64_t hash, response *resp);
+int write_cached(int fd, node *cached, int keepalive);
+int is_hop_header(char *line);
+int serve_stats(int fd, int json, served *sv);
+int serve_snapshot(int fd, served *sv);
+int local_page(char *buf, size_t maxlen, char *status, char *body);
+int relay_response(rio_t *rp, response *resp);
+int relay_body(rio_t *rp, response *resp, long n);
+int forward(response *resp, char *buf, size_t n);
+void stats_printf(stats_out *o, const char *fmt, ...);
+void stat_num(stats_out *o, const char *name, unsigned long long v);
+void stat_str(stats_out *o, const char *name, const char *v);
 
 
 
 int main(int argc, char **argv) 
 {
-    int listenfd, clientlen;
-    int *connfdp;
+    int listenfd, connfd, clientlen;
+    int i, opt;
+    int nthreads = DEFAULT_NTHREADS;
+    int nloops = -1;
+    int nrings = -1;
+    int sbufsize = DEFAULT_SBUFSIZE;
+    unsigned int nshards = CACHE_DEFAULT_SHARDS;
+    unsigned long cache_size = MAX_CACHE_SIZE;
+    unsigned long object_size = MAX_OBJECT_SIZE;
+    int policy = POLICY_LRU;
+    char *disk_path = NULL;
+    char *log_path = NULL;
+    unsigned long disk_size = DISK_DEFAULT_SIZE;
     struct sockaddr_in clientaddr;
     pthread_t tid;
 
-    /* Cache list initiation */
-    web_cache = (cache_list *)malloc(sizeof(cache_list));
-    init_cache_list(web_cache);
+    /* Parse command line options, -V replacing the default key */
+    request_vary(REQ_DEFAULT_VARY);
+    while ((opt = getopt(argc, argv, "s:t:q:e:u:p:c:o:d:D:S:V:l:")) != -1) {
+        switch (opt) {
+        case 's':
+            nshards = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'q':
+            sbufsize = atoi(optarg);
+            break;
+        case 'e':
+            nloops = atoi(optarg);
+            break;
+        case 'u':
+            nrings = atoi(optarg);
+            break;
+        case 'p':
+            if ((policy = cache_policy_parse(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'c':
+            cache_size = parse_size(optarg);
+            break;
+        case 'o':
+            object_size = parse_size(optarg);
+            break;
+        case 'd':
+            disk_path = optarg;
+            break;
+        case 'D':
+            disk_size = parse_size(optarg);
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        case 'V':
+            if (request_vary(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'l':
+            log_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
     /* Check command line args number */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    if (argc - optind != 1 || nthreads < 1 || sbufsize < 1 ||
+            object_size < 1 || cache_size < object_size || 
+            cache_size > UINT_MAX || 
+            (disk_path != NULL && disk_size < object_size * 4))
+        usage(argv[0]);
+    max_object_size = object_size;
+
+    /* 
+     * Every shard must be able to hold the largest object,
+     * so bound the number of shards by the cache size
+     */
+    if (nshards < 1)
+        nshards = 1;
+    if (nshards > cache_size / object_size) {
+        nshards = cache_size / object_size;
+        fprintf(stderr, "Too many shards, using %u\n", nshards);
     }
 
+    /* 
+     * SIGUSR1 asks for a snapshot. Block it before any thread 
+     * starts, so only the snapshot thread ever takes it.
+     */
+    sigemptyset(&snapshot_signals);
+    sigaddset(&snapshot_signals, SIGUSR1);
+    if (snapshot_path != NULL)
+        pthread_sigmask(SIG_BLOCK, &snapshot_signals, NULL);
+
+    /* Cache list initiation */
+    web_cache = init_cache(nshards, cache_size, policy);
+    bufpool_init();
+
+    /* Evicted objects go on to the disk tier, if there is one */
+    if (disk_path != NULL) {
+        if (disk_init(disk_path, disk_size, max_object_size) < 0)
+            unix_error("Cannot open disk cache");
+        web_cache->spill = disk_spill;
+    }
+
+    /* Start warm from the last snapshot, if there is one */
+    if (snapshot_path != NULL) {
+        long n = cache_restore(web_cache, snapshot_path, max_object_size);
+
+        if (n >= 0)
+            printf("Restored %ld objects from %s\n", n, snapshot_path);
+        Pthread_create(&tid, NULL, snapshot_thread, NULL);
+    }
+    upstream_init();
+    dns_init();
+    flight_init();
+    if (log_path != NULL && accesslog_open(log_path) < 0)
+        unix_error("Cannot open access log");
+
     /* Ignore SIGPIPE signal */
     Signal(SIGPIPE, SIG_IGN);
 
+    /* The queue stays empty in event-driven mode */
+    sbuf_init(&sbuf, sbufsize);
+
+    /* Event-driven and completion-driven modes never return */
+    if (nloops >= 0)
+        event_run(argv[optind], nloops);
+    if (nrings >= 0)
+        uring_run(argv[optind], nrings);
+
     /* Open listening port */
-    listenfd = Open_listenfd(argv[1]);
+    listenfd = Open_listenfd(argv[optind]);
 
+    /* Prethread the pool of workers */
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid, NULL, thread, NULL);
+
+    /* 
+     * Hand accepted connections to the pool, blocking
+     * while the queue is full 
+     */
     while (1) {
         clientlen = sizeof(clientaddr);
-        connfdp = (int *)malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, 
+        connfd = Accept(listenfd, (SA *)&clientaddr, 
                     (socklen_t *)&clientlen);
-        Pthread_create(&tid, NULL, thread, connfdp);
+        sbuf_insert(&sbuf, connfd);
     }
     
     return 0;
 }
 
+/*
+ * Print the command line usage and exit
+ */
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-s shards] [-t threads] [-q depth] "
+            "[-e loops] [-u rings] [-p policy] [-c bytes]\n"
+            "       [-o bytes] [-d file] [-D bytes] [-S file] [-V headers] [-l file] "
+            "<port>\n", 
+            prog);
+    fprintf(stderr, "   -s shards  number of independently locked "
+            "cache shards (default %d)\n", CACHE_DEFAULT_SHARDS);
+    fprintf(stderr, "   -t threads number of worker threads "
+            "(default %d)\n", DEFAULT_NTHREADS);
+    fprintf(stderr, "   -q depth   connections queued for the workers "
+            "(default %d)\n", DEFAULT_SBUFSIZE);
+    fprintf(stderr, "   -e loops   event-driven mode with this many epoll "
+            "loops instead of threads (0: one per CPU)\n");
+    fprintf(stderr, "   -u rings   completion-driven mode with this many "
+            "io_uring rings instead of threads (0: one per CPU)\n");
+    fprintf(stderr, "   -p policy  cache eviction policy: lru, slru, "
+            "tinylfu or gdsf (default lru)\n");
+    fprintf(stderr, "   -c bytes   cache capacity (default %d)\n", 
+            MAX_CACHE_SIZE);
+    fprintf(stderr, "   -o bytes   largest object cached (default %d)\n", 
+            MAX_OBJECT_SIZE);
+    fprintf(stderr, "   -d file    keep evicted objects in this log file, "
+            "indexed again at startup\n");
+    fprintf(stderr, "   -D bytes   size of the disk log (default %d)\n", 
+            DISK_DEFAULT_SIZE);
+    fprintf(stderr, "   -S file    snapshot file, restored at startup and "
+            "written on SIGUSR1 or GET /__snapshot\n");
+    fprintf(stderr, "   -V headers client headers in the cache key, "
+            "comma separated (default %s)\n", REQ_DEFAULT_VARY);
+    fprintf(stderr, "   -l file    append a line per request to this "
+            "access log\n");
+    fprintf(stderr, "   Sizes take a k, m or g suffix.\n");
+    exit(1);
+}
+
+/*
+ * Parse a size in bytes, with an optional k, m or g suffix,
+ * return 0 if it is not one
+ */
+unsigned long parse_size(char *s)
+{
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K':
+        n <<= 10;
+        end++;
+        break;
+    case 'm': case 'M':
+        n <<= 20;
+        end++;
+        break;
+    case 'g': case 'G':
+        n <<= 30;
+        end++;
+        break;
+    }
+    return end == s || *end != '\0' ? 0 : n;
+}
+
 /* 
- * New threads to process the request and then detach it for 
- * it being automatically handled after finishing 
+ * Worker thread of the pool, detached for it being 
+ * automatically reaped. It keeps taking connections 
+ * from the queue and processing their requests.
  */
 void *thread(void* vargp) 
 {
-    int connfd = *((int *)vargp);
-    free(vargp);
-
     Pthread_detach(Pthread_self());
-    doit(connfd);
-    Close(connfd);
+    while (1) {
+        int connfd = sbuf_remove(&sbuf);
+        serve_client(connfd);
+        Close(connfd);
+    }
     return NULL;
 }
 
-void free_request(char *request ,char *uri ,char *host )
+/*
+ * Serve the requests of a client connection until it is 
+ * closed, idle for too long, or a response cannot be framed. 
+ * Pipelined requests wait in the rio buffer and are served 
+ * in order. A worker blocked on an idle client cannot take 
+ * new connections, so when some are queued the connection 
+ * is closed as soon as it has nothing pipelined.
+ */
+void serve_client(int fd)
 {
-    free(request);
-    free(host);
-    free(uri);
+    rio_t client_rio;
+    struct timeval tv;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    uint32_t client = 0;
+    int one = 1;
+
+    tv.tv_sec = CLIENT_IDLE_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    /* Responses go out gathered, so there is nothing for Nagle to merge */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    /* Who the client is, once, for the access log */
+    if (accesslog_enabled() && 
+            getpeername(fd, (SA *)&addr, &len) == 0 && 
+            addr.sin_family == AF_INET)
+        client = addr.sin_addr.s_addr;
+
+    Rio_readinitb(&client_rio, fd);
+    while (doit(fd, &client_rio, client)) {
+        if (client_rio.rio_cnt == 0 && sbuf_depth(&sbuf) > 0)
+            break;
+    }
 }
+
 /* 
- * Process a request 
+ * Process a request, return 1 if the client 
+ * connection can take another one
  */
-void doit(int fd) 
+int doit(int fd, rio_t *client_rio, uint32_t client) 
 {  
-    int is_static;  
-    int port;
-    int server_fd;
-    int content_size = 0;
-    int fit_size = 1;
-    unsigned int total = 0;
-    char* content_copy = NULL;
-    char *uri = (char *)malloc(MAXLINE * sizeof(char));
-    char *request = (char *)malloc(MAXLINE * sizeof(char));
-    char *host = (char *)malloc(MAXLINE * sizeof(char));
-    rio_t client_rio, server_rio;
+    http_request req;
+    served sv;
+    uint64_t ns;
+    int rc;
 
-    Rio_readinitb(&client_rio, fd);
+    /* Parse the GET request in the buffer it was read into */
+    if ((rc = read_request(client_rio, &req)) < 0)
+        client_error(fd, "request", "400", "Bad Request", 
+                "The proxy could not parse the");
+    if (rc <= 0)
+        return 0;
+    sv.received = req.received;
+    sv.outcome = METRIC_FAILED;
+    sv.status = 0;
+    sv.bytes = 0;
+    rc = serve_request(fd, &req, &sv);
 
-    /* Parse URI from GET request */
-    is_static = generate_request(&client_rio, request, host, uri, &port);   
-    if(!is_static) {
-        free_request(request ,uri ,host);
-        return;
-    }
+    ns = metrics_now() - req.received;
+    metrics_count(METRIC_REQUESTS);
+    metrics_count(sv.outcome);
+    metrics_record(METRIC_TOTAL, ns);
+    accesslog_write(client, req.uri.p, req.uri.n, sv.status, sv.bytes, 
+            sv.outcome, ns);
+    return rc;
+}
 
-    /* First: read in cache */
-    content_copy = search_cache(web_cache, request, &content_size);
-    /* Cache hit: send cached response back to client */
-    if (content_size > 0){ 
-        if (content_copy == NULL){
-            printf("Content in cache error\n");
-            return;
-        }
+/*
+ * Answer a parsed request, from the proxy, the cache or the
+ * server. Return 1 if the client connection can take another
+ * request.
+ */
+int serve_request(int fd, http_request *req, served *sv)
+{
+    int port;
+    int rc;
+    int keepalive;
+    int leader;
+    int niov, ncond;
+    uint64_t key_hash, start;
+    response resp;
+    node *cached;
+    flight *fl = NULL;
+    flight_cursor cur;
+    disk_object dobj;
+    time_t now;
+    struct iovec iov[REQ_MAX_IOV], cond[COND_IOV];
+    char key[MAXLINE], host[REQ_MAX_HOST + 1];
 
-        Rio_writen(fd, content_copy, content_size);
-        free(content_copy);
-        free_request(request ,uri ,host);
-        return;
-    }  
+    keepalive = req->keepalive;
 
-    /* Cache miss: connect to server to get response
-     * Open connection error
-     */
-    char p[20];
-    sprintf(p, "%d", port);
-    if ((server_fd = Open_clientfd(host, p)) < 0) {   
-        free_request(request ,uri ,host);
-        return;
+    /* Requests for the proxy itself */
+    if (slice_is(req->uri, "/__stats") || 
+            slice_is(req->uri, "/__stats?format=json")) {
+        sv->outcome = METRIC_LOCAL;
+        return serve_stats(fd, slice_is(req->uri, "/__stats?format=json"), 
+                sv);
+    }
+    if (slice_is(req->uri, "/__snapshot")) {
+        sv->outcome = METRIC_LOCAL;
+        return serve_snapshot(fd, sv);
     }
-        
-    Rio_readinitb(&server_rio, server_fd);
 
-    /* Send request to server */
-    if (!myRio_writen(server_fd, request, strlen(request))) {
-        Close(server_fd);
-        free_request(request ,uri ,host);
-        return;
+    /* 
+     * The cache key names the resource, the request for the
+     * server goes out in pieces
+     */
+    if (request_key(req, key, MAXLINE) == 0) {
+        sv->status = 400;
+        client_error(fd, "request", "400", "Bad Request", 
+                "The proxy could not parse the");
+        return 0;
     }
+    niov = request_iov(req, 1, iov);
+    slice_copy(req->host, host);
+    port = req->port;
+
+    /* 
+     * First: read in cache. A fresh copy is served as is. A stale
+     * one may still be served while it is revalidated in the
+     * background, if the server allowed stale-while-revalidate.
+     */
+    start = metrics_now();
+    key_hash = cache_hash(key);
+    cached = search_cache(web_cache, key, key_hash);
+    metrics_since(METRIC_LOOKUP, start);
+    now = time(NULL);
+    if (cached != NULL && 
+            now < __atomic_load_n(&cached->meta.stale_until, __ATOMIC_RELAXED)) {
+        if (now >= __atomic_load_n(&cached->meta.fresh_until, 
+                    __ATOMIC_RELAXED)) {
+            __sync_fetch_and_add(&stale_hits, 1);
+            if (__sync_bool_compare_and_swap(&cached->revalidating, 0, 1))
+                revalidate_later(cached, key, iov, niov, host, port, 
+                        key_hash);
+        }
+        sv->outcome = METRIC_HITS;
+        sv->status = response_status(cached->content, cached->_size);
+        sv->bytes = cached->_size;
+        metrics_since(METRIC_FIRST_BYTE, req->received);
+        rc = serve_cached(fd, cached, keepalive);
+        return rc;
+    }  
+
+    /* Nothing relayed yet, whatever fails before the server answers */
+    memset(&resp, 0, sizeof(resp));
+    fresh_init(&resp.fi);
+    resp.clientfd = fd;
+    resp.keepalive = keepalive;
+    growbuf_init(&resp.copy);
+    resp.fl = NULL;
+    resp.revalidating = 0;
+    resp.received = req->received;
+    leader = 0;
 
-    
-    ssize_t n;
-    char buf[MAX_OBJECT_SIZE];
-    char content[MAX_OBJECT_SIZE];
     /* 
-     * Forward response from the server to the 
-     * client through connfd and keep reading 
-     * until the end of the response 
+     * Too stale: ask the server whether the cached copy is still
+     * valid, and serve it again if so
      */
-    while ((n = Rio_readnb(&server_rio, buf, MAX_OBJECT_SIZE))) {
-        if(n < 0) {
-            free_request(request ,uri ,host);
-            return;
+    if (cached != NULL && 
+            (ncond = conditional_request(cond, iov, niov, cached)) > 0) {
+        resp.revalidating = 1;
+        __sync_fetch_and_add(&revalidations, 1);
+        rc = fetch(cond, ncond, host, port, &resp);
+        if (rc >= 0 && resp.not_modified) {
+            __sync_fetch_and_add(&not_modified, 1);
+            refresh_cached(cached, key_hash, &resp.fi);
+            sv->outcome = METRIC_HITS;
+            sv->status = response_status(cached->content, cached->_size);
+            sv->bytes = cached->_size;
+            metrics_since(METRIC_FIRST_BYTE, req->received);
+            rc = serve_cached(fd, cached, keepalive);
+            growbuf_free(&resp.copy);
+            return rc;
+        }
+        release_cache(cached);
+    } else {
+        if (cached != NULL)
+            release_cache(cached);
+
+        /* Evicted from memory, but maybe still on disk */
+        if (cached == NULL && disk_enabled() && 
+                disk_lookup(key, key_hash, &dobj) &&
+                (rc = serve_disk(fd, &dobj, keepalive, sv)) >= 0) {
+            sv->outcome = METRIC_HITS;
+            return rc;
         }
 
-        /* Store the response and 
-         * check if it extends the max object size
+        /* 
+         * Cache miss: if another client is already fetching the
+         * same request, stream its response as it arrives. If it
+         * failed before sending us anything, fetch it ourselves.
          */
-        if ((total + n) < MAX_OBJECT_SIZE){
-            memcpy(content + total, buf, sizeof(char) * n);
-            total += n;
-        }else{
-            printf("Web content object exceeds maximum size!\n");
-            fit_size = 0;
+        fl = flight_join(key, key_hash, &leader, &cur);
+        if (!leader) {
+            rc = serve_flight(fd, fl, &cur, keepalive, sv);
+            flight_leave(fl, &cur);
+            if (rc >= 0)
+                return rc;
         }
-        /* Forward response back to client */
-        Rio_writen(fd, buf, n);
+        resp.fl = leader ? fl : NULL;
+        rc = fetch(iov, niov, host, port, &resp);
     }
 
-    /* Close proxy-server connection */
-    Close(server_fd);
+    /* 
+     * Cache the response object if the server allows it and 
+     * it fits the max object size
+     */
+    if (rc >= 0)
+        sv->outcome = METRIC_FETCHED;
+    sv->status = resp.fi.status;
+    sv->bytes = resp.forwarded;
+    if (rc >= 0 && resp.fit_size == 1)
+        cache_response(key, key_hash, &resp);
 
-    /* Cache the response object if it fits the max object size */
-    if (fit_size == 1){
-        if (strstr(content, "no-cache") != NULL){
-            printf("No cache, do not cache\n");
-        }else{
-            printf("Cache the object uri: %s\n", uri);
-            update_cache(web_cache, request, content, total);
+    /* Nothing reached the client, so it can still be told why */
+    if (rc < 0 && resp.forwarded == 0) {
+        if (errno == ETIMEDOUT || errno == EAGAIN) {
+            sv->status = 504;
+            client_error(fd, host, "504", "Gateway Timeout", 
+                    "No answer in time from the server");
+        } else {
+            sv->status = 502;
+            client_error(fd, host, "502", "Bad Gateway", 
+                    "No valid answer from the server");
         }
-    } 
+    }
+
+    /* Let the clients streaming this response finish */
+    if (leader)
+        flight_finish(fl, rc >= 0);
  
-    free_request(request ,uri ,host);
-    return;
+    growbuf_free(&resp.copy);
+    return rc >= 0 && resp.keepalive;
 }
 
-/* 
- * Generate a new request for server according to the request from clinet
+/*
+ * Send the pinned cached response back to client without
+ * copying it. Return whether the connection stays open.
  */
-int generate_request(rio_t *rp, char *i_request, char *i_host, 
-            char *i_uri, int *i_port) 
+int serve_cached(int fd, node *cached, int keepalive)
 {
-    char buf[MAXLINE], key[MAXLINE], value[MAXLINE];
-    int port = DEFAULT_PORT;
-    int host_exist = 0; 
-    char* request = i_request;
-    char* host = i_host;
-    char* uri = i_uri;
+    int rc;
 
-    *request = 0;
-    *host = 0;
+    keepalive = keepalive && 
+        response_delimited(cached->content, cached->_size);
+    rc = write_cached(fd, cached, keepalive);
+    release_cache(cached);
+    return rc == 0 && keepalive;
+}
 
-    /* Parse the request to get the host, uri and port */
-    if (Rio_readlineb(rp, buf, MAXLINE) < 0 || 
-        !(parse_request(request, buf, host, uri, &port)))
+/*
+ * Stream the response another client is fetching as its bytes
+ * arrive. Like for cached responses, the Connection header of
+ * this client goes in at the end of the headers. Return whether
+ * the connection stays open, or -1 if nothing could be sent.
+ * Counts the request as joined, or cut if the flight cut this
+ * client off for lagging.
+ */
+int serve_flight(int fd, flight *fl, flight_cursor *cur, int keepalive, 
+        served *sv)
+{
+    struct iovec iov[3];
+    char head[MAXBUF];
+    char *data, *end, *conn;
+    size_t nhead = 0, split;
+    ssize_t n;
+
+    /* Gather the headers first */
+    do {
+        if (nhead == sizeof(head) || (n = flight_read(fl, cur, &data, 
+                        sizeof(head) - nhead)) <= 0)
+            return -1;
+        memcpy(head + nhead, data, n);
+        nhead += n;
+    } while ((end = header_end(head, nhead)) == NULL);
+
+    keepalive = keepalive && response_delimited(head, nhead);
+    conn = keepalive ? "Connection: keep-alive\r\n" : 
+        "Connection: close\r\n";
+    split = end - head - 2;
+    sv->status = response_status(head, nhead);
+    metrics_since(METRIC_FIRST_BYTE, sv->received);
+    iov_put(iov, 0, head, split);
+    iov_put(iov, 1, conn, strlen(conn));
+    iov_put(iov, 2, head + split, nhead - split);
+    if (sendv_all(fd, iov, 3, 0) < 0)
         return 0;
+    sv->bytes = nhead;
 
-    /* Concat the request headers */
-    strcat(request, user_agent_hdr);
-    strcat(request, accept_hdr);
-    strcat(request, accept_encoding_hdr);
-    strcat(request, "Connection: close\r\n");
-    strcat(request, "Proxy-Connection: close\r\n");
-
-    /* Go through the request line by line */
-    while (strcmp(buf, "\r\n")) {
-        *key = '\0';
-        *value = '\0';
-        if (Rio_readlineb(rp, buf, MAXLINE) < 0)
+    /* Then the rest, as the leader relays it */
+    sv->outcome = METRIC_JOINED;
+    while ((n = flight_read(fl, cur, &data, FLIGHT_CHUNK)) > 0) {
+        if (rio_writen(fd, data, n) != n)
             return 0;
+        sv->bytes += n;
+    }
+    if (n == FLIGHT_CUT)
+        sv->outcome = METRIC_CUT;
+    return n == 0 && keepalive;
+}
+
+/*
+ * Send a response kept in the disk log. The record is read into
+ * a pooled buffer first, and only sent if the log did not wrap
+ * over it while it was read, so no overwritten byte goes out.
+ * The Connection header of the client goes in at the end of the
+ * headers. Return whether the connection stays open, or -1 if
+ * nothing could be sent and the request must be fetched.
+ */
+int serve_disk(int fd, disk_object *obj, int keepalive, served *sv)
+{
+    struct iovec iov[3];
+    growbuf rec;
+    char *conn;
+    size_t split;
+    int rc;
 
-        if (!strcmp(buf, "\r\n"))
+    growbuf_init(&rec);
+    growbuf_reserve(&rec, obj->_size);
+    if (pread(disk_fd(), rec.data, obj->_size, obj->off) != 
+            (ssize_t)obj->_size || !disk_intact(obj)) {
+        growbuf_free(&rec);
+        return -1;
+    }
+
+    /* Without headers to split, the record goes out as is */
+    if (obj->head == 0 || obj->head + 2 > obj->_size) {
+        keepalive = 0;
+        split = obj->_size;
+        conn = "";
+    } else {
+        keepalive = keepalive && response_delimited(rec.data, obj->_size);
+        sv->status = response_status(rec.data, obj->_size);
+        split = obj->head;
+        conn = keepalive ? "Connection: keep-alive\r\n" : 
+            "Connection: close\r\n";
+    }
+    metrics_since(METRIC_FIRST_BYTE, sv->received);
+    iov_put(iov, 0, rec.data, split);
+    iov_put(iov, 1, conn, strlen(conn));
+    iov_put(iov, 2, rec.data + split, obj->_size - split);
+    rc = sendv_all(fd, iov, 3, 0);
+    growbuf_free(&rec);
+    if (rc < 0)
+        return 0;
+    sv->bytes = obj->_size;
+    return keepalive;
+}
+
+/*
+ * Get a connection to the server, pooled if possible, send
+ * it the request and relay its response to resp->clientfd.
+ * Return what relay_response() did, or -1 if the server
+ * could not be reached. On failure errno tells whether the
+ * server timed out, it is 0 if it merely closed.
+ */
+int fetch(struct iovec *iov, int niov, char *host, int port, 
+        response *resp)
+{
+    upconn *uc;
+    int rc;
+    uint64_t start;
+    char p[20];
+
+    sprintf(p, "%d", port);
+    while (1) {
+        errno = 0;
+        start = metrics_now();
+        uc = upstream_get(host, p);
+        metrics_since(METRIC_CONNECT, start);
+        if (uc == NULL)
+            return -1;
+
+        resp->copy.len = 0;
+        resp->fit_size = 1;
+        resp->forwarded = 0;
+        resp->not_modified = 0;
+        resp->more = 0;
+        fresh_init(&resp->fi);
+
+        /* Send request to server and relay the response */
+        rc = -1;
+        if (writev_all(uc->fd, iov, niov) >= 0)
+            rc = relay_response(&uc->rio, resp);
+        if (rc >= 0)
             break;
 
-        /* Extract one key-value pair from one header line */
-        get_key_value(buf, key, value);
-        if (*key != '\0' && *value!='\0') {
-            /* Use the request host header if existing */
-            if (!strcmp(key, "Host")) {
-                get_host_port(value, host, &port);
-                host_exist = 1;
-            }
-            /* Check if the browser sends any additional request headers 
-             * as part of an HTTP request.
-             */
-            if (strcmp(key, "User-Agent") && 
-                    strcmp(key, "Accept") && 
-                    strcmp(key, "Accept-Encoding") &&
-                    strcmp(key, "Connection") &&
-                    strcmp(key, "Proxy-Connection")) {
-
-                char hdrline[MAXLINE];
-                sprintf(hdrline, "%s: %s\r\n", key, value);
-                strcat(request, hdrline);
-            }
+        /* 
+         * The server may have closed a pooled connection 
+         * before seeing the request, try a new one
+         */
+        if (uc->reused && resp->forwarded == 0) {
+            upstream_discard(uc);
+            continue;
         }
+        upstream_close(uc);
+        return rc;
     }
-    
-    /*  
-     * Combine the host and port from the 
-     * first request line as the Host header,
-     * if request doesn't have a Host header.
-     */
-    if (!host_exist) {
-        char host_hdr[MAXLINE];
-        if (port != DEFAULT_PORT)
-            sprintf(host_hdr, "Host: %s:%d\r\n", host, port);
-        else 
-            sprintf(host_hdr, "Host: %s\r\n", host);
 
-        strcat(request, host_hdr);
+    /* Keep the server connection if it can take another request */
+    if (rc == 1)
+        upstream_put(uc);
+    else
+        upstream_close(uc);
+    return rc;
+}
+
+/*
+ * Lay out in cond, which holds COND_IOV pieces, the request in
+ * iov with the validators of the pinned cached response added,
+ * pointing into both. Return the number of pieces, or 0 if it
+ * has no validators to revalidate it with.
+ */
+int conditional_request(struct iovec *cond, struct iovec *iov, int niov, 
+        node *cached)
+{
+    cache_meta *m = &cached->meta;
+    int n;
+
+    if (m->etag_len == 0 && m->lm_len == 0)
+        return 0;
+
+    /* The request ends with its blank line, in its last piece */
+    for (n = 0; n < niov - 1; n++)
+        cond[n] = iov[n];
+    n = iov_put(cond, n, iov[n].iov_base, iov[n].iov_len - 2);
+    if (m->etag_len > 0) {
+        n = iov_put(cond, n, "If-None-Match: ", 15);
+        n = iov_put(cond, n, cached->content + m->etag_off, m->etag_len);
+        n = iov_put(cond, n, "\r\n", 2);
     }
+    if (m->lm_len > 0) {
+        n = iov_put(cond, n, "If-Modified-Since: ", 19);
+        n = iov_put(cond, n, cached->content + m->lm_off, m->lm_len);
+        n = iov_put(cond, n, "\r\n", 2);
+    }
+    return iov_put(cond, n, "\r\n", 2);
+}
+
+/*
+ * Revalidate the pinned stale cached response in a thread of
+ * its own, so the client it was served to does not wait for
+ * the server. If the thread cannot start, a later stale hit
+ * may try again.
+ */
+void revalidate_later(node *cached, char *key, struct iovec *iov, 
+        int niov, char *host, int port, uint64_t hash)
+{
+    revalidation *rv = (revalidation *)Malloc(sizeof(revalidation));
+    pthread_t tid;
+
+    /* The pieces point into the client buffer, which moves on */
+    if (request_flatten(iov, niov, rv->request, MAXLINE) == 0) {
+        __atomic_store_n(&cached->revalidating, 0, __ATOMIC_RELAXED);
+        Free(rv);
+        return;
+    }
+    strcpy(rv->key, key);
+    strcpy(rv->host, host);
+    rv->port = port;
+    rv->hash = hash;
+    Pthread_create(&tid, NULL, revalidate_thread, rv);
+}
 
-    *i_port = port;
+/*
+ * Fetch a stale response again, conditionally if it has
+ * validators, leading the flight of its request so clients
+ * missing it meanwhile stream the new copy. Nothing goes to
+ * a client: a 304 refreshes the cached copy, anything else
+ * replaces it. However it ends, the cached copy is no longer
+ * revalidating, so a later stale hit may try again.
+ */
+void *revalidate_thread(void *vargp)
+{
+    revalidation *rv = (revalidation *)vargp;
+    struct iovec req, cond[COND_IOV];
+    int ncond;
+    response resp;
+    node *cached;
+    flight *fl;
+    flight_cursor cur;
+    int leader, rc = -1;
 
-    /* End the request with "\r\n" */
-    strcat(request, "\r\n");
+    Pthread_detach(pthread_self());
+    fl = flight_join(rv->key, rv->hash, &leader, &cur);
+    cached = search_cache(web_cache, rv->key, rv->hash);
+
+    /* Unless it is already being fetched */
+    if (leader && cached != NULL) {
+        resp.clientfd = -1;
+        resp.keepalive = 0;
+        growbuf_init(&resp.copy);
+        resp.fl = fl;
+        iov_put(&req, 0, rv->request, strlen(rv->request));
+        ncond = conditional_request(cond, &req, 1, cached);
+        resp.revalidating = ncond > 0;
+        if (resp.revalidating)
+            __sync_fetch_and_add(&revalidations, 1);
+        else
+            ncond = iov_put(cond, 0, rv->request, strlen(rv->request));
+        rc = fetch(cond, ncond, rv->host, rv->port, &resp);
+        if (rc >= 0 && resp.not_modified) {
+            __sync_fetch_and_add(&not_modified, 1);
+            refresh_cached(cached, rv->hash, &resp.fi);
+            rc = -1;    /* nothing for the flight */
+        } else if (rc >= 0 && resp.fit_size)
+            cache_response(rv->key, rv->hash, &resp);
+        growbuf_free(&resp.copy);
+    }
+    if (cached != NULL) {
+        __atomic_store_n(&cached->revalidating, 0, __ATOMIC_RELAXED);
+        release_cache(cached);
+    }
 
-    return 1;
+    if (leader)
+        flight_finish(fl, rc >= 0);
+    else
+        flight_leave(fl, &cur);
+    Free(rv);
+    return NULL;
 }
 
-/* 
- * Process the request line 
+/*
+ * The server answered a revalidation with a 304: the cached
+ * response is fresh again, for as long as its headers, updated
+ * with those of the 304, allow
  */
-int parse_request(char *request, char *reqline, char *host, 
-            char *uri, int *port) 
+void refresh_cached(node *cached, uint64_t hash, fresh_info *upd)
 {
-    char method[MAXLINE], version[MAXLINE];
-    char new_uri[MAXLINE], new_req[MAXLINE];
-    
-    /* line:netp:doit:parserequest */
-    sscanf(reqline, "%s %s %s", method, uri, version);
-    /* line:netp:doit:beginrequesterr */
-    if(strcasecmp(method, "GET"))
-        return 0;
+    fresh_info fi;
+    cache_meta meta;
+
+    fresh_parse(&fi, cached->content, cached->_size);
+    fresh_update(&fi, upd);
+    fresh_meta(&fi, time(NULL), &meta);
+    refresh_cache(web_cache, cached->id, hash, &meta);
+}
 
-    /* Parse the uri */
-    parse_uri(uri, host, port, new_uri);
+/*
+ * Cache a response just relayed, with the freshness its
+ * headers give it
+ */
+void cache_response(char *key, uint64_t hash, response *resp)
+{
+    cache_meta meta;
 
-    /* Generate a new request */
-    sprintf(new_req, "%s %s %s", method, new_uri, "HTTP/1.0\r\n");
-    strcat(request, new_req);
-    return 1;
+    fresh_meta(&resp->fi, time(NULL), &meta);
+    update_cache(web_cache, key, hash, resp->copy.data, resp->copy.len, 
+            &meta);
 }
 
 /*
- * Process the URI string
+ * Write a cached response, adding the Connection header 
+ * for the client at the end of the headers
  */
-int parse_uri(char *uri, char *host, int *port, char *new_uri) 
+int write_cached(int fd, node *cached, int keepalive)
 {
-    char *ptr, *tmp_ptr, *port_ptr;
-    /* allocate momory to port string */
-    char  port_str[MAXLINE];
-    *host = 0;
-    *port = DEFAULT_PORT;
+    struct iovec iov[3];
+    char *end = header_end(cached->content, cached->_size);
+    char *conn = keepalive ? "Connection: keep-alive\r\n" : 
+        "Connection: close\r\n";
+    size_t head;
+    int n;
 
-    /* If the request starts without "http://", 
-     * just return with the uri 
+    /* 
+     * Everything before the blank line, our header, then the
+     * rest, in one send
      */
-    if ((ptr = strstr(uri, "http://")) == NULL) {
-        strcpy(new_uri, uri);
-        return 0;
-    } else {
-        /* Point to the start of the Host name */
-        ptr += 7;
-
-        /* Get the Host name */
-        tmp_ptr = substring(host, ptr, "/");
-        /* tmp_ptr points to the string after hostname */
-        strcpy(new_uri, tmp_ptr);
-            
-        /* Extract the Port number after hostname */
-        if ((port_ptr = strstr(host, ":"))!= NULL) {
-                *port_ptr = 0;
-                strcpy(port_str, port_ptr + 1);
-                *port = atoi(port_str);
+    if (end == NULL)
+        n = iov_put(iov, 0, cached->content, cached->_size);
+    else {
+        head = end - cached->content - 2;
+        n = iov_put(iov, 0, cached->content, head);
+        n = iov_put(iov, n, conn, strlen(conn));
+        n = iov_put(iov, n, cached->content + head, cached->_size - head);
+    }
+    return sendv_all(fd, iov, n, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Relay one HTTP/1.1 response from a server to the client,
+ * finding where it ends from its Content-length or chunked
+ * framing. Return 1 if the connection can take another
+ * request, 0 if it must be closed, -1 if nothing could be 
+ * read from the server and -2 if the relay broke midway.
+ * Hop-by-hop headers of the server are dropped, and the 
+ * client connection is kept only if the response is framed,
+ * which resp->keepalive reports and the Connection header 
+ * sent to the client announces. What the headers say about 
+ * caching goes to resp->fi, and the copy is only kept if the
+ * response may be cached. When revalidating, a 304 is not 
+ * relayed but reported in resp->not_modified.
+ */
+int relay_response(rio_t *rp, response *resp)
+{
+    char buf[MAXLINE];
+    struct iovec iov;
+    char *conn;
+    ssize_t n;
+    long length = -1;
+    int status = 0, chunked = 0, keepalive, nobody;
+
+    /* Status line */
+    if ((n = rio_readlineb(rp, buf, MAXLINE)) <= 0)
+        return -1;
+    keepalive = !strncmp(buf, "HTTP/1.1", 8);
+    fresh_status(&resp->fi, buf);
+    status = resp->fi.status;
+
+    /* The cached copy is still valid, its headers refresh it */
+    if (resp->revalidating && status == 304) {
+        resp->not_modified = 1;
+        while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0 && 
+                strcmp(buf, "\r\n") && strcmp(buf, "\n")) {
+            fresh_header(&resp->fi, buf, 0);
+            if (!strncasecmp(buf, "Connection:", 11) && 
+                    (strstr(buf, "close") || strstr(buf, "Close")))
+                keepalive = 0;
         }
-        
-        return 1;
+        return n > 0 ? keepalive : -2;
+    }
+
+    /* Header lines are held back to go out together */
+    resp->more = 1;
+    if (forward(resp, buf, n) < 0)
+        return -2;
+
+    /* Headers, up to the blank line */
+    while (1) {
+        if ((n = rio_readlineb(rp, buf, MAXLINE)) <= 0)
+            return -2;
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+            break;
+        if (!is_hop_header(buf)) {
+            fresh_header(&resp->fi, buf, resp->copy.len);
+            if (forward(resp, buf, n) < 0)
+                return -2;
+        }
+
+        if (!strncasecmp(buf, "Content-Length:", 15))
+            length = atol(buf + 15);
+        else if (!strncasecmp(buf, "Transfer-Encoding:", 18))
+            chunked = strstr(buf, "chunked") != NULL;
+        else if (!strncasecmp(buf, "Connection:", 11)) {
+            if (strstr(buf, "close") || strstr(buf, "Close"))
+                keepalive = 0;
+            else if (strstr(buf, "keep-alive") || strstr(buf, "Keep-Alive"))
+                keepalive = 1;
+        }
+    }
+
+    /* Keep no copy of what may not be cached */
+    if (!fresh_cacheable(&resp->fi))
+        resp->fit_size = 0;
+
+    /* Tell the client whether its connection stays open */
+    nobody = (status >= 100 && status < 200) || status == 204 || 
+        status == 304;
+    resp->keepalive = resp->keepalive && (nobody || chunked || length >= 0);
+    conn = resp->keepalive ? "Connection: keep-alive\r\n" : 
+        "Connection: close\r\n";
+    iov_put(&iov, 0, conn, strlen(conn));
+    if (resp->clientfd >= 0 && sendv_all(resp->clientfd, &iov, 1, 
+                MSG_MORE) < 0)
+        return -2;
+
+    /* The blank line goes with the body, if one follows */
+    resp->more = !nobody && length != 0;
+    if (forward(resp, buf, n) < 0)
+        return -2;
+    resp->more = 0;
+
+    /* Responses that never have a body */
+    if (nobody)
+        return keepalive;
+
+    if (chunked) {
+        /* Chunks until the last one of size 0, then trailers */
+        while (1) {
+            if ((n = rio_readlineb(rp, buf, MAXLINE)) <= 0 ||
+                    forward(resp, buf, n) < 0)
+                return -2;
+            length = strtol(buf, NULL, 16);
+            if (length <= 0)
+                break;
+            if (relay_body(rp, resp, length + 2) < 0)
+                return -2;
+        }
+        do {
+            if ((n = rio_readlineb(rp, buf, MAXLINE)) <= 0 ||
+                    forward(resp, buf, n) < 0)
+                return -2;
+        } while (strcmp(buf, "\r\n") && strcmp(buf, "\n"));
+        return keepalive;
     }
+
+    if (length >= 0) {
+        /* 
+         * Known in advance not to fit, so do not keep a copy,
+         * else size the copy once
+         */
+        if (resp->copy.len + length >= max_object_size) {
+            if (resp->fit_size)
+                __sync_fetch_and_add(&too_large, 1);
+            resp->fit_size = 0;
+        } else if (resp->fit_size)
+            growbuf_reserve(&resp->copy, resp->copy.len + length);
+        return relay_body(rp, resp, length) < 0 ? -2 : keepalive;
+    }
+
+    /* No framing, the body ends when the server closes */
+    return relay_body(rp, resp, -1) < 0 ? -2 : 0;
 }
+
 /*
- * Extract the string before a delimiter and copy to destiantion
+ * Relay n bytes of body, or everything up to EOF if n < 0.
+ * Bytes go through user space only while a copy is kept for
+ * the cache or for clients streaming the response, which stop
+ * joining once an uncacheable body starts, or when there is no
+ * client to splice to. Once no copy is
+ * needed, what is left in the rio buffer is written
+ * out and the rest is spliced from the server to the client
+ * inside the kernel.
  */
-char* substring(char *dest, char *src, char *delim)
+int relay_body(rio_t *rp, response *resp, long n)
 {
-    char *ptr;
-    if ((ptr = strstr(src, delim)) == NULL) 
-        return NULL;
+    char buf[MAXBUF];
+    ssize_t rc;
+    size_t want;
+    long moved;
+    int copy;
 
-    *ptr = '\0';
-    strcpy(dest, src);
-    *ptr = *delim;
-    return ptr;
+    while (n != 0) {
+        copy = resp->fit_size || resp->clientfd < 0 ||
+            (flight_teeing(resp->fl) && flight_detach(resp->fl));
+        if (!copy && rp->rio_cnt == 0) {
+            if ((moved = relay_splice(rp->rio_fd, resp->clientfd, n)) < 0)
+                return -1;
+            resp->forwarded += moved;
+            __sync_fetch_and_add(&spliced_bytes, moved);
+            return 0;
+        }
+
+        /* Without a copy to keep, never refill the rio buffer */
+        want = (n < 0 || n > MAXBUF) ? MAXBUF : (size_t)n;
+        if (!copy && want > (size_t)rp->rio_cnt)
+            want = rp->rio_cnt;
+        if ((rc = rio_readnb(rp, buf, want)) < 0)
+            return -1;
+        if (rc == 0)
+            return n < 0 ? 0 : -1;
+        if (forward(resp, buf, rc) < 0)
+            return -1;
+        if (n > 0)
+            n -= rc;
+    }
+    return 0;
 }
+
 /*
- * Get key value pair from request header line
+ * Write part of a response to the client, and keep a copy
+ * for the cache while it fits the max object size
  */
-void get_key_value(char *header_line, char *key, char *value) 
+int forward(response *resp, char *buf, size_t n)
 {
-    char *key_ptr;
+    struct iovec iov;
 
-    /* Split the given header line by ':' */
-    /* Get the key part from the substring of header */
-    if((key_ptr = substring(key, header_line, ":")) == NULL)
-        return;
+    if (resp->fit_size && resp->copy.len + n < max_object_size) {
+        growbuf_append(&resp->copy, buf, n);
+    } else if (resp->fit_size) {
+        __sync_fetch_and_add(&too_large, 1);
+        resp->fit_size = 0;
+    }
 
-    /* Find the "\r\n" and get the value from the substring of header */
-    key_ptr = substring(value, key_ptr + 2, "\r");
-   
+    /* Clients streaming the same response get it too */
+    if (resp->fl != NULL)
+        flight_append(resp->fl, buf, n);
+
+    /* Background revalidations have no client */
+    if (resp->clientfd >= 0 && resp->forwarded == 0)
+        metrics_since(METRIC_FIRST_BYTE, resp->received);
+    iov_put(&iov, 0, buf, n);
+    if (resp->clientfd >= 0 && sendv_all(resp->clientfd, &iov, 1, 
+                resp->more ? MSG_MORE : 0) < 0)
+        return -1;
+    resp->forwarded += n;
+    return 0;
 }
 
-/* 
- * Get Host and Port from the "Host:" request header line
+/*
+ * Connection management headers apply to one hop only, 
+ * the proxy sends its own
+ */
+int is_hop_header(char *line)
+{
+    return !strncasecmp(line, "Connection:", 11) ||
+        !strncasecmp(line, "Keep-Alive:", 11) ||
+        !strncasecmp(line, "Proxy-Connection:", 17);
+}
+
+/*
+ * Drop the hop-by-hop headers from the n bytes of response in
+ * resp, moving the rest up, so a copy kept for the cache only
+ * carries the headers of the server. Return the new length.
  */
-void get_host_port(char *value, char *host, int *port) {
-    char *ptr;
-    *port = DEFAULT_PORT;
+size_t strip_hop_headers(char *resp, size_t n)
+{
+    char *line = resp, *end = header_end(resp, n), *eol;
+    size_t len;
 
-    /* Split the header line by ":" */
-    if(( ptr = substring(host, value, ":")) != NULL){
-        *port = atoi(ptr + 1);
+    if (end == NULL)
+        return n;
+    while (line < end && (eol = scan_char(line, end - line, '\n')) != NULL) {
+        if (is_hop_header(line)) {
+            len = eol + 1 - line;
+            memmove(line, eol + 1, resp + n - (eol + 1));
+            n -= len;
+            end -= len;
+        } else
+            line = eol + 1;
     }
-    return;
+    return n;
 }
 
+/*
+ * Return the byte after the blank line ending the 
+ * headers at the start of buf, NULL if there is none
+ */
+char *header_end(char *buf, size_t n)
+{
+    char *p = buf, *end = buf + n, *nl;
 
-/* 
- * Customized r/w func and error handler wrapper 
+    /* Only line ends can end the headers, jump from one to the next */
+    while ((nl = scan_char(p, end - p, '\n')) != NULL) {
+        if (nl - buf >= 3 && nl[-1] == '\r' && nl[-2] == '\n' && 
+                nl[-3] == '\r')
+            return nl + 1;
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Status code of the response starting buf, 0 if it has none
  */
-int myRio_writen(int fd, void *usrbuf, size_t n) {
-    if (rio_writen(fd, usrbuf, n) != n) {
-        unix_error("Rio_writen error");
+int response_status(char *buf, size_t n)
+{
+    int status = 0, i;
+
+    if (n < 12 || strncmp(buf, "HTTP/", 5))
         return 0;
+    for (i = 9; i < 12; i++) {
+        if (buf[i] < '0' || buf[i] > '9')
+            return 0;
+        status = status * 10 + buf[i] - '0';
+    }
+    return status;
+}
+
+/*
+ * Whether the end of a response can be found without the 
+ * server closing: it has a Content-length, is chunked, or 
+ * has a status that never carries a body
+ */
+int response_delimited(char *resp, size_t n)
+{
+    char *line = resp, *end = header_end(resp, n), *eol, *p;
+    int status = 0;
+
+    if (end == NULL)
+        return 0;
+    sscanf(resp, "%*s %d", &status);
+    if ((status >= 100 && status < 200) || status == 204 || status == 304)
+        return 1;
+
+    while (line < end && (eol = scan_char(line, end - line, '\n')) != NULL) {
+        if (!strncasecmp(line, "Content-Length:", 15))
+            return 1;
+        if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+            for (p = line; p + 7 <= eol; p++)
+                if (!strncasecmp(p, "chunked", 7))
+                    return 1;
+        }
+        line = eol + 1;
     }
-    return 1;
+    return 0;
 }
 
+/*
+ * Report cache and connection queue statistics, as plain text
+ * or JSON. Return -1 if the client went away, which only ends
+ * its connection.
+ */
+int serve_stats(int fd, int json, served *sv)
+{
+    char buf[MAXBUF];
+    int n = build_stats(buf, sizeof(buf), json);
+
+    sv->status = response_status(buf, n);
+    sv->bytes = n;
+    return rio_writen(fd, buf, n) < 0 ? -1 : 0;
+}
+
+/*
+ * Dump the cache into the snapshot file and report it. Return
+ * -1 if the client went away, as serve_stats() does.
+ */
+int serve_snapshot(int fd, served *sv)
+{
+    char buf[MAXLINE];
+    int n = build_snapshot(buf, sizeof(buf));
+
+    sv->status = response_status(buf, n);
+    sv->bytes = n;
+    return rio_writen(fd, buf, n) < 0 ? -1 : 0;
+}
+
+/*
+ * Take a snapshot of the cache and build the response telling
+ * how it went in buf, return its length
+ */
+int build_snapshot(char *buf, size_t maxlen)
+{
+    char body[MAXLINE];
+    unsigned long bytes = 0;
+    long n;
+    char *status = "200 OK";
+
+    if (snapshot_path == NULL) {
+        status = "404 Not Found";
+        snprintf(body, sizeof(body), "no snapshot file, see -S\n");
+    } else if ((n = cache_snapshot(web_cache, snapshot_path, &bytes)) < 0) {
+        status = "500 Internal Server Error";
+        snprintf(body, sizeof(body), "snapshot to %s failed: %s\n", 
+                snapshot_path, strerror(errno));
+    } else
+        snprintf(body, sizeof(body), "snapshot_objects %ld\n"
+                "snapshot_bytes %lu\n", n, bytes);
+    return local_page(buf, maxlen, status, body);
+}
+
+/*
+ * Ask the snapshot thread for a snapshot and build the response
+ * telling so in buf, return its length. The event loops answer
+ * with this, since they must not wait for the file to be written.
+ */
+int request_snapshot(char *buf, size_t maxlen)
+{
+    char body[MAXLINE];
+    char *status = "202 Accepted";
+
+    if (snapshot_path == NULL) {
+        status = "404 Not Found";
+        snprintf(body, sizeof(body), "no snapshot file, see -S\n");
+    } else if (kill(getpid(), SIGUSR1) < 0) {
+        status = "500 Internal Server Error";
+        snprintf(body, sizeof(body), "snapshot to %s failed: %s\n", 
+                snapshot_path, strerror(errno));
+    } else
+        snprintf(body, sizeof(body), "snapshot to %s started\n", 
+                snapshot_path);
+    return local_page(buf, maxlen, status, body);
+}
+
+/*
+ * Build a plain text response of the proxy in buf, return its
+ * length
+ */
+int local_page(char *buf, size_t maxlen, char *status, char *body)
+{
+    int n = snprintf(buf, maxlen, "HTTP/1.0 %s\r\n"
+            "Content-type: text/plain\r\n"
+            "Content-length: %d\r\n\r\n%s", status, (int)strlen(body), body);
+
+    return n < (int)maxlen ? n : (int)maxlen - 1;
+}
+
+/*
+ * Take a snapshot each time the proxy gets SIGUSR1
+ */
+void *snapshot_thread(void *vargp)
+{
+    unsigned long bytes;
+    long n;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    while (sigwait(&snapshot_signals, &sig) == 0) {
+        if ((n = cache_snapshot(web_cache, snapshot_path, &bytes)) < 0)
+            fprintf(stderr, "Snapshot to %s failed: %s\n", snapshot_path,
+                    strerror(errno));
+        else
+            printf("Snapshot of %ld objects, %lu bytes, in %s\n", n, 
+                    bytes, snapshot_path);
+    }
+    return NULL;
+}
+
+/*
+ * Build the whole response of the statistics page in buf, as
+ * "name value" lines or as one JSON object with the same names,
+ * return its length
+ */
+int build_stats(char *buf, size_t maxlen, int json)
+{
+    static const char *latency_fields[] = { "count", "mean_ns", "p50_ns", 
+        "p90_ns", "p99_ns", "p999_ns", "max_ns" };
+    char body[MAXBUF], name[64];
+    stats_out o = { body, 0, sizeof(body), json, 0 };
+    int n, i, j;
+    cache_stats cs;
+    sbuf_stats qs;
+    upstream_stats us;
+    dns_stats ds;
+    flight_stats fs;
+    disk_stats dk;
+    bufpool_stats bs;
+    metrics_stats ms;
+    accesslog_stats ls;
+    uring_stats rs;
+
+    get_cache_stats(web_cache, &cs);
+    get_bufpool_stats(&bs);
+    get_disk_stats(&dk);
+    sbuf_get_stats(&sbuf, &qs);
+    get_upstream_stats(&us);
+    get_dns_stats(&ds);
+    get_flight_stats(&fs);
+    get_metrics_stats(&ms);
+    get_accesslog_stats(&ls);
+    get_uring_stats(&rs);
+
+    stats_printf(&o, json ? "{" : "");
+    stat_str(&o, "cache_policy", cache_policy_name(web_cache->policy));
+    stat_num(&o, "cache_hits", cs.hits);
+    stat_num(&o, "cache_misses", cs.misses);
+    stat_num(&o, "cache_probes", cs.probes);
+    stat_num(&o, "cache_evictions", cs.evictions);
+    stat_num(&o, "cache_rejections", cs.rejections);
+    stat_num(&o, "cache_objects", cs.objects);
+    stat_num(&o, "cache_bytes", cs._size);
+    stat_num(&o, "cache_arena_bytes", cs.arena_bytes);
+    stat_num(&o, "cache_compactions", cs.compactions);
+    stat_num(&o, "cache_stale_hits", stale_hits);
+    stat_num(&o, "cache_revalidations", revalidations);
+    stat_num(&o, "cache_not_modified", not_modified);
+    stat_num(&o, "cache_too_large", too_large);
+    stat_num(&o, "disk_hits", dk.hits);
+    stat_num(&o, "disk_misses", dk.misses);
+    stat_num(&o, "disk_spills", dk.spills);
+    stat_num(&o, "disk_dropped", dk.dropped);
+    stat_num(&o, "disk_queued_bytes", dk.queued);
+    stat_num(&o, "disk_overwritten", dk.overwritten);
+    stat_num(&o, "disk_recovered", dk.recovered);
+    stat_num(&o, "disk_objects", dk.objects);
+    stat_num(&o, "disk_bytes", dk.bytes);
+    stat_num(&o, "queue_depth", qs.depth);
+    stat_num(&o, "queue_max_depth", qs.max_depth);
+    stat_num(&o, "queue_capacity", qs.n);
+    stat_num(&o, "queue_accepted", qs.inserted);
+    stat_num(&o, "queue_full", qs.full);
+    stat_num(&o, "upstream_opened", us.opened);
+    stat_num(&o, "upstream_reused", us.reused);
+    stat_num(&o, "upstream_stale", us.stale);
+    stat_num(&o, "upstream_idle", us.idle);
+    stat_num(&o, "dns_lookups", ds.lookups);
+    stat_num(&o, "dns_hits", ds.hits);
+    stat_num(&o, "dns_negative_hits", ds.negative_hits);
+    stat_num(&o, "dns_resolved", ds.resolved);
+    stat_num(&o, "dns_failed", ds.failed);
+    stat_num(&o, "dns_resolve_avg_us", 
+            ds.resolved ? ds.resolve_ns / ds.resolved / 1000 : 0);
+    stat_num(&o, "dns_resolve_max_us", ds.max_resolve_ns / 1000);
+    stat_num(&o, "dns_entries", ds.entries);
+    stat_num(&o, "relay_spliced_bytes", spliced_bytes);
+    stat_num(&o, "bufpool_reused", bs.reused);
+    stat_num(&o, "bufpool_allocated", bs.allocated);
+    stat_num(&o, "bufpool_grown", bs.grown);
+    stat_num(&o, "bufpool_pooled_bytes", bs.pooled_bytes);
+    stat_num(&o, "flight_leaders", fs.leaders);
+    stat_num(&o, "flight_joined", fs.joined);
+    stat_num(&o, "flight_inflight", fs.inflight);
+    stat_num(&o, "flight_tee_bytes", fs.tee_bytes);
+    stat_num(&o, "flight_cut", fs.cut);
+    stat_num(&o, "uring_enters", rs.enters);
+    stat_num(&o, "uring_sqes", rs.sqes);
+    stat_num(&o, "uring_cqes", rs.cqes);
+    stat_num(&o, "uring_fixed", rs.fixed);
+    stat_num(&o, "accesslog_records", ls.records);
+    stat_num(&o, "accesslog_dropped", ls.dropped);
+    stat_num(&o, "accesslog_batches", ls.batches);
+
+    /* Requests by outcome, and the latency of each step */
+    for (i = 0; i < METRIC_NCOUNTERS; i++)
+        stat_num(&o, metric_counter_name(i), ms.counters[i]);
+    for (i = 0; i < METRIC_NPHASES; i++) {
+        metric_summary *m = &ms.phases[i];
+        uint64_t v[] = { m->count, m->mean, m->p50, m->p90, m->p99, 
+            m->p999, m->max };
+        for (j = 0; j < 7; j++) {
+            snprintf(name, sizeof(name), "latency_%s_%s", 
+                    metric_phase_name(i), latency_fields[j]);
+            stat_num(&o, name, v[j]);
+        }
+    }
+    stats_printf(&o, json ? "\n}\n" : "");
+
+    n = snprintf(buf, maxlen, "HTTP/1.0 200 OK\r\n"
+            "Content-type: %s\r\n"
+            "Content-length: %d\r\n\r\n%s", 
+            json ? "application/json" : "text/plain", (int)o.len, body);
+    return n < (int)maxlen ? n : (int)maxlen - 1;
+}
+
+/*
+ * Append to the statistics, dropping what does not fit
+ */
+void stats_printf(stats_out *o, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(o->buf + o->len, o->maxlen - o->len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        o->len += (size_t)n < o->maxlen - o->len ? (size_t)n : 
+            o->maxlen - o->len - 1;
+}
+
+/*
+ * One named value of the statistics
+ */
+void stat_num(stats_out *o, const char *name, unsigned long long v)
+{
+    if (o->json)
+        stats_printf(o, "%s\n  \"%s\": %llu", o->n++ ? "," : "", name, v);
+    else
+        stats_printf(o, "%s %llu\n", name, v);
+}
+
+void stat_str(stats_out *o, const char *name, const char *v)
+{
+    if (o->json)
+        stats_printf(o, "%s\n  \"%s\": \"%s\"", o->n++ ? "," : "", name, v);
+    else
+        stats_printf(o, "%s %s\n", name, v);
+}
 
 /* 
- * Build a simple website for cannot connect to server errors 
+ * Build a simple website for requests the proxy could not
+ * serve, and send it in one writev
  */
 void client_error(int fd, char *cause, char *errnum, 
             char *shortmsg, char *longmsg) {
     char buf[MAXLINE], body[MAXLINE];
+    struct iovec iov[2];
+    int nbody, nbuf;
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Request Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The proxy</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
-}
\ No newline at end of file
+    nbody = snprintf(body, sizeof(body), 
+            "<html><title>Request Error</title>"
+            "<body bgcolor=""ffffff"">\r\n"
+            "%s: %s\r\n"
+            "<p>%s: %s\r\n"
+            "<hr><em>The proxy</em>\r\n", 
+            errnum, shortmsg, longmsg, cause);
+    if (nbody >= (int)sizeof(body))
+        nbody = sizeof(body) - 1;
+
+    /* Print the HTTP response, headers and body in one send */
+    nbuf = snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\n"
+            "Connection: close\r\n"
+            "Content-type: text/html\r\n"
+            "Content-length: %d\r\n\r\n", errnum, shortmsg, nbody);
+    if (nbuf >= (int)sizeof(buf))
+        nbuf = sizeof(buf) - 1;
+    iov_put(iov, 0, buf, nbuf);
+    iov_put(iov, 1, body, nbody);
+    sendv_all(fd, iov, 2, 0);
+}
@@ -0,0 +1,32 @@
+/*
+ * proxy.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Definitions shared by the threaded and the event-driven
+ * request handling of the proxy
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "cache.h"
+
+/* Recommended max cache and object sizes, -c and -o change them */
+#define MAX_OBJECT_SIZE 102400
+#define DEFAULT_PORT    80
+
+/* Seconds a persistent client connection may wait for a request */
+#define CLIENT_IDLE_TIMEOUT 5
+
+extern cache *web_cache;
+extern unsigned int max_object_size;
+
+int build_stats(char *buf, size_t maxlen, int json);
+int build_snapshot(char *buf, size_t maxlen);
+int request_snapshot(char *buf, size_t maxlen);
+int response_delimited(char *resp, size_t n);
+int response_status(char *buf, size_t n);
+char *header_end(char *buf, size_t n);
+size_t strip_hop_headers(char *resp, size_t n);
+
+#endif
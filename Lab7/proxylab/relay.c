@@ -0,0 +1,84 @@
+/*
+ * relay.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Moves bytes from one socket to another inside the kernel.
+ * splice() needs a pipe on one side, so every thread keeps a
+ * pipe of its own: data is spliced from the source socket into
+ * the pipe and from the pipe into the destination socket,
+ * without ever being copied to user space. If a splice fails
+ * with bytes still in the pipe, the pipe is thrown away so the
+ * next relay starts empty.
+ *
+ * This file defines _GNU_SOURCE for splice(), which clashes
+ * with the gai_error() of csapp.h, so it does not include it.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "relay.h"
+
+static __thread int relay_pipe[2] = { -1, -1 };
+
+static void drop_pipe(void);
+
+
+/*
+ * Relay n bytes from descriptor from to descriptor to, or
+ * everything up to EOF if n < 0. Return the number of bytes
+ * relayed, or -1 on error or if EOF came before n bytes.
+ */
+long relay_splice(int from, int to, long n)
+{
+	long total = 0;
+	ssize_t in, out;
+	size_t want;
+
+	if (relay_pipe[0] < 0 && pipe(relay_pipe) < 0)
+		return -1;
+
+	while (n != 0)
+	{
+		want = (n < 0 || n > RELAY_CHUNK) ? RELAY_CHUNK : (size_t)n;
+		in = splice(from, NULL, relay_pipe[1], NULL, want,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in < 0 && errno == EINTR)
+			continue;
+		if (in <= 0)
+			return (in == 0 && n < 0) ? total : -1;
+
+		/* Drain the pipe into the destination */
+		while (in > 0)
+		{
+			out = splice(relay_pipe[0], NULL, to, NULL, in,
+						 SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out <= 0)
+			{
+				drop_pipe();
+				return -1;
+			}
+			in -= out;
+			total += out;
+			if (n > 0)
+				n -= out;
+		}
+	}
+	return total;
+}
+
+/*
+ * Close a pipe that may still hold bytes
+ */
+static void drop_pipe(void)
+{
+	close(relay_pipe[0]);
+	close(relay_pipe[1]);
+	relay_pipe[0] = relay_pipe[1] = -1;
+}
@@ -0,0 +1,18 @@
+/*
+ * relay.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Zero-copy relay of bytes between descriptors
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <sys/types.h>
+
+/* Largest piece moved through the pipe at once */
+#define RELAY_CHUNK 65536
+
+long relay_splice(int from, int to, long n);
+
+#endif
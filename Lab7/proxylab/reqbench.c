@@ -0,0 +1,407 @@
+/*
+ * reqbench.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Measures how many client requests, and request headers, the
+ * proxy parses and rewrites per second, with the request parser
+ * of request.c and with the parser it replaced, kept below as it
+ * was. Each round goes over a set of requests like the ones
+ * browsers send, from a short one to one with large cookies:
+ *
+ * old     copy the header block, then generate_request() and
+ *         client_keepalive() as the proxy used to
+ * parse   request_parse() only
+ * iov     request_parse() and request_iov(), what a request
+ *         costs when it is written with writev()
+ * flat    the same, then request_flatten() for the cache key
+ *
+ * usage: reqbench [-n rounds]
+ */
+
+#include "csapp.h"
+#include "proxy.h"
+#include "request.h"
+
+#define DEFAULT_ROUNDS 200000
+
+/* One way of handling a request, timed over all of them */
+typedef int (*handler)(char *buf, size_t n);
+
+static char *samples[] = {
+	"GET http://localhost:15213/home.html HTTP/1.0\r\n"
+	"Host: localhost:15213\r\n"
+	"\r\n",
+
+	"GET http://www.cmu.edu/hub/index.html HTTP/1.1\r\n"
+	"Host: www.cmu.edu\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+	"Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+	"image/avif,image/webp,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Referer: http://www.cmu.edu/\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"\r\n",
+
+	"GET http://csapp.cs.cmu.edu/3e/ics3/code/src/csapp.c HTTP/1.1\r\n"
+	"Host: csapp.cs.cmu.edu\r\n"
+	"User-Agent: curl/8.5.0\r\n"
+	"Accept: */*\r\n"
+	"Proxy-Connection: Keep-Alive\r\n"
+	"\r\n",
+
+	"GET http://images.example.com/a/b/c/photo.jpg?w=640&h=480 HTTP/1.1\r\n"
+	"Host: images.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) "
+	"AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.0 Safari/605.1.15\r\n"
+	"Accept: image/webp,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Referer: http://www.example.com/gallery/2023/summer\r\n"
+	"Cookie: session=6f1c2a7be0d94c4aa1d0e5b1c3f2a9d8; theme=dark; "
+	"tz=America%2FNew_York; consent=1; _ga=GA1.2.1234567890.1690000000; "
+	"_gid=GA1.2.987654321.1690000000; cart=eyJpdGVtcyI6WzEsMiwzXX0\r\n"
+	"If-None-Match: \"5d8c72a5edda8\"\r\n"
+	"If-Modified-Since: Sat, 29 Oct 1994 19:43:31 GMT\r\n"
+	"DNT: 1\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n",
+};
+
+#define NSAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+void usage(char *prog);
+void bench(const char *name, handler h, long rounds, long headers);
+int old_request(char *buf, size_t n);
+int new_parse(char *buf, size_t n);
+int new_iov(char *buf, size_t n);
+int new_flat(char *buf, size_t n);
+int legacy_generate_request(char *hdrs, char *i_request, char *i_host,
+							char *i_uri, int *i_port, int persistent);
+int legacy_client_keepalive(char *hdrs);
+
+/* Keeps the compiler from dropping the work */
+static volatile size_t sink;
+
+
+int main(int argc, char **argv)
+{
+	long rounds = DEFAULT_ROUNDS, headers = 0;
+	unsigned int i;
+	char *p;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			rounds = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || rounds < 1)
+		usage(argv[0]);
+
+	/* Header lines of a round, without request lines and blank lines */
+	for (i = 0; i < NSAMPLES; i++)
+		for (p = strstr(samples[i], "\r\n") + 2; strncmp(p, "\r\n", 2);
+			 p = strstr(p, "\r\n") + 2)
+			headers++;
+
+	printf("%-6s %12s %14s %10s\n", "parser", "requests/s", "headers/s",
+		   "ns/req");
+	bench("old", old_request, rounds, headers);
+	bench("parse", new_parse, rounds, headers);
+	bench("iov", new_iov, rounds, headers);
+	bench("flat", new_flat, rounds, headers);
+	return 0;
+}
+
+/*
+ * Print the command line usage and exit
+ */
+void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-n rounds]\n", prog);
+	fprintf(stderr, "   -n rounds  times every sample request is handled "
+			"(default %d)\n", DEFAULT_ROUNDS);
+	exit(1);
+}
+
+/*
+ * Time rounds of h over the samples and print the rates
+ */
+void bench(const char *name, handler h, long rounds, long headers)
+{
+	struct timespec t0, t1;
+	double secs;
+	size_t len[NSAMPLES];
+	unsigned int i;
+	long r;
+
+	for (i = 0; i < NSAMPLES; i++)
+		len[i] = strlen(samples[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < NSAMPLES; i++)
+			if (!h(samples[i], len[i]))
+				app_error("sample request refused");
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%-6s %12.0f %14.0f %10.1f\n", name,
+		   rounds * NSAMPLES / secs, rounds * headers / secs,
+		   secs * 1e9 / (rounds * NSAMPLES));
+}
+
+/*
+ * The proxy before request.c: the headers were read into a copy,
+ * then rewritten
+ */
+int old_request(char *buf, size_t n)
+{
+	char hdrs[MAXLINE], request[MAXLINE], host[MAXLINE], uri[MAXLINE];
+	int port, rc;
+
+	memcpy(hdrs, buf, n + 1);
+	rc = legacy_generate_request(hdrs, request, host, uri, &port, 1);
+	sink += legacy_client_keepalive(hdrs) + port + strlen(request);
+	return rc;
+}
+
+int new_parse(char *buf, size_t n)
+{
+	http_request req;
+	int rc = request_parse(buf, n, &req);
+
+	sink += req.nheaders + req.keepalive;
+	return rc > 0;
+}
+
+int new_iov(char *buf, size_t n)
+{
+	http_request req;
+	struct iovec iov[REQ_MAX_IOV];
+
+	if (request_parse(buf, n, &req) <= 0)
+		return 0;
+	sink += request_iov(&req, 1, iov);
+	return 1;
+}
+
+int new_flat(char *buf, size_t n)
+{
+	http_request req;
+	struct iovec iov[REQ_MAX_IOV];
+	char request[MAXLINE];
+
+	if (request_parse(buf, n, &req) <= 0)
+		return 0;
+	sink += request_flatten(iov, request_iov(&req, 1, iov), request,
+							MAXLINE);
+	return 1;
+}
+
+
+/*
+ * The request parser of proxy.c before request.c, unchanged
+ * but for the names
+ */
+
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+
+static char *next_line(char *hdrs, char *buf);
+static int parse_request(char *request, char *reqline, char *host,
+						 char *uri, int *port, int persistent);
+static int parse_uri(char *uri, char *host, int *port, char *new_uri);
+static char *substring(char *dest, char *src, char *delim);
+static void get_key_value(char *header_line, char *key, char *value);
+static void get_host_port(char *value, char *host, int *port);
+
+int legacy_client_keepalive(char *hdrs)
+{
+	char *eol = strstr(hdrs, "\r\n");
+	char *p;
+
+	for (p = hdrs; *p; p++) {
+		if (!strncasecmp(p, "connection: close", 17))
+			return 0;
+	}
+	for (p = hdrs; *p; p++) {
+		if (!strncasecmp(p, "connection: keep-alive", 22))
+			return 1;
+	}
+	return eol != NULL && eol - hdrs >= 8 &&
+		!strncmp(eol - 8, "HTTP/1.1", 8);
+}
+
+static char *next_line(char *hdrs, char *buf)
+{
+	char *end = strchr(hdrs, '\n');
+	size_t n = end ? (size_t)(end - hdrs + 1) : strlen(hdrs);
+
+	memcpy(buf, hdrs, n);
+	buf[n] = '\0';
+	return hdrs + n;
+}
+
+int legacy_generate_request(char *hdrs, char *i_request, char *i_host,
+							char *i_uri, int *i_port, int persistent)
+{
+	char buf[MAXLINE], key[MAXLINE], value[MAXLINE];
+	int port = DEFAULT_PORT;
+	int host_exist = 0;
+	char* request = i_request;
+	char* host = i_host;
+	char* uri = i_uri;
+
+	*request = 0;
+	*host = 0;
+
+	hdrs = next_line(hdrs, buf);
+	if (!(parse_request(request, buf, host, uri, &port, persistent)))
+		return 0;
+
+	strcat(request, user_agent_hdr);
+	strcat(request, accept_hdr);
+	strcat(request, accept_encoding_hdr);
+	if (persistent) {
+		strcat(request, "Connection: keep-alive\r\n");
+	} else {
+		strcat(request, "Connection: close\r\n");
+		strcat(request, "Proxy-Connection: close\r\n");
+	}
+
+	while (strcmp(buf, "\r\n")) {
+		*key = '\0';
+		*value = '\0';
+		if (*hdrs == '\0')
+			break;
+		hdrs = next_line(hdrs, buf);
+
+		if (!strcmp(buf, "\r\n"))
+			break;
+
+		get_key_value(buf, key, value);
+		if (*key != '\0' && *value!='\0') {
+			if (!strcmp(key, "Host")) {
+				get_host_port(value, host, &port);
+				host_exist = 1;
+			}
+			if (strcmp(key, "User-Agent") &&
+					strcmp(key, "Accept") &&
+					strcmp(key, "Accept-Encoding") &&
+					strcmp(key, "Connection") &&
+					strcmp(key, "Proxy-Connection")) {
+
+				char hdrline[MAXLINE];
+				if (snprintf(hdrline, sizeof(hdrline), "%s: %s\r\n", key,
+							 value) < (int)sizeof(hdrline))
+					strcat(request, hdrline);
+			}
+		}
+	}
+
+	if (!host_exist) {
+		char host_hdr[MAXLINE];
+		if (port != DEFAULT_PORT)
+			sprintf(host_hdr, "Host: %s:%d\r\n", host, port);
+		else
+			sprintf(host_hdr, "Host: %s\r\n", host);
+
+		strcat(request, host_hdr);
+	}
+
+	*i_port = port;
+	strcat(request, "\r\n");
+	return 1;
+}
+
+static int parse_request(char *request, char *reqline, char *host,
+						 char *uri, int *port, int persistent)
+{
+	char method[MAXLINE], version[MAXLINE];
+	char new_uri[MAXLINE], new_req[MAXLINE];
+
+	sscanf(reqline, "%s %s %s", method, uri, version);
+	if(strcasecmp(method, "GET"))
+		return 0;
+
+	parse_uri(uri, host, port, new_uri);
+
+	if (snprintf(new_req, sizeof(new_req), "%s %s %s", method, new_uri,
+				 persistent ? "HTTP/1.1\r\n" : "HTTP/1.0\r\n") >=
+		(int)sizeof(new_req))
+		return 0;
+	strcat(request, new_req);
+	return 1;
+}
+
+static int parse_uri(char *uri, char *host, int *port, char *new_uri)
+{
+	char *ptr, *tmp_ptr, *port_ptr;
+	char  port_str[MAXLINE];
+	*host = 0;
+	*port = DEFAULT_PORT;
+
+	if ((ptr = strstr(uri, "http://")) == NULL) {
+		strcpy(new_uri, uri);
+		return 0;
+	} else {
+		ptr += 7;
+		tmp_ptr = substring(host, ptr, "/");
+		strcpy(new_uri, tmp_ptr);
+
+		if ((port_ptr = strstr(host, ":"))!= NULL) {
+				*port_ptr = 0;
+				strcpy(port_str, port_ptr + 1);
+				*port = atoi(port_str);
+		}
+
+		return 1;
+	}
+}
+
+static char *substring(char *dest, char *src, char *delim)
+{
+	char *ptr;
+	if ((ptr = strstr(src, delim)) == NULL)
+		return NULL;
+
+	*ptr = '\0';
+	strcpy(dest, src);
+	*ptr = *delim;
+	return ptr;
+}
+
+static void get_key_value(char *header_line, char *key, char *value)
+{
+	char *key_ptr;
+
+	if((key_ptr = substring(key, header_line, ":")) == NULL)
+		return;
+
+	key_ptr = substring(value, key_ptr + 2, "\r");
+}
+
+static void get_host_port(char *value, char *host, int *port) {
+	char *ptr;
+	*port = DEFAULT_PORT;
+
+	if(( ptr = substring(host, value, ":")) != NULL){
+		*port = atoi(ptr + 1);
+	}
+	return;
+}
@@ -0,0 +1,598 @@
+/*
+ * request.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Requests used to be read line by line into a copy of the
+ * headers, split with sscanf and strstr into more copies, and
+ * rewritten with strcat, which goes over the whole request again
+ * for every header added. Now the request is parsed where it was
+ * read, in the buffer of the client rio: request_parse() walks
+ * the bytes once, from the request line to the blank line, and
+ * fills an http_request with slices pointing into them. Nothing
+ * is copied or allocated, and the buffer is left as it is.
+ *
+ * request_iov() lays out the request for the server as pieces:
+ * the request line, the fixed headers of the proxy, the client
+ * headers passed on, a Host header if the client sent none, and
+ * the blank line. They go out in one writev() with writev_all(),
+ * or are copied once, in order, by request_flatten() where a
+ * flat request is needed, for the cache key. Slices stay valid
+ * until the next read on the rio they point into.
+ *
+ * The cache key is not the request for the server, whose headers
+ * mostly do not change the response, but request_key(): the host
+ * in lower case, the port and the path, followed by the values
+ * of the client headers named with -V (request_vary(), by default
+ * REQ_DEFAULT_VARY). A resource asked for by an absolute uri or
+ * by path and Host header, in either mode, has the same key, and
+ * responses that vary on a header outside the key are not cached
+ * (see request_keyed()).
+ *
+ * If the request is not all in the buffer, request_parse() says
+ * so and is called again, from the start, once more bytes came
+ * in. A request almost always arrives in one read, so this is
+ * cheaper than keeping the state of a parse in between.
+ */
+
+#include "csapp.h"
+#include <ctype.h>
+#include "proxy.h"
+#include "request.h"
+#include "scan.h"
+#include "metrics.h"
+
+/* You won't lose style points for including these long lines in your code */
+#define USER_AGENT_HDR "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+#define ACCEPT_HDR "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+#define ACCEPT_ENCODING_HDR "Accept-Encoding: gzip, deflate\r\n"
+
+/* Headers the proxy sends in place of those of the client */
+static const char fixed_hdrs[] =
+	USER_AGENT_HDR ACCEPT_HDR ACCEPT_ENCODING_HDR;
+static const char keepalive_hdrs[] = "Connection: keep-alive\r\n";
+static const char close_hdrs[] =
+	"Connection: close\r\nProxy-Connection: close\r\n";
+
+/* Client headers the cache key includes, set by request_vary() */
+static char vary[REQ_MAX_VARY][REQ_MAX_NAME + 1];
+static int nvary;
+
+static char *line_end(char *p, char *eol);
+static int name_is(char *p, size_t n, const char *name);
+static int parse_uri(http_request *req);
+static int parse_host(char *p, size_t n, http_request *req);
+static int is_replaced(char *p, size_t n);
+static ssize_t gather(int fd, struct iovec *iov, int n, int sock, int flags);
+static int take_header(http_request *req, char *p, char *colon, char *end,
+					   int *conn_close, int *conn_keep);
+static void connection_tokens(char *p, char *end, int *conn_close,
+							  int *conn_keep);
+
+
+/*
+ * Parse the request at the start of buf, n bytes long. Return 1
+ * if it is complete, 0 if more bytes are needed, and -1 if it is
+ * malformed, too large, not a GET or names no server.
+ */
+int request_parse(char *buf, size_t n, http_request *req)
+{
+	char *p = buf, *end = buf + n, *eol, *le, *sp, *colon;
+	int conn_close = 0, conn_keep = 0, http11;
+
+	req->nheaders = 0;
+	req->has_host = 0;
+
+	/* Request line: method, uri and version */
+	if ((eol = scan_char(p, n, '\n')) == NULL)
+		return 0;
+	le = line_end(p, eol);
+	if ((sp = scan_char(p, le - p, ' ')) == NULL)
+		return -1;
+	req->method.p = p;
+	req->method.n = sp - p;
+	if (!name_is(p, sp - p, "GET"))
+		return -1;
+
+	for (p = sp; p < le && *p == ' '; p++)
+		;
+	if ((sp = scan_char(p, le - p, ' ')) == NULL)
+		sp = le;
+	req->uri.p = p;
+	req->uri.n = sp - p;
+	if (req->uri.n == 0 || parse_uri(req) < 0)
+		return -1;
+
+	for (p = sp; p < le && *p == ' '; p++)
+		;
+	http11 = le - p == 8 && !memcmp(p, "HTTP/1.1", 8);
+
+	/*
+	 * Header lines, up to the blank line. The name ends at the
+	 * first ':' unless the line ends first, and the line end is
+	 * searched from there, so every byte is scanned once.
+	 */
+	while (1)
+	{
+		p = eol + 1;
+		if ((eol = scan_either(p, end - p, ':', '\n')) == NULL)
+			return 0;
+		colon = NULL;
+		if (*eol == ':')
+		{
+			colon = eol;
+			if ((eol = scan_char(colon, end - colon, '\n')) == NULL)
+				return 0;
+		}
+		le = line_end(p, eol);
+		if (le == p)
+			break;
+		if (colon != NULL && colon < le &&
+			take_header(req, p, colon, le, &conn_close, &conn_keep) < 0)
+			return -1;
+	}
+	req->len = eol + 1 - buf;
+
+	/* Neither the uri nor a Host header named the server */
+	if (req->host.n == 0 || req->host.n > REQ_MAX_HOST ||
+		req->port <= 0 || req->port > 65535)
+		return -1;
+	req->keepalive = !conn_close && (conn_keep || http11);
+	return 1;
+}
+
+/*
+ * Read the next request from the client into the rio buffer and
+ * parse it there, taking its bytes out of the buffer. Return 1
+ * for a request, 0 on EOF or error, and -1 for a request to
+ * refuse, malformed or too large for the buffer. The
+ * parse that found the whole request is timed, and its start
+ * kept in req->received.
+ */
+int read_request(rio_t *rp, http_request *req)
+{
+	ssize_t n;
+	uint64_t start;
+	int rc;
+
+	while (1)
+	{
+		if (rp->rio_cnt > 0)
+		{
+			start = metrics_now();
+			if ((rc = request_parse(rp->rio_bufptr, rp->rio_cnt, req)) < 0)
+				return -1;
+			if (rc > 0)
+			{
+				metrics_since(METRIC_PARSE, start);
+				req->received = start;
+				rp->rio_bufptr += req->len;
+				rp->rio_cnt -= req->len;
+				return 1;
+			}
+		}
+
+		/* Make room after the partial request and read more */
+		if (rp->rio_bufptr != rp->rio_buf)
+		{
+			memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+			rp->rio_bufptr = rp->rio_buf;
+		}
+		if (rp->rio_cnt == sizeof(rp->rio_buf))
+			return -1;
+		n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+				 sizeof(rp->rio_buf) - rp->rio_cnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		rp->rio_cnt += n;
+	}
+}
+
+/*
+ * Lay out the request for the server in iov, which holds
+ * REQ_MAX_IOV pieces. A persistent request asks the server to
+ * keep the connection open. Return the number of pieces.
+ */
+int request_iov(http_request *req, int persistent, struct iovec *iov)
+{
+	int i, n = 0;
+
+	n = iov_put(iov, n, req->method.p, req->method.n);
+	n = iov_put(iov, n, " ", 1);
+	n = iov_put(iov, n, req->path.p, req->path.n);
+	n = iov_put(iov, n, persistent ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n", 11);
+	n = iov_put(iov, n, fixed_hdrs, sizeof(fixed_hdrs) - 1);
+	if (persistent)
+		n = iov_put(iov, n, keepalive_hdrs, sizeof(keepalive_hdrs) - 1);
+	else
+		n = iov_put(iov, n, close_hdrs, sizeof(close_hdrs) - 1);
+
+	for (i = 0; i < req->nheaders; i++)
+	{
+		n = iov_put(iov, n, req->headers[i].p, req->headers[i].n);
+		n = iov_put(iov, n, "\r\n", 2);
+	}
+
+	/* Name the server from the uri if the client did not */
+	if (!req->has_host)
+	{
+		if (req->port != DEFAULT_PORT)
+			sprintf(req->hostline, "Host: %.*s:%d\r\n",
+					(int)req->host.n, req->host.p, req->port);
+		else
+			sprintf(req->hostline, "Host: %.*s\r\n",
+					(int)req->host.n, req->host.p);
+		n = iov_put(iov, n, req->hostline, strlen(req->hostline));
+	}
+
+	return iov_put(iov, n, "\r\n", 2);
+}
+
+/*
+ * Copy the pieces of a request, in order, into buf as one
+ * string. Return its length, or 0 if it does not fit in maxlen.
+ */
+size_t request_flatten(struct iovec *iov, int n, char *buf, size_t maxlen)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (len + iov[i].iov_len >= maxlen)
+			return 0;
+		memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+/*
+ * Build the cache key of a request in buf. Return its length,
+ * or 0 if it does not fit in maxlen.
+ */
+size_t request_key(http_request *req, char *buf, size_t maxlen)
+{
+	size_t len, i;
+	char *colon, *v, *end;
+	slice *h;
+	int j, k;
+
+	if (req->host.n + req->path.n + 8 >= maxlen)
+		return 0;
+
+	/* host:port/path, the host in lower case */
+	for (len = 0; len < req->host.n; len++)
+		buf[len] = tolower((unsigned char)req->host.p[len]);
+	len += sprintf(buf + len, ":%d", req->port);
+	memcpy(buf + len, req->path.p, req->path.n);
+	len += req->path.n;
+
+	/* A line "name: value" for each header of -V the client sent */
+	for (j = 0; j < nvary; j++)
+	{
+		for (k = 0; k < req->nheaders; k++)
+		{
+			h = &req->headers[k];
+			end = h->p + h->n;
+			colon = memchr(h->p, ':', h->n);
+			if (!name_is(h->p, colon - h->p, vary[j]))
+				continue;
+			for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+				;
+			i = strlen(vary[j]);
+			if (len + i + 3 + (end - v) >= maxlen)
+				return 0;
+			buf[len++] = '\n';
+			memcpy(buf + len, vary[j], i);
+			len += i;
+			buf[len++] = ':';
+			buf[len++] = ' ';
+			memcpy(buf + len, v, end - v);
+			len += end - v;
+		}
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+/*
+ * Key on the client headers named in list, separated by commas,
+ * instead of those before. Return -1 if there are more than
+ * REQ_MAX_VARY of them or a name is too long. Not to be called
+ * while requests are served.
+ */
+int request_vary(char *list)
+{
+	char *p = list, *t;
+	size_t n;
+
+	nvary = 0;
+	while (*p != '\0')
+	{
+		p += strspn(p, " \t,");
+		t = p;
+		p += strcspn(p, " \t,");
+		if ((n = p - t) == 0)
+			continue;
+		if (nvary == REQ_MAX_VARY || n > REQ_MAX_NAME)
+			return -1;
+		memcpy(vary[nvary], t, n);
+		vary[nvary][n] = '\0';
+		nvary++;
+	}
+	return 0;
+}
+
+/*
+ * Whether a response varying on the client header name can be
+ * cached under request_key(): the header is in the key, or the
+ * proxy sends its own value for it whatever the client sent
+ */
+int request_keyed(char *name, size_t n)
+{
+	int j;
+
+	if (is_replaced(name, n))
+		return 1;
+	for (j = 0; j < nvary; j++)
+		if (name_is(name, n, vary[j]))
+			return 1;
+	return 0;
+}
+
+/*
+ * Set piece n of iov, return the number of pieces
+ */
+int iov_put(struct iovec *iov, int n, const void *p, size_t len)
+{
+	iov[n].iov_base = (void *)p;
+	iov[n].iov_len = len;
+	return n + 1;
+}
+
+/*
+ * Whether a slice holds exactly the string str
+ */
+int slice_is(slice s, const char *str)
+{
+	return strlen(str) == s.n && !memcmp(s.p, str, s.n);
+}
+
+/*
+ * Copy a slice into buf as a string
+ */
+void slice_copy(slice s, char *buf)
+{
+	memcpy(buf, s.p, s.n);
+	buf[s.n] = '\0';
+}
+
+/*
+ * Write all the pieces of iov to fd, however many writes it
+ * takes. iov is as it was when this returns. Return the number
+ * of bytes written, or -1 on error.
+ */
+ssize_t writev_all(int fd, struct iovec *iov, int n)
+{
+	return gather(fd, iov, n, 0, 0);
+}
+
+/*
+ * writev_all() to a socket, with the flags of send(). With
+ * MSG_MORE the kernel holds the bytes back to fill the packets
+ * of what is sent next.
+ */
+ssize_t sendv_all(int fd, struct iovec *iov, int n, int flags)
+{
+	return gather(fd, iov, n, 1, flags);
+}
+
+/*
+ * Write the pieces with writev(), or sendmsg() and flags if
+ * sock, until all are written
+ */
+static ssize_t gather(int fd, struct iovec *iov, int n, int sock, int flags)
+{
+	struct iovec saved;
+	struct msghdr msg;
+	ssize_t rc, total = 0;
+	int i = 0, moved = -1, cnt;
+
+	memset(&msg, 0, sizeof(msg));
+	while (i < n)
+	{
+		cnt = n - i < IOV_MAX ? n - i : IOV_MAX;
+		if (sock)
+		{
+			msg.msg_iov = iov + i;
+			msg.msg_iovlen = cnt;
+			rc = sendmsg(fd, &msg, flags);
+		}
+		else
+			rc = writev(fd, iov + i, cnt);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		total += rc;
+
+		/* Skip the pieces written, and the written part of the next */
+		while (i < n && (size_t)rc >= iov[i].iov_len)
+		{
+			rc -= iov[i].iov_len;
+			if (i == moved)
+			{
+				iov[i] = saved;
+				moved = -1;
+			}
+			i++;
+		}
+		if (rc > 0)
+		{
+			if (moved != i)
+			{
+				saved = iov[i];
+				moved = i;
+			}
+			iov[i].iov_base = (char *)iov[i].iov_base + rc;
+			iov[i].iov_len -= rc;
+		}
+	}
+
+	if (moved >= 0)
+		iov[moved] = saved;
+	return i < n ? -1 : total;
+}
+
+/*
+ * End of the line ending at the newline eol, without its CR
+ */
+static char *line_end(char *p, char *eol)
+{
+	return eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+}
+
+/*
+ * Whether the n bytes at p are name, ignoring case
+ */
+static int name_is(char *p, size_t n, const char *name)
+{
+	return strlen(name) == n && !strncasecmp(p, name, n);
+}
+
+/*
+ * Whether the proxy replaces the client header name with its own
+ */
+static int is_replaced(char *p, size_t n)
+{
+	return name_is(p, n, "User-Agent") || name_is(p, n, "Accept") ||
+		name_is(p, n, "Accept-Encoding");
+}
+
+/*
+ * Find the path, and the host and port if the uri names them,
+ * in an absolute uri. Return -1 if the host cannot be used.
+ */
+static int parse_uri(http_request *req)
+{
+	char *p = req->uri.p, *end = p + req->uri.n, *slash;
+
+	req->host.p = NULL;
+	req->host.n = 0;
+	req->port = DEFAULT_PORT;
+	if (req->uri.n < 7 || strncasecmp(p, "http://", 7))
+	{
+		req->path = req->uri;
+		return 0;
+	}
+
+	p += 7;
+	if ((slash = memchr(p, '/', end - p)) != NULL)
+	{
+		req->path.p = slash;
+		req->path.n = end - slash;
+	}
+	else
+	{
+		req->path.p = "/";
+		req->path.n = 1;
+		slash = end;
+	}
+	return parse_host(p, slash - p, req);
+}
+
+/*
+ * Take the host and port out of "host[:port]"
+ */
+static int parse_host(char *p, size_t n, http_request *req)
+{
+	char *colon = memchr(p, ':', n);
+	size_t i;
+
+	req->host.p = p;
+	req->host.n = colon != NULL ? (size_t)(colon - p) : n;
+	req->port = DEFAULT_PORT;
+	if (colon == NULL)
+		return 0;
+
+	req->port = 0;
+	for (i = colon + 1 - p; i < n; i++)
+	{
+		if (!isdigit((unsigned char)p[i]) || req->port > 65535)
+			return -1;
+		req->port = req->port * 10 + p[i] - '0';
+	}
+	return 0;
+}
+
+/*
+ * Take in the header line from p to end, its name ending at
+ * colon. The headers the proxy replaces are dropped, the others
+ * are kept to pass on. Return -1 if there are too many to keep.
+ */
+static int take_header(http_request *req, char *p, char *colon, char *end,
+					   int *conn_close, int *conn_keep)
+{
+	char *v, *vend = end;
+	size_t n = colon - p;
+
+	for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+		;
+	while (vend > v && (vend[-1] == ' ' || vend[-1] == '\t'))
+		vend--;
+	if (v == vend)
+		return 0;
+
+	if (name_is(p, n, "Connection") || name_is(p, n, "Proxy-Connection"))
+	{
+		connection_tokens(v, vend, conn_close, conn_keep);
+		return 0;
+	}
+	if (is_replaced(p, n))
+		return 0;
+
+	/* The Host header names the server over the uri */
+	if (name_is(p, n, "Host"))
+	{
+		req->has_host = 1;
+		if (parse_host(v, vend - v, req) < 0)
+			return -1;
+	}
+
+	if (req->nheaders == REQ_MAX_HEADERS)
+		return -1;
+	req->headers[req->nheaders].p = p;
+	req->headers[req->nheaders].n = end - p;
+	req->nheaders++;
+	return 0;
+}
+
+/*
+ * Look for close and keep-alive in the value of a Connection
+ * or Proxy-Connection header
+ */
+static void connection_tokens(char *p, char *end, int *conn_close,
+							  int *conn_keep)
+{
+	char *t;
+
+	while (p < end)
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		for (t = p; p < end && *p != ',' && *p != ' ' && *p != '\t'; p++)
+			;
+		if (name_is(t, p - t, "close"))
+			*conn_close = 1;
+		else if (name_is(t, p - t, "keep-alive"))
+			*conn_keep = 1;
+	}
+}
@@ -0,0 +1,70 @@
+/*
+ * request.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Parsing of client requests into slices of the bytes read,
+ * and the request sent on to the server
+ */
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include "csapp.h"
+#include <limits.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define REQ_MAX_HEADERS 64		/* client headers passed on to the server */
+#define REQ_MAX_HOST    256		/* bytes of a host name */
+#define REQ_MAX_VARY    8		/* client headers -V adds to the cache key */
+#define REQ_MAX_NAME    63		/* bytes of a header name for -V */
+
+/* Responses differ by them, and sharing them would leak them */
+#define REQ_DEFAULT_VARY "Authorization,Cookie"
+
+/* Pieces of the request for the server, at most */
+#define REQ_MAX_IOV     (2 * REQ_MAX_HEADERS + 12)
+
+/* Pieces one writev() takes, if limits.h does not say */
+#ifndef IOV_MAX
+#define IOV_MAX         1024
+#endif
+
+/* Bytes of a request that stay where they were read */
+typedef struct
+{
+	char *p;
+	size_t n;
+}slice;
+
+/* A client request, pointing into the buffer it was parsed from */
+typedef struct
+{
+	slice method;
+	slice uri;				/* as the client sent it */
+	slice path;				/* the uri without scheme and host */
+	slice host;
+	int port;
+	int keepalive;			/* client wants the connection kept open */
+	int has_host;			/* client sent a Host header */
+	slice headers[REQ_MAX_HEADERS];	/* passed on, without line ends */
+	int nheaders;
+	size_t len;				/* bytes up to and with the blank line */
+	uint64_t received;		/* metrics_now() when it was all read */
+	char hostline[REQ_MAX_HOST + 16];	/* Host header made up if missing */
+}http_request;
+
+int request_parse(char *buf, size_t n, http_request *req);
+int read_request(rio_t *rp, http_request *req);
+int request_iov(http_request *req, int persistent, struct iovec *iov);
+size_t request_flatten(struct iovec *iov, int n, char *buf, size_t maxlen);
+size_t request_key(http_request *req, char *buf, size_t maxlen);
+int request_vary(char *list);
+int request_keyed(char *name, size_t n);
+int slice_is(slice s, const char *str);
+void slice_copy(slice s, char *buf);
+int iov_put(struct iovec *iov, int n, const void *p, size_t len);
+ssize_t writev_all(int fd, struct iovec *iov, int n);
+ssize_t sendv_all(int fd, struct iovec *iov, int n, int flags);
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * sbuf.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * A bounded FIFO ring of connected descriptors, as in the
+ * prethreaded echo server of CS:APP. The main thread inserts
+ * every accepted descriptor and blocks while the ring is full,
+ * and the worker threads of the pool remove them. Three
+ * semaphores guard the ring: a mutex for the indices and two
+ * counting semaphores for free slots and available items.
+ * The mutex also covers the queue depth statistics.
+ */
+
+#include "csapp.h"
+#include "sbuf.h"
+
+/*
+ * Create an empty, bounded, shared FIFO buffer with n slots
+ */
+void sbuf_init(sbuf_t *sp, int n)
+{
+	sp->buf = Calloc(n, sizeof(int));
+	sp->n = n;
+	sp->front = sp->rear = 0;
+	Sem_init(&sp->mutex, 0, 1);
+	Sem_init(&sp->slots, 0, n);
+	Sem_init(&sp->items, 0, 0);
+
+	memset(&sp->stats, 0, sizeof(sp->stats));
+	sp->stats.n = n;
+}
+
+/*
+ * Clean up buffer sp
+ */
+void sbuf_deinit(sbuf_t *sp)
+{
+	Free(sp->buf);
+}
+
+/*
+ * Insert item onto the rear of shared buffer sp
+ */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+	int val;
+
+	/* Remember when the pool is not keeping up */
+	sem_getvalue(&sp->slots, &val);
+	if (val <= 0)
+	{
+		P(&sp->mutex);
+		sp->stats.full++;
+		V(&sp->mutex);
+	}
+
+	P(&sp->slots);							/* Wait for available slot */
+	P(&sp->mutex);							/* Lock the buffer */
+	sp->buf[(++sp->rear)%(sp->n)] = item;	/* Insert the item */
+	sp->stats.inserted++;
+	if (++sp->stats.depth > sp->stats.max_depth)
+		sp->stats.max_depth = sp->stats.depth;
+	V(&sp->mutex);							/* Unlock the buffer */
+	V(&sp->items);							/* Announce available item */
+}
+
+/*
+ * Remove and return the first item from buffer sp
+ */
+int sbuf_remove(sbuf_t *sp)
+{
+	int item;
+
+	P(&sp->items);							/* Wait for available item */
+	P(&sp->mutex);							/* Lock the buffer */
+	item = sp->buf[(++sp->front)%(sp->n)];	/* Remove the item */
+	sp->stats.depth--;
+	V(&sp->mutex);							/* Unlock the buffer */
+	V(&sp->slots);							/* Announce available slot */
+	return item;
+}
+
+/*
+ * Return the number of items waiting in buffer sp
+ */
+int sbuf_depth(sbuf_t *sp)
+{
+	int val;
+
+	sem_getvalue(&sp->items, &val);
+	return val > 0 ? val : 0;
+}
+
+/*
+ * Copy the queue depth statistics of buffer sp
+ */
+void sbuf_get_stats(sbuf_t *sp, sbuf_stats *st)
+{
+	P(&sp->mutex);
+	*st = sp->stats;
+	V(&sp->mutex);
+}
@@ -0,0 +1,48 @@
+/*
+ * sbuf.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Bounded buffer of connected descriptors shared by the
+ * main thread and the worker threads of the proxy
+ */
+
+#ifndef SBUF_H
+#define SBUF_H
+
+#include <semaphore.h>
+
+#define DEFAULT_NTHREADS 16
+#define DEFAULT_SBUFSIZE 64
+
+/* Queue depth statistics of a buffer */
+typedef struct
+{
+	unsigned long inserted;		/* descriptors accepted so far */
+	unsigned long full;			/* inserts that found the buffer full */
+	int depth;					/* descriptors waiting right now */
+	int max_depth;				/* highest depth seen */
+	int n;						/* capacity */
+}sbuf_stats;
+
+/* Definition of the bounded buffer */
+typedef struct
+{
+	int *buf;		/* Buffer array */
+	int n;			/* Maximum number of slots */
+	int front;		/* buf[(front+1)%n] is first item */
+	int rear;		/* buf[rear%n] is last item */
+	sem_t mutex;	/* Protects accesses to buf */
+	sem_t slots;	/* Counts available slots */
+	sem_t items;	/* Counts available items */
+
+	sbuf_stats stats;	/* protected by mutex */
+}sbuf_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+void sbuf_get_stats(sbuf_t *sp, sbuf_stats *st);
+int sbuf_depth(sbuf_t *sp);
+
+#endif
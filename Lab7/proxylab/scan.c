@@ -0,0 +1,313 @@
+/*
+ * scan.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Finds the first of one or two delimiters in a buffer: line
+ * ends for rio_readlineb() and the header parsers, and the ':'
+ * ending a header name. rio_readlineb() used to go through the
+ * buffer one rio_read() call per byte.
+ *
+ * There are three versions of each search:
+ *
+ * scalar  one byte at a time, for any CPU
+ * sse2    16 bytes at a time, compared at once with pcmpeqb, the
+ *         matches gathered in a bit mask by pmovmskb, and the
+ *         first one found with ctz
+ * avx2    the same, 32 bytes at a time
+ *
+ * The widest one the CPU supports is picked before main() runs,
+ * with __builtin_cpu_supports(), and called through a pointer
+ * from then on. Every x86-64 CPU has SSE2, other ones get the
+ * scalar version. scan_select() picks one by name instead, for
+ * benchmarks. The last bytes of a buffer, short of a whole
+ * vector, are left to the next narrower version, so nothing is
+ * read past the end of the buffer.
+ */
+
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* One version of the searches */
+typedef struct
+{
+	const char *name;
+	char *(*find)(const char *p, size_t n, int c);
+	char *(*find2)(const char *p, size_t n, int a, int b);
+	int (*supported)(void);
+}scanner;
+
+static char *find_scalar(const char *p, size_t n, int c);
+static char *find2_scalar(const char *p, size_t n, int a, int b);
+static int always(void);
+#ifdef SCAN_X86
+static char *find_sse2(const char *p, size_t n, int c);
+static char *find2_sse2(const char *p, size_t n, int a, int b);
+static char *find_avx2(const char *p, size_t n, int c);
+static char *find2_avx2(const char *p, size_t n, int a, int b);
+static int has_avx2(void);
+#endif
+
+/* From the widest down */
+static const scanner scanners[] = {
+#ifdef SCAN_X86
+	{ "avx2", find_avx2, find2_avx2, has_avx2 },
+	{ "sse2", find_sse2, find2_sse2, always },
+#endif
+	{ "scalar", find_scalar, find2_scalar, always },
+};
+
+#define NSCANNERS (sizeof(scanners) / sizeof(scanners[0]))
+
+/* The version in use, scalar until scan_init() ran */
+static const scanner *current = &scanners[NSCANNERS - 1];
+
+static void scan_init(void) __attribute__((constructor));
+
+
+/*
+ * Return the first c in the n bytes at p, or NULL
+ */
+char *scan_char(const char *p, size_t n, int c)
+{
+	return current->find(p, n, c);
+}
+
+/*
+ * Return the first a or b in the n bytes at p, or NULL
+ */
+char *scan_either(const char *p, size_t n, int a, int b)
+{
+	return current->find2(p, n, a, b);
+}
+
+/*
+ * Use the version called name, or the widest supported for
+ * "auto". Return -1 if it is unknown or not supported. Not to
+ * be called while other threads scan.
+ */
+int scan_select(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < NSCANNERS; i++)
+	{
+		if (scanners[i].supported() &&
+			(!strcmp(name, "auto") || !strcmp(name, scanners[i].name)))
+		{
+			current = &scanners[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Name of the version in use
+ */
+const char *scan_name(void)
+{
+	return current->name;
+}
+
+/*
+ * Pick the widest version before main() runs, so it is set
+ * before any thread scans
+ */
+static void scan_init(void)
+{
+	scan_select("auto");
+}
+
+static int always(void)
+{
+	return 1;
+}
+
+static char *find_scalar(const char *p, size_t n, int c)
+{
+	const char *end = p + n;
+
+	for (; p < end; p++)
+		if (*p == (char)c)
+			return (char *)p;
+	return NULL;
+}
+
+static char *find2_scalar(const char *p, size_t n, int a, int b)
+{
+	const char *end = p + n;
+
+	for (; p < end; p++)
+		if (*p == (char)a || *p == (char)b)
+			return (char *)p;
+	return NULL;
+}
+
+#ifdef SCAN_X86
+
+/*
+ * Bit mask of the bytes equal to c in the 16 bytes at p
+ */
+static inline unsigned int match16(const char *p, __m128i c)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(
+		_mm_loadu_si128((const __m128i *)p), c));
+}
+
+static inline unsigned int match16_2(const char *p, __m128i a, __m128i b)
+{
+	__m128i x = _mm_loadu_si128((const __m128i *)p);
+
+	return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, a),
+										  _mm_cmpeq_epi8(x, b)));
+}
+
+/*
+ * The last vector of a buffer is loaded from its end, over
+ * bytes already searched, which matched nothing. Inlined in
+ * the AVX2 versions too, so they run no legacy SSE code, which
+ * would stall on the upper halves of the AVX registers.
+ */
+static inline __attribute__((always_inline))
+char *find16(const char *p, size_t n, int c)
+{
+	const char *end = p + n;
+	__m128i v = _mm_set1_epi8((char)c);
+	unsigned int m;
+
+	if (n < 16)
+		return find_scalar(p, n, c);
+	for (; end - p > 16; p += 16)
+		if ((m = match16(p, v)) != 0)
+			return (char *)p + __builtin_ctz(m);
+	p = end - 16;
+	if ((m = match16(p, v)) != 0)
+		return (char *)p + __builtin_ctz(m);
+	return NULL;
+}
+
+static inline __attribute__((always_inline))
+char *find16_2(const char *p, size_t n, int a, int b)
+{
+	const char *end = p + n;
+	__m128i va = _mm_set1_epi8((char)a), vb = _mm_set1_epi8((char)b);
+	unsigned int m;
+
+	if (n < 16)
+		return find2_scalar(p, n, a, b);
+	for (; end - p > 16; p += 16)
+		if ((m = match16_2(p, va, vb)) != 0)
+			return (char *)p + __builtin_ctz(m);
+	p = end - 16;
+	if ((m = match16_2(p, va, vb)) != 0)
+		return (char *)p + __builtin_ctz(m);
+	return NULL;
+}
+
+static char *find_sse2(const char *p, size_t n, int c)
+{
+	return find16(p, n, c);
+}
+
+static char *find2_sse2(const char *p, size_t n, int a, int b)
+{
+	return find16_2(p, n, a, b);
+}
+
+/*
+ * Bit masks of the bytes equal to c in the 32 bytes at p
+ */
+__attribute__((target("avx2")))
+static inline unsigned int match32(const char *p, __m256i c)
+{
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+		_mm256_loadu_si256((const __m256i *)p), c));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int match32_2(const char *p, __m256i a, __m256i b)
+{
+	__m256i x = _mm256_loadu_si256((const __m256i *)p);
+
+	return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, a),
+												_mm256_cmpeq_epi8(x, b)));
+}
+
+/*
+ * 64 bytes a round while the buffer is long enough, the two
+ * masks checked together
+ */
+__attribute__((target("avx2")))
+static char *find_avx2(const char *p, size_t n, int c)
+{
+	const char *end = p + n;
+	__m256i v;
+	unsigned int m, m2;
+
+	if (n < 32)
+		return find16(p, n, c);
+	v = _mm256_set1_epi8((char)c);
+	for (; end - p >= 64; p += 64)
+	{
+		m = match32(p, v);
+		m2 = match32(p + 32, v);
+		if ((m | m2) != 0)
+			return (char *)p + (m != 0 ? __builtin_ctz(m) :
+								32 + __builtin_ctz(m2));
+	}
+	if (end - p > 32)
+	{
+		if ((m = match32(p, v)) != 0)
+			return (char *)p + __builtin_ctz(m);
+	}
+	p = end - 32;
+	if ((m = match32(p, v)) != 0)
+		return (char *)p + __builtin_ctz(m);
+	return NULL;
+}
+
+__attribute__((target("avx2")))
+static char *find2_avx2(const char *p, size_t n, int a, int b)
+{
+	const char *end = p + n;
+	__m256i va, vb;
+	unsigned int m, m2;
+
+	if (n < 32)
+		return find16_2(p, n, a, b);
+	va = _mm256_set1_epi8((char)a);
+	vb = _mm256_set1_epi8((char)b);
+	for (; end - p >= 64; p += 64)
+	{
+		m = match32_2(p, va, vb);
+		m2 = match32_2(p + 32, va, vb);
+		if ((m | m2) != 0)
+			return (char *)p + (m != 0 ? __builtin_ctz(m) :
+								32 + __builtin_ctz(m2));
+	}
+	if (end - p > 32)
+	{
+		if ((m = match32_2(p, va, vb)) != 0)
+			return (char *)p + __builtin_ctz(m);
+	}
+	p = end - 32;
+	if ((m = match32_2(p, va, vb)) != 0)
+		return (char *)p + __builtin_ctz(m);
+	return NULL;
+}
+
+static int has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif
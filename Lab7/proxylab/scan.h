@@ -0,0 +1,18 @@
+/*
+ * scan.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Search of buffers for delimiters, many bytes at a time
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+char *scan_char(const char *p, size_t n, int c);
+char *scan_either(const char *p, size_t n, int a, int b);
+int scan_select(const char *name);
+const char *scan_name(void);
+
+#endif
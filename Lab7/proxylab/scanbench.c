@@ -0,0 +1,243 @@
+/*
+ * scanbench.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Measures the delimiter searches of scan.c in bytes per cycle,
+ * for each version the CPU supports and for the memchr() of the
+ * C library as a reference. Each search goes over a buffer of
+ * the given length with the only delimiter in its last byte, so
+ * every byte is looked at:
+ *
+ * 32 bytes    a short header line
+ * 256 bytes   a long header line, with cookies
+ * 8192 bytes  a full rio buffer
+ *
+ * Then rio_readlineb(), which finds line ends with scan_char(),
+ * reads a file of response headers, in the page cache, line by
+ * line, next to the rio_readlineb() it replaced, which took one
+ * byte at a time out of the rio buffer.
+ *
+ * Cycles are those of the time stamp counter, which ticks at a
+ * fixed rate close to the nominal clock of the CPU.
+ *
+ * usage: scanbench [-n bytes]
+ */
+
+#include "csapp.h"
+#include "scan.h"
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+#define BENCH_BYTES (1L << 30)		/* scanned per version and length */
+#define LINES_BYTES (16L << 20)		/* of headers read line by line */
+
+static const char *versions[] = { "scalar", "sse2", "avx2", "memchr" };
+static const size_t lengths[] = { 32, 256, 8192 };
+
+#define NVERSIONS (sizeof(versions) / sizeof(versions[0]))
+#define NLENGTHS  (sizeof(lengths) / sizeof(lengths[0]))
+
+/* Keeps the compiler from dropping the searches */
+static volatile size_t sink;
+
+void usage(char *prog);
+double bench(const char *version, char *buf, size_t len, long total,
+			 int two);
+double bench_lines(int fd, ssize_t (*readline)(rio_t *, void *, size_t));
+int header_file(void);
+ssize_t legacy_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+unsigned long long cycles(void);
+
+
+int main(int argc, char **argv)
+{
+	long total = BENCH_BYTES;
+	unsigned int v, i;
+	char *buf;
+	int opt, two, fd;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			total = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || total < 1)
+		usage(argv[0]);
+
+	buf = (char *)Malloc(lengths[NLENGTHS - 1]);
+	memset(buf, 'x', lengths[NLENGTHS - 1]);
+
+	printf("in use: %s\n", scan_name());
+	printf("%-8s %-7s", "search", "version");
+	for (i = 0; i < NLENGTHS; i++)
+		printf(" %8zuB", lengths[i]);
+	printf("   (bytes/cycle)\n");
+
+	for (two = 0; two <= 1; two++)
+	{
+		for (v = 0; v < NVERSIONS; v++)
+		{
+			if (strcmp(versions[v], "memchr") &&
+				scan_select(versions[v]) < 0)
+				continue;
+			if (two && !strcmp(versions[v], "memchr"))
+				continue;
+			printf("%-8s %-7s", two ? "either" : "char", versions[v]);
+			for (i = 0; i < NLENGTHS; i++)
+				printf(" %9.2f", bench(versions[v], buf, lengths[i],
+									   total, two));
+			printf("\n");
+		}
+	}
+	scan_select("auto");
+
+	fd = header_file();
+	printf("\n%-16s %9s   (bytes/cycle)\n", "rio_readlineb", "headers");
+	printf("%-16s %9.2f\n", "byte at a time",
+		   bench_lines(fd, legacy_readlineb));
+	printf("%-16s %9.2f\n", scan_name(), bench_lines(fd, rio_readlineb));
+	Close(fd);
+	return 0;
+}
+
+/*
+ * Print the command line usage and exit
+ */
+void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-n bytes]\n", prog);
+	fprintf(stderr, "   -n bytes  scanned per version and length "
+			"(default %ld)\n", BENCH_BYTES);
+	exit(1);
+}
+
+/*
+ * Search for '\n', or for ':' or '\n' if two, in len bytes of
+ * buf until total bytes were scanned. Return bytes per cycle.
+ */
+double bench(const char *version, char *buf, size_t len, long total,
+			 int two)
+{
+	unsigned long long t0, t1;
+	int libc = !strcmp(version, "memchr");
+	long i, rounds = total / len;
+
+	buf[len - 1] = '\n';
+	t0 = cycles();
+	for (i = 0; i < rounds; i++)
+	{
+		if (libc)
+			sink += (char *)memchr(buf, '\n', len) - buf;
+		else if (two)
+			sink += scan_either(buf, len, ':', '\n') - buf;
+		else
+			sink += scan_char(buf, len, '\n') - buf;
+	}
+	t1 = cycles();
+	buf[len - 1] = 'x';
+
+	return (double)rounds * len / (t1 - t0);
+}
+
+/*
+ * Read the file line by line, return bytes per cycle
+ */
+double bench_lines(int fd, ssize_t (*readline)(rio_t *, void *, size_t))
+{
+	unsigned long long t0, t1;
+	char line[MAXLINE];
+	long total = 0;
+	ssize_t n;
+	rio_t rio;
+
+	lseek(fd, 0, SEEK_SET);
+	Rio_readinitb(&rio, fd);
+	t0 = cycles();
+	while ((n = readline(&rio, line, MAXLINE)) > 0)
+		total += n;
+	t1 = cycles();
+	return (double)total / (t1 - t0);
+}
+
+/*
+ * An unlinked file of LINES_BYTES of response headers
+ */
+int header_file(void)
+{
+	static const char *head =
+		"HTTP/1.1 200 OK\r\n"
+		"Date: Tue, 17 Oct 2023 18:04:12 GMT\r\n"
+		"Server: Apache/2.4.57 (Unix)\r\n"
+		"Last-Modified: Mon, 02 Oct 2023 09:15:00 GMT\r\n"
+		"ETag: \"2d4-606b8c1a3e0c0\"\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"Content-Length: 724\r\n"
+		"Cache-Control: public, max-age=3600, stale-while-revalidate=60\r\n"
+		"Vary: Accept-Encoding\r\n"
+		"Content-Type: text/html; charset=UTF-8\r\n"
+		"\r\n";
+	char path[] = "/tmp/scanbenchXXXXXX";
+	size_t len = strlen(head);
+	long written;
+	int fd;
+
+	if ((fd = mkstemp(path)) < 0)
+		unix_error("mkstemp error");
+	unlink(path);
+	for (written = 0; written < LINES_BYTES; written += len)
+		Rio_writen(fd, (void *)head, len);
+	return fd;
+}
+
+/*
+ * rio_readlineb() as it was, one byte at a time
+ */
+ssize_t legacy_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+	int n, rc;
+	char c, *bufp = usrbuf;
+
+	for (n = 1; n < maxlen; n++) {
+		if ((rc = rio_readnb(rp, &c, 1)) == 1) {
+			*bufp++ = c;
+			if (c == '\n') {
+				n++;
+				break;
+			}
+		} else if (rc == 0) {
+			if (n == 1)
+				return 0;
+			else
+				break;
+		} else
+			return -1;
+	}
+	*bufp = 0;
+	return n-1;
+}
+
+/*
+ * Cycles of the time stamp counter, or nanoseconds where there
+ * is none
+ */
+unsigned long long cycles(void)
+{
+#ifdef __x86_64__
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
@@ -0,0 +1,180 @@
+/*
+ * upstream.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * Keeps idle connections to servers for reuse, so a cache miss
+ * usually skips the TCP handshake. New connections resolve the
+ * server through the cache of dns.c. Idle
+ * connections hang off a small hash table keyed by "host:port",
+ * each chain holding the connections of one or more servers,
+ * most recently returned first. A connection is only returned
+ * by the caller once it has read a complete, framed response
+ * and the server did not ask to close.
+ *
+ * A server may close an idle connection at any time, so
+ * connections idle for more than UPSTREAM_IDLE_SECS are
+ * dropped, and upconn->reused tells the caller a failed request
+ * may be retried on a fresh connection. One semaphore guards
+ * the whole table; it is only held to pop or push a node.
+ */
+
+#include "csapp.h"
+#include "cache.h"
+#include "upstream.h"
+#include "dns.h"
+
+static upconn *idle[UPSTREAM_BUCKETS];
+static int nidle[UPSTREAM_BUCKETS];
+static upstream_stats stats;
+static sem_t mutex;
+
+static void make_key(upconn *uc, char *host, char *port);
+
+
+/*
+ * Initialize the empty pool
+ */
+void upstream_init(void)
+{
+	memset(idle, 0, sizeof(idle));
+	memset(nidle, 0, sizeof(nidle));
+	memset(&stats, 0, sizeof(stats));
+	Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * Return a connection to host:port, reusing an idle one
+ * if possible. NULL if a new one could not be opened.
+ */
+upconn *upstream_get(char *host, char *port)
+{
+	upconn key, *uc, **pp, *expired = NULL;
+	time_t now = time(NULL);
+	int b;
+
+	make_key(&key, host, port);
+	b = key.hash & (UPSTREAM_BUCKETS - 1);
+
+	P(&mutex);
+	pp = &idle[b];
+	while ((uc = *pp) != NULL)
+	{
+		/* Unlink connections idle for too long */
+		if (now - uc->idle_since > UPSTREAM_IDLE_SECS)
+		{
+			*pp = uc->next;
+			nidle[b]--;
+			stats.idle--;
+			uc->next = expired;
+			expired = uc;
+			continue;
+		}
+		if (uc->hash == key.hash && !strcmp(uc->key, key.key))
+		{
+			*pp = uc->next;
+			nidle[b]--;
+			stats.idle--;
+			stats.reused++;
+			break;
+		}
+		pp = &uc->next;
+	}
+	V(&mutex);
+
+	while (expired != NULL)
+	{
+		upconn *next = expired->next;
+		upstream_close(expired);
+		expired = next;
+	}
+
+	if (uc != NULL)
+	{
+		uc->reused = 1;
+		uc->next = NULL;
+		return uc;
+	}
+
+	/* Nothing idle, open a new connection */
+	uc = (upconn *)Malloc(sizeof(upconn));
+	*uc = key;
+	if ((uc->fd = dns_open_clientfd(host, port)) < 0)
+	{
+		Free(uc);
+		return NULL;
+	}
+	uc->reused = 0;
+	uc->next = NULL;
+	Rio_readinitb(&uc->rio, uc->fd);
+
+	P(&mutex);
+	stats.opened++;
+	V(&mutex);
+	return uc;
+}
+
+/*
+ * Give a connection back after a complete response,
+ * close it if its server already has enough idle ones
+ */
+void upstream_put(upconn *uc)
+{
+	int b = uc->hash & (UPSTREAM_BUCKETS - 1);
+
+	uc->idle_since = time(NULL);
+
+	P(&mutex);
+	if (nidle[b] >= UPSTREAM_MAX_IDLE)
+	{
+		V(&mutex);
+		upstream_close(uc);
+		return;
+	}
+	uc->next = idle[b];
+	idle[b] = uc;
+	nidle[b]++;
+	stats.idle++;
+	V(&mutex);
+}
+
+/*
+ * Close a connection that cannot be reused
+ */
+void upstream_close(upconn *uc)
+{
+	Close(uc->fd);
+	Free(uc);
+}
+
+/*
+ * Close a pooled connection the server had already closed
+ */
+void upstream_discard(upconn *uc)
+{
+	P(&mutex);
+	stats.stale++;
+	V(&mutex);
+	upstream_close(uc);
+}
+
+/*
+ * Copy the statistics of the pool
+ */
+void get_upstream_stats(upstream_stats *st)
+{
+	P(&mutex);
+	*st = stats;
+	V(&mutex);
+}
+
+/*
+ * Fill in the "host:port" key of a connection and its hash
+ */
+static void make_key(upconn *uc, char *host, char *port)
+{
+	snprintf(uc->key, sizeof(uc->key), "%s:%s", host, port);
+	uc->hash = cache_hash(uc->key);
+}
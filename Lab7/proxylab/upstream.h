@@ -0,0 +1,45 @@
+/*
+ * upstream.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Pool of persistent HTTP/1.1 connections to servers
+ */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include "csapp.h"
+
+#define UPSTREAM_BUCKETS   64	/* (host, port) chains, a power of two */
+#define UPSTREAM_MAX_IDLE  8	/* idle connections kept per server */
+#define UPSTREAM_IDLE_SECS 30	/* idle connections older are closed */
+
+/* Definition of a server connection */
+typedef struct upconn
+{
+	int fd;
+	int reused;				/* taken from the pool, may have gone stale */
+	char key[MAXLINE];		/* "host:port" */
+	uint64_t hash;
+	time_t idle_since;
+	rio_t rio;				/* kept with the connection across requests */
+	struct upconn *next;	/* next idle connection to the same server */
+}upconn;
+
+/* Statistics of the pool */
+typedef struct
+{
+	unsigned long opened;		/* new connections */
+	unsigned long reused;		/* requests sent on pooled connections */
+	unsigned long stale;		/* pooled connections found closed */
+	unsigned long idle;			/* idle connections right now */
+}upstream_stats;
+
+void upstream_init(void);
+upconn *upstream_get(char *host, char *port);
+void upstream_put(upconn *uc);
+void upstream_close(upconn *uc);
+void upstream_discard(upconn *uc);
+void get_upstream_stats(upstream_stats *st);
+
+#endif
@@ -0,0 +1,923 @@
+/*
+ * uring.c
+ *
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ *
+ * Overview:
+ * A completion-driven alternative to the thread pool and the
+ * epoll loops, on io_uring, used through its system calls and
+ * the ring layout of <linux/io_uring.h>. Every ring thread owns
+ * a listening socket bound with SO_REUSEPORT and an io_uring
+ * instance. Instead of waiting for a socket to become ready and
+ * then calling read() or write() on it, a connection queues the
+ * operation itself and is called back with its result:
+ *
+ * OP_RECV_CLIENT  read the client until the blank line ending
+ *                 the headers, then look the request up in cache
+ * OP_CONNECT      connect to the server
+ * OP_SEND_SERVER  write the rewritten request to the server
+ * OP_RECV_SERVER  read a chunk of the response from the server
+ * OP_SEND_CLIENT  write that chunk, a cache hit or a page of the
+ *                 proxy to the client
+ *
+ * A connection has at most one operation in flight, so it is
+ * only ever freed while handling the completion of its own last
+ * one. Operations are queued while the completions of a batch
+ * are handled, and all of them are submitted by the same
+ * io_uring_enter() that waits for the next batch: a loop makes
+ * one system call per batch, however many sockets it touches.
+ * New connections come from a single multishot accept.
+ *
+ * Every ring registers URING_SLOTS buffers of MAXBUF bytes with
+ * the kernel, so relaying a response through one of them is
+ * done with READ_FIXED and WRITE_FIXED, which skip mapping the
+ * user pages on every call. A connection that finds them all
+ * taken, or a ring the kernel did not let lock that much memory,
+ * relays through a buffer of its own instead.
+ *
+ * Like the epoll loops, cache hits are only served while fresh,
+ * and a connection is kept for the next request when the client
+ * asked for it and the response carries its own framing. An
+ * operation pending for EVENT_IDLE_TIMEOUT seconds, be it a read
+ * of the client, a connect or a read of the server, is
+ * cancelled, which ends its connection. As there, evicted objects
+ * and snapshots are written by other threads, and only the
+ * first request to a server waits, for the resolver.
+ */
+
+#include "csapp.h"
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+#include "cache.h"
+#include "proxy.h"
+#include "event.h"
+#include "uring.h"
+#include "dns.h"
+#include "fresh.h"
+#include "bufpool.h"
+#include "request.h"
+#include "metrics.h"
+#include "accesslog.h"
+
+/* Operation a connection has in flight */
+enum { OP_NONE, OP_RECV_CLIENT, OP_CONNECT, OP_SEND_SERVER, OP_RECV_SERVER,
+	OP_SEND_CLIENT };
+
+/* user_data of the accept and cancels, connections use their address */
+#define ACCEPT_DATA 0
+#define CANCEL_DATA 1
+
+typedef struct uconn uconn;
+
+/* Definition of a client connection */
+struct uconn
+{
+	int client;
+	int server;
+	int op;
+	int keepalive;			/* client wants the connection kept open */
+	int has_length;			/* response end is known without a close */
+	int head_seen;			/* the response headers were all read */
+	time_t last_active;
+	uconn *prev;			/* connections of the same ring */
+	uconn *next;
+
+	/* Request bytes read from the client, NUL terminated */
+	char *in;
+	size_t inlen;
+	size_t consumed;		/* bytes of in used by the current request */
+
+	/* Rewritten request for the server, its cache key and address */
+	char *request;
+	size_t reqlen;
+	size_t reqsent;
+	char *key;
+	uint64_t key_hash;
+	dns_addr addr;
+	char host[REQ_MAX_HOST + 1];
+	char port[20];
+
+	/* Timing of the request, by metrics_now() */
+	uint64_t received;		/* when it was all read, 0 once answered */
+	uint64_t connecting;	/* when the connect to the server began */
+	int first_sent;			/* first byte of the response written */
+
+	/* What the access log says of the request */
+	uint32_t peer;			/* of the client, IPv4 in network order */
+	const char *uri;		/* in the input buffer */
+	size_t urilen;
+	int status;				/* of the response, 0 if unknown */
+	unsigned long sent;		/* bytes written to the client */
+	metric_counter outcome;
+
+	/* Response being written to the client */
+	node *cached;			/* pinned cache hit */
+	char *local;			/* page built by the proxy */
+	char *relay;			/* last chunk read from the server */
+	int slot;				/* registered buffer relay is, or -1 */
+	char *out;
+	size_t outlen;
+	size_t outsent;
+
+	/* Copy of a missed response for the cache */
+	growbuf copy;
+	int fit_size;
+};
+
+/* Definition of a ring and its loop */
+typedef struct
+{
+	int fd;
+	int listenfd;
+	time_t now;
+	uconn conns;			/* dummy head of the connection list */
+
+	/* Submission queue, shared with the kernel */
+	unsigned *sq_head;
+	unsigned *sq_ktail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_tail;		/* queued, published at submit */
+	unsigned submitted;		/* handed to the kernel */
+	struct io_uring_sqe *sqes;
+
+	/* Completion queue, shared with the kernel */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Registered relay buffers, and a stack of the free ones */
+	char *slab;
+	int *free_slots;
+	int nfree;
+
+	uring_stats st;			/* not yet added to the totals */
+}uloop;
+
+static uring_stats totals;
+
+static void *ring_thread(void *vargp);
+static void ring_main(char *port);
+static void ring_init(uloop *l);
+static void register_slots(uloop *l);
+static struct io_uring_sqe *get_sqe(uloop *l);
+static void submit(uloop *l, int wait);
+static void queue_accept(uloop *l);
+static void queue_op(uloop *l, uconn *c, int op);
+static void accepted(uloop *l, int fd);
+static void complete(uloop *l, uconn *c, int res);
+static void next_request(uloop *l, uconn *c);
+static int start_request(uloop *l, uconn *c);
+static void finish_response(uloop *l, uconn *c);
+static void answered(uconn *c, metric_counter outcome);
+static void free_response(uloop *l, uconn *c);
+static void close_server(uconn *c);
+static void close_conn(uloop *l, uconn *c);
+static void sweep_idle(uloop *l);
+static void add_stats(uloop *l);
+
+
+/*
+ * Run nrings rings on port, one per CPU if nrings is 0. The
+ * calling thread becomes one of them, so it never returns.
+ */
+void uring_run(char *port, int nrings)
+{
+	int i;
+	pthread_t tid;
+	struct rlimit rl;
+
+	if (nrings <= 0)
+		nrings = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nrings <= 0)
+		nrings = 1;
+
+	/*
+	 * Allow as many open connections, and as much memory locked
+	 * for the registered buffers, as the hard limits do
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_MEMLOCK, &rl);
+	}
+
+	for (i = 1; i < nrings; i++)
+		Pthread_create(&tid, NULL, ring_thread, port);
+	ring_main(port);
+}
+
+void get_uring_stats(uring_stats *st)
+{
+	st->enters = __atomic_load_n(&totals.enters, __ATOMIC_RELAXED);
+	st->sqes = __atomic_load_n(&totals.sqes, __ATOMIC_RELAXED);
+	st->cqes = __atomic_load_n(&totals.cqes, __ATOMIC_RELAXED);
+	st->fixed = __atomic_load_n(&totals.fixed, __ATOMIC_RELAXED);
+}
+
+static void *ring_thread(void *vargp)
+{
+	Pthread_detach(Pthread_self());
+	ring_main((char *)vargp);
+	return NULL;
+}
+
+/*
+ * Submit what the last batch queued, wait for the next batch
+ * of completions and hand each to its connection
+ */
+static void ring_main(char *port)
+{
+	uloop l;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	time_t last_sweep;
+	uint64_t data;
+	int res;
+
+	memset(&l, 0, sizeof(l));
+	ring_init(&l);
+	register_slots(&l);
+	l.conns.next = l.conns.prev = &l.conns;
+	l.now = last_sweep = time(NULL);
+
+	/* The ring waits on the listener, so it may as well block */
+	if ((l.listenfd = open_reuseport_listenfd(port)) < 0)
+		unix_error("Open_listenfd error");
+	fcntl(l.listenfd, F_SETFL, fcntl(l.listenfd, F_GETFL) & ~O_NONBLOCK);
+	queue_accept(&l);
+
+	while (1)
+	{
+		submit(&l, 1);
+		l.now = time(NULL);
+
+		head = *l.cq_head;
+		tail = __atomic_load_n(l.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			cqe = &l.cqes[head & l.cq_mask];
+			data = cqe->user_data;
+			res = cqe->res;
+
+			/* A multishot accept without MORE has stopped */
+			if (data == ACCEPT_DATA)
+			{
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					queue_accept(&l);
+				if (res >= 0)
+					accepted(&l, res);
+			}
+			else if (data != CANCEL_DATA)
+				complete(&l, (uconn *)(uintptr_t)data, res);
+			l.st.cqes++;
+		}
+		__atomic_store_n(l.cq_head, head, __ATOMIC_RELEASE);
+
+		if (l.now != last_sweep)
+		{
+			sweep_idle(&l);
+			last_sweep = l.now;
+		}
+		add_stats(&l);
+	}
+}
+
+/*
+ * Set up the ring and map its queues
+ */
+static void ring_init(uloop *l)
+{
+	struct io_uring_params p;
+	size_t ringsz, cqsz;
+	char *ring;
+	unsigned i, *array;
+
+	/* Only this thread submits, and only while it waits */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+		IORING_SETUP_DEFER_TASKRUN;
+	p.cq_entries = URING_ENTRIES * 4;
+	l->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (l->fd < 0 && errno == EINVAL)
+	{
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = URING_ENTRIES * 4;
+		l->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	}
+	if (l->fd < 0)
+		unix_error("io_uring_setup error");
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(p.features & IORING_FEAT_NODROP) ||
+			!(p.features & IORING_FEAT_EXT_ARG))
+		app_error("io_uring of this kernel is too old");
+
+	/* Both queue rings are in one mapping */
+	ringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cqsz > ringsz)
+		ringsz = cqsz;
+	ring = mmap(NULL, ringsz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, l->fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		unix_error("mmap error");
+	l->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+				   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				   l->fd, IORING_OFF_SQES);
+	if (l->sqes == MAP_FAILED)
+		unix_error("mmap error");
+
+	l->sq_head = (unsigned *)(ring + p.sq_off.head);
+	l->sq_ktail = (unsigned *)(ring + p.sq_off.tail);
+	l->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+	l->sq_entries = p.sq_entries;
+	l->sq_tail = l->submitted = *l->sq_ktail;
+	l->cq_head = (unsigned *)(ring + p.cq_off.head);
+	l->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+	l->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+	l->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	/* Entry i of the queue is always sqes[i] */
+	array = (unsigned *)(ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+}
+
+/*
+ * Register the relay buffers, or leave the ring without if the
+ * kernel refuses to lock them
+ */
+static void register_slots(uloop *l)
+{
+	struct iovec iov[URING_SLOTS];
+	int i;
+
+	l->slab = (char *)Malloc((size_t)URING_SLOTS * MAXBUF);
+	for (i = 0; i < URING_SLOTS; i++)
+	{
+		iov[i].iov_base = l->slab + (size_t)i * MAXBUF;
+		iov[i].iov_len = MAXBUF;
+	}
+	if (syscall(__NR_io_uring_register, l->fd, IORING_REGISTER_BUFFERS,
+				iov, URING_SLOTS) < 0)
+	{
+		fprintf(stderr, "io_uring buffers not registered: %s\n",
+				strerror(errno));
+		Free(l->slab);
+		l->slab = NULL;
+		return;
+	}
+	l->free_slots = (int *)Malloc(URING_SLOTS * sizeof(int));
+	for (i = 0; i < URING_SLOTS; i++)
+		l->free_slots[i] = URING_SLOTS - 1 - i;
+	l->nfree = URING_SLOTS;
+}
+
+/*
+ * A cleared entry at the tail of the submission queue,
+ * submitting the queue first if it is full
+ */
+static struct io_uring_sqe *get_sqe(uloop *l)
+{
+	struct io_uring_sqe *sqe;
+
+	while (l->sq_tail - __atomic_load_n(l->sq_head, __ATOMIC_ACQUIRE) ==
+			l->sq_entries)
+		submit(l, 0);
+	sqe = &l->sqes[l->sq_tail & l->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	l->sq_tail++;
+	return sqe;
+}
+
+/*
+ * Hand the queued entries to the kernel and, if wait, wait up
+ * to a second for a completion
+ */
+static void submit(uloop *l, int wait)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned n = l->sq_tail - l->submitted;
+	int rc;
+
+	__atomic_store_n(l->sq_ktail, l->sq_tail, __ATOMIC_RELEASE);
+	if (wait)
+	{
+		ts.tv_sec = 1;
+		ts.tv_nsec = 0;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		rc = syscall(__NR_io_uring_enter, l->fd, n, 1,
+					 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+					 &arg, sizeof(arg));
+	}
+	else
+		rc = syscall(__NR_io_uring_enter, l->fd, n, 0, 0, NULL, 0);
+	l->st.enters++;
+
+	/* Timed out, interrupted, or completions to reap first */
+	if (rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY &&
+			errno != EAGAIN)
+		unix_error("io_uring_enter error");
+	if (rc > 0)
+	{
+		l->submitted += rc;
+		l->st.sqes += rc;
+	}
+}
+
+/*
+ * Accept connections of the listener until it fails
+ */
+static void queue_accept(uloop *l)
+{
+	struct io_uring_sqe *sqe = get_sqe(l);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = l->listenfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = ACCEPT_DATA;
+}
+
+/*
+ * Queue the next operation of a connection, on the buffers its
+ * state points to
+ */
+static void queue_op(uloop *l, uconn *c, int op)
+{
+	struct io_uring_sqe *sqe = get_sqe(l);
+
+	c->op = op;
+	sqe->user_data = (uint64_t)(uintptr_t)c;
+	switch (op)
+	{
+	case OP_RECV_CLIENT:
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = c->client;
+		sqe->addr = (uint64_t)(uintptr_t)(c->in + c->inlen);
+		sqe->len = MAXLINE - 1 - c->inlen;
+		break;
+
+	case OP_CONNECT:
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->fd = c->server;
+		sqe->addr = (uint64_t)(uintptr_t)&c->addr.addr;
+		sqe->off = c->addr.addrlen;
+		break;
+
+	case OP_SEND_SERVER:
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = c->server;
+		sqe->addr = (uint64_t)(uintptr_t)(c->request + c->reqsent);
+		sqe->len = c->reqlen - c->reqsent;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		break;
+
+	case OP_RECV_SERVER:
+		sqe->fd = c->server;
+		sqe->addr = (uint64_t)(uintptr_t)c->relay;
+		sqe->len = MAXBUF;
+		if (c->slot >= 0)
+		{
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->buf_index = c->slot;
+			l->st.fixed++;
+		}
+		else
+			sqe->opcode = IORING_OP_RECV;
+		break;
+
+	case OP_SEND_CLIENT:
+		sqe->fd = c->client;
+		sqe->addr = (uint64_t)(uintptr_t)(c->out + c->outsent);
+		sqe->len = c->outlen - c->outsent;
+		if (c->out == c->relay && c->slot >= 0)
+		{
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->buf_index = c->slot;
+			l->st.fixed++;
+		}
+		else
+		{
+			sqe->opcode = IORING_OP_SEND;
+			sqe->msg_flags = MSG_NOSIGNAL;
+		}
+		break;
+	}
+}
+
+/*
+ * Start reading the requests of a new client
+ */
+static void accepted(uloop *l, int fd)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	uconn *c = (uconn *)Calloc(1, sizeof(uconn));
+	int one = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->client = fd;
+	c->server = -1;
+	c->slot = -1;
+	c->last_active = l->now;
+	if (accesslog_enabled() && getpeername(fd, (SA *)&addr, &len) == 0 &&
+			addr.sin_family == AF_INET)
+		c->peer = addr.sin_addr.s_addr;
+
+	c->next = l->conns.next;
+	c->prev = &l->conns;
+	l->conns.next->prev = c;
+	l->conns.next = c;
+	next_request(l, c);
+}
+
+/*
+ * Take the result of the operation a connection had in flight
+ * and queue the next one
+ */
+static void complete(uloop *l, uconn *c, int res)
+{
+	fresh_info fi;
+	cache_meta meta;
+	int op = c->op;
+
+	c->op = OP_NONE;
+	c->last_active = l->now;
+	switch (op)
+	{
+	case OP_RECV_CLIENT:
+		if (res <= 0)
+		{
+			close_conn(l, c);
+			return;
+		}
+		c->inlen += res;
+		c->in[c->inlen] = '\0';
+		next_request(l, c);
+		return;
+
+	case OP_CONNECT:
+		if (res < 0)
+		{
+			dns_invalidate(c->host, c->port);
+			close_conn(l, c);
+			return;
+		}
+		metrics_since(METRIC_CONNECT, c->connecting);
+		queue_op(l, c, OP_SEND_SERVER);
+		return;
+
+	case OP_SEND_SERVER:
+		if (res <= 0)
+		{
+			close_conn(l, c);
+			return;
+		}
+		c->reqsent += res;
+		queue_op(l, c, c->reqsent < c->reqlen ? OP_SEND_SERVER :
+				 OP_RECV_SERVER);
+		return;
+
+	case OP_RECV_SERVER:
+		if (res < 0)
+		{
+			close_conn(l, c);
+			return;
+		}
+		if (res > 0)
+		{
+			/*
+			 * Keep a copy while it fits the max object size, and
+			 * the headers at least until their blank line was read
+			 */
+			if (c->fit_size || !c->head_seen)
+				growbuf_append(&c->copy, c->relay, res);
+			if (c->copy.len >= max_object_size)
+				c->fit_size = 0;
+			if (!c->head_seen && (c->copy.len >= MAXBUF ||
+					header_end(c->copy.data, c->copy.len) != NULL))
+			{
+				c->head_seen = 1;
+				c->has_length = response_delimited(c->copy.data, c->copy.len);
+				c->status = response_status(c->copy.data, c->copy.len);
+			}
+
+			c->out = c->relay;
+			c->outlen = res;
+			c->outsent = 0;
+			if (!c->first_sent)
+			{
+				metrics_since(METRIC_FIRST_BYTE, c->received);
+				c->first_sent = 1;
+			}
+			queue_op(l, c, OP_SEND_CLIENT);
+			return;
+		}
+
+		/* The server closed, the response is complete */
+		close_server(c);
+		if (c->fit_size && c->copy.len > 0)
+		{
+			/* Cache what the server said, not how it framed this hop */
+			c->copy.len = strip_hop_headers(c->copy.data, c->copy.len);
+			fresh_parse(&fi, c->copy.data, c->copy.len);
+			if (fresh_cacheable(&fi))
+			{
+				fresh_meta(&fi, time(NULL), &meta);
+				update_cache(web_cache, c->key, c->key_hash,
+							 c->copy.data, c->copy.len, &meta);
+			}
+		}
+		finish_response(l, c);
+		return;
+
+	case OP_SEND_CLIENT:
+		if (res <= 0)
+		{
+			close_conn(l, c);
+			return;
+		}
+		c->outsent += res;
+		c->sent += res;
+		if (c->outsent < c->outlen)
+			queue_op(l, c, OP_SEND_CLIENT);
+		else if (c->out == c->relay)
+			queue_op(l, c, OP_RECV_SERVER);
+		else
+			finish_response(l, c);
+		return;
+	}
+}
+
+/*
+ * Start the request at the start of the input buffer if it is
+ * all there, else read more of it
+ */
+static void next_request(uloop *l, uconn *c)
+{
+	int rc;
+
+	if (c->in == NULL)
+	{
+		c->in = (char *)Malloc(MAXLINE);
+		c->inlen = 0;
+		c->in[0] = '\0';
+	}
+	if ((rc = start_request(l, c)) < 0)
+		close_conn(l, c);
+	else if (rc == 0 && c->inlen >= MAXLINE - 1)
+		close_conn(l, c);	/* Request headers too large */
+	else if (rc == 0)
+		queue_op(l, c, OP_RECV_CLIENT);
+}
+
+/*
+ * Handle the request at the start of the input buffer: serve
+ * it from the proxy or the cache, or start connecting to the
+ * server. Return 0 if it is not all buffered yet, -1 if the
+ * connection should be closed.
+ */
+static int start_request(uloop *l, uconn *c)
+{
+	http_request req;
+	struct iovec iov[REQ_MAX_IOV];
+	dns_addr addrs[DNS_MAX_ADDRS];
+	uint64_t start = metrics_now();
+	int i, n, rc;
+
+	if ((rc = request_parse(c->in, c->inlen, &req)) <= 0)
+		return rc;
+	metrics_since(METRIC_PARSE, start);
+	c->received = start;
+	c->first_sent = 0;
+	c->uri = req.uri.p;
+	c->urilen = req.uri.n;
+	c->status = 0;
+	c->sent = 0;
+	c->consumed = req.len;
+	c->keepalive = req.keepalive;
+
+	/* The request is written from one flat copy */
+	c->request = (char *)Malloc(MAXLINE);
+	c->reqlen = request_flatten(iov, request_iov(&req, 0, iov),
+								c->request, MAXLINE);
+	c->key = (char *)Malloc(MAXLINE);
+	if (c->reqlen == 0 || request_key(&req, c->key, MAXLINE) == 0)
+		return -1;
+
+	c->outlen = c->outsent = 0;
+
+	/* Requests for the proxy itself */
+	if (slice_is(req.uri, "/__stats") ||
+		slice_is(req.uri, "/__stats?format=json") ||
+		slice_is(req.uri, "/__snapshot"))
+	{
+		c->local = (char *)Malloc(MAXBUF);
+		c->out = c->local;
+		c->outlen = slice_is(req.uri, "/__snapshot") ?
+			request_snapshot(c->local, MAXBUF) :
+			build_stats(c->local, MAXBUF,
+						slice_is(req.uri, "/__stats?format=json"));
+		c->has_length = 1;
+		c->status = response_status(c->local, c->outlen);
+		c->outcome = METRIC_LOCAL;
+		queue_op(l, c, OP_SEND_CLIENT);
+		return 1;
+	}
+
+	/* Cache hit: write the pinned node while it is fresh */
+	start = metrics_now();
+	c->key_hash = cache_hash(c->key);
+	c->cached = search_cache(web_cache, c->key, c->key_hash);
+	metrics_since(METRIC_LOOKUP, start);
+	if (c->cached != NULL && time(NULL) >= __atomic_load_n(
+			&c->cached->meta.fresh_until, __ATOMIC_RELAXED))
+	{
+		release_cache(c->cached);
+		c->cached = NULL;
+	}
+	if (c->cached != NULL)
+	{
+		c->out = c->cached->content;
+		c->outlen = c->cached->_size;
+		c->has_length = response_delimited(c->out, c->outlen);
+		c->status = response_status(c->out, c->outlen);
+		c->outcome = METRIC_HITS;
+		metrics_since(METRIC_FIRST_BYTE, c->received);
+		c->first_sent = 1;
+		queue_op(l, c, OP_SEND_CLIENT);
+		return 1;
+	}
+
+	/* Cache miss: connect to the first address of the server */
+	slice_copy(req.host, c->host);
+	sprintf(c->port, "%d", req.port);
+	c->connecting = metrics_now();
+	if ((n = dns_lookup(c->host, c->port, addrs, DNS_MAX_ADDRS)) < 0)
+		return -1;
+	for (i = 0; i < n && c->server < 0; i++)
+	{
+		c->server = socket(addrs[i].family, addrs[i].socktype,
+						   addrs[i].protocol);
+		c->addr = addrs[i];
+	}
+	if (c->server < 0)
+		return -1;
+
+	/* Relay through a registered buffer if one is free */
+	if (l->nfree > 0)
+	{
+		c->slot = l->free_slots[--l->nfree];
+		c->relay = l->slab + (size_t)c->slot * MAXBUF;
+	}
+	else
+		c->relay = (char *)Malloc(MAXBUF);
+	c->reqsent = 0;
+	growbuf_init(&c->copy);
+	c->fit_size = 1;
+	c->has_length = 0;
+	c->head_seen = 0;
+	c->outcome = METRIC_FETCHED;
+	queue_op(l, c, OP_CONNECT);
+	return 1;
+}
+
+/*
+ * Release what the finished response held. Keep the
+ * connection for the next request if possible, else close it.
+ */
+static void finish_response(uloop *l, uconn *c)
+{
+	answered(c, c->outcome);
+	free_response(l, c);
+	if (!c->keepalive || !c->has_length)
+	{
+		close_conn(l, c);
+		return;
+	}
+
+	/* Keep the pipelined requests behind this one */
+	c->inlen -= c->consumed;
+	memmove(c->in, c->in + c->consumed, c->inlen + 1);
+	c->consumed = 0;
+	if (c->inlen == 0)
+	{
+		free(c->in);
+		c->in = NULL;
+	}
+	next_request(l, c);
+}
+
+/*
+ * Count and log the request being answered, as done or cut off
+ */
+static void answered(uconn *c, metric_counter outcome)
+{
+	uint64_t ns = metrics_now() - c->received;
+
+	metrics_count(METRIC_REQUESTS);
+	metrics_count(outcome);
+	metrics_record(METRIC_TOTAL, ns);
+	accesslog_write(c->peer, c->uri, c->urilen, c->status, c->sent,
+					outcome, ns);
+	c->received = 0;
+}
+
+/*
+ * Free the buffers of the current response, giving its relay
+ * buffer back to the ring
+ */
+static void free_response(uloop *l, uconn *c)
+{
+	if (c->cached != NULL)
+	{
+		release_cache(c->cached);
+		c->cached = NULL;
+	}
+	if (c->slot >= 0)
+		l->free_slots[l->nfree++] = c->slot;
+	else
+		free(c->relay);
+	c->slot = -1;
+	free(c->local);
+	growbuf_free(&c->copy);
+	free(c->request);
+	free(c->key);
+	c->local = c->relay = c->request = c->key = NULL;
+	c->out = NULL;
+	c->outlen = c->outsent = 0;
+}
+
+/*
+ * Close the server side of a connection
+ */
+static void close_server(uconn *c)
+{
+	if (c->server >= 0)
+	{
+		close(c->server);
+		c->server = -1;
+	}
+}
+
+/*
+ * Close and free a connection, which has no operation in flight
+ */
+static void close_conn(uloop *l, uconn *c)
+{
+	if (c->received != 0)
+		answered(c, METRIC_FAILED);
+	close_server(c);
+	close(c->client);
+	free_response(l, c);
+	free(c->in);
+
+	c->prev->next = c->next;
+	c->next->prev = c->prev;
+	free(c);
+}
+
+/*
+ * Cancel the operation of connections that waited too long
+ * for it, whatever it is; it then fails and ends them
+ */
+static void sweep_idle(uloop *l)
+{
+	struct io_uring_sqe *sqe;
+	uconn *c;
+
+	for (c = l->conns.next; c != &l->conns; c = c->next)
+		if (c->op != OP_NONE &&
+				l->now - c->last_active > EVENT_IDLE_TIMEOUT)
+		{
+			sqe = get_sqe(l);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uint64_t)(uintptr_t)c;
+			sqe->user_data = CANCEL_DATA;
+			c->last_active = l->now;
+		}
+}
+
+/*
+ * Add what the ring counted to the totals
+ */
+static void add_stats(uloop *l)
+{
+	__atomic_fetch_add(&totals.enters, l->st.enters, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&totals.sqes, l->st.sqes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&totals.cqes, l->st.cqes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&totals.fixed, l->st.fixed, __ATOMIC_RELAXED);
+	memset(&l->st, 0, sizeof(l->st));
+}
@@ -0,0 +1,26 @@
+/*
+ * uring.h
+ * Name: Ti-Fen Pan
+ * Andrew ID: tpan
+ * Completion-driven (io_uring) mode of the proxy
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#define URING_ENTRIES 256		/* submission queue entries per ring */
+#define URING_SLOTS   512		/* registered relay buffers per ring */
+
+/* Statistics of all rings */
+typedef struct
+{
+	unsigned long enters;		/* io_uring_enter calls */
+	unsigned long sqes;			/* operations submitted */
+	unsigned long cqes;			/* completions handled */
+	unsigned long fixed;		/* of them on registered buffers */
+}uring_stats;
+
+void uring_run(char *port, int nrings);
+void get_uring_stats(uring_stats *st);
+
+#endif